@@ -0,0 +1,438 @@
+/*********************************************************************
+ *** FILE: arena.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// All the buffers the logger needs are sized at startup and carved out
+// of one block, so the memory it runs in is known before the first
+// sweep and never grows. Built with FRONIUS_SMALL (make small) the
+// program supplies its own malloc() family, the aligned allocators
+// included, so any heap allocation made after startup, by us or by the
+// C library, is counted or stops the program when asked to.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* INCLUDE FILES */
+#include "arena.h"
+
+/* STATIC VARIABLES */
+static arena_t arena;
+
+// Ends of the program's initialised data and bss, from the linker
+extern char etext, edata, end;
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: arenaInit
+ ***
+ *** DESCRIPTION:
+ ***   Map the arena. Every page is touched now, so it's all resident
+ ***   from the start rather than faulted in during the day.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int arenaInit(size_t size)
+{
+    void *mem;
+
+    size = ARENA_ROUND(size);
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        printf("arena: can't map %lu bytes\n", (unsigned long)size);
+        return 0;
+    }
+
+    arena.base = mem;
+    arena.size = size;
+    arena.used = 0;
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: arenaAlloc
+ ***
+ *** DESCRIPTION:
+ ***   Hand out a zeroed block of the arena.
+ ***
+ *** RETURN VALUE:
+ ***   The block, NULL if the arena wasn't sized for it.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *arenaAlloc(size_t size)
+{
+    void *p;
+
+    size = ARENA_ROUND(size);
+    if (arena.used + size > arena.size)
+    {
+        printf("arena: %lu bytes asked for, %lu left\n", (unsigned long)size,
+               (unsigned long)(arena.size - arena.used));
+        return NULL;
+    }
+
+    p = arena.base + arena.used;
+    arena.used += size;
+
+    return p;
+}
+
+/*********************************************************************
+ *** FUNCTION: arenaCount
+ ***
+ *** DESCRIPTION:
+ ***   Count a block that was set aside at startup but isn't in the
+ ***   arena, such as the checkpoint mapping, in the budget.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void arenaCount(size_t size)
+{
+    arena.mapped += size;
+}
+
+/*********************************************************************
+ *** FUNCTION: arenaSeal
+ ***
+ *** DESCRIPTION:
+ ***   Mark the end of startup. From here on nothing should come from
+ ***   the heap.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   In the small build, heap allocations are counted from now on,
+ ***   and abort the program if fatal is set.
+ *********************************************************************/
+void arenaSeal(int fatal)
+{
+    arena.fatal = fatal;
+    arena.heapAllocs = 0;
+    arena.sealed = 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: readStatus
+ ***
+ *** DESCRIPTION:
+ ***   Get a figure from /proc/self/status. Read with plain system calls
+ ***   so as not to need a FILE.
+ ***
+ *** RETURN VALUE:
+ ***   The figure in kB, 0 if it isn't there.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static unsigned long readStatus(const char *name)
+{
+    char buf[2048];
+    char *p;
+    int fd;
+    int len;
+
+    fd = open("/proc/self/status", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    p = strstr(buf, name);
+    if (p == NULL)
+        return 0;
+
+    return strtoul(p + strlen(name), NULL, 10);
+}
+
+/*********************************************************************
+ *** FUNCTION: arenaReport
+ ***
+ *** DESCRIPTION:
+ ***   Print the memory budget, the arena, the blocks counted with it
+ ***   and the program's static data, next to what the kernel says is
+ ***   resident. Shared libraries and stacks come on top.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void arenaReport(const char *when)
+{
+    size_t data = &edata - &etext;
+    size_t bss  = &end - &edata;
+
+    printf("Memory %s: arena %lu of %lu bytes used, mapped %lu bytes, data %lu bytes, "
+           "bss %lu bytes, budget %lu kB\n", when, (unsigned long)arena.used,
+           (unsigned long)arena.size, (unsigned long)arena.mapped, (unsigned long)data,
+           (unsigned long)bss,
+           (unsigned long)((arena.size + arena.mapped + data + bss + 1023) / 1024));
+    printf("Memory %s: resident %lu kB, peak %lu kB, %lu heap allocations since "
+           "startup\n", when, readStatus("VmRSS:"), readStatus("VmHWM:"),
+           arena.heapAllocs);
+}
+
+#ifdef FRONIUS_SMALL
+/*********************************************************************
+ *** FUNCTION: heapUsed
+ ***
+ *** DESCRIPTION:
+ ***   Called for every heap allocation in the small build.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Aborts the program if the arena is sealed and that was asked for.
+ ***   The message is written directly, stdio may be what's allocating.
+ *********************************************************************/
+static void heapUsed(const char *what)
+{
+    if (!arena.sealed)
+        return;
+
+    __sync_fetch_and_add(&arena.heapAllocs, 1);
+    if (arena.fatal)
+    {
+        write(2, what, strlen(what));
+        write(2, " after startup\n", 15);
+        abort();
+    }
+}
+
+// glibc's own allocator, which the versions below hand on to
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+void  __libc_free(void *p);
+
+/*********************************************************************
+ *** FUNCTION: malloc
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's malloc() for the whole program, the C
+ ***   library included, so stdio and the like get caught too.
+ ***
+ *** RETURN VALUE:
+ ***   As malloc().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *malloc(size_t size)
+{
+    heapUsed("malloc");
+    return __libc_malloc(size);
+}
+
+/*********************************************************************
+ *** FUNCTION: calloc
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's calloc().
+ ***
+ *** RETURN VALUE:
+ ***   As calloc().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *calloc(size_t count, size_t size)
+{
+    heapUsed("calloc");
+    return __libc_calloc(count, size);
+}
+
+/*********************************************************************
+ *** FUNCTION: realloc
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's realloc().
+ ***
+ *** RETURN VALUE:
+ ***   As realloc().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *realloc(void *p, size_t size)
+{
+    heapUsed("realloc");
+    return __libc_realloc(p, size);
+}
+
+/*********************************************************************
+ *** FUNCTION: memalign
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's memalign(). It and the other aligned
+ ***   allocators below get to the heap without going through malloc(),
+ ***   so each has to be caught itself.
+ ***
+ *** RETURN VALUE:
+ ***   As memalign().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *memalign(size_t align, size_t size)
+{
+    heapUsed("memalign");
+    return __libc_memalign(align, size);
+}
+
+/*********************************************************************
+ *** FUNCTION: posix_memalign
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's posix_memalign(), which has no __libc_
+ ***   version of its own to hand on to.
+ ***
+ *** RETURN VALUE:
+ ***   As posix_memalign().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int posix_memalign(void **pp, size_t align, size_t size)
+{
+    void *p;
+
+    heapUsed("posix_memalign");
+    if ((align % sizeof(void *) != 0) || ((align & (align - 1)) != 0) || (align == 0))
+        return EINVAL;
+    p = __libc_memalign(align, size);
+    if (p == NULL)
+        return ENOMEM;
+    *pp = p;
+    return 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: aligned_alloc
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's aligned_alloc().
+ ***
+ *** RETURN VALUE:
+ ***   As aligned_alloc().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *aligned_alloc(size_t align, size_t size)
+{
+    heapUsed("aligned_alloc");
+    return __libc_memalign(align, size);
+}
+
+/*********************************************************************
+ *** FUNCTION: valloc
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's valloc().
+ ***
+ *** RETURN VALUE:
+ ***   As valloc().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *valloc(size_t size)
+{
+    heapUsed("valloc");
+    return __libc_valloc(size);
+}
+
+/*********************************************************************
+ *** FUNCTION: pvalloc
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's pvalloc().
+ ***
+ *** RETURN VALUE:
+ ***   As pvalloc().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void *pvalloc(size_t size)
+{
+    heapUsed("pvalloc");
+    return __libc_pvalloc(size);
+}
+
+/*********************************************************************
+ *** FUNCTION: free
+ ***
+ *** DESCRIPTION:
+ ***   Replaces the C library's free(), which has to go with the rest.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void free(void *p)
+{
+    __libc_free(p);
+}
+#endif // FRONIUS_SMALL
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
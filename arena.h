@@ -0,0 +1,55 @@
+/*********************************************************************
+ *** FILE: arena.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stddef.h>
+
+/* DEFINES */
+
+// Every block handed out starts on a cache line
+#define ARENA_ALIGN         64
+#define ARENA_ROUND(n)      (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* TYPEDEFS */
+
+// One block of memory, mapped and touched at startup, that all the
+// buffers are carved out of. Nothing is ever given back.
+typedef struct
+{
+    unsigned char *base;
+    size_t         size;
+    size_t         used;
+    size_t         mapped;      // Blocks kept elsewhere, counted in the budget
+    int            sealed;      // Set once startup is over
+    int            fatal;       // Abort on a heap allocation once sealed
+    unsigned long  heapAllocs;  // Heap allocations since it was sealed
+} arena_t;
+
+/* FUNCTION PROTOTYPES */
+int   arenaInit(size_t size);
+void *arenaAlloc(size_t size);
+void  arenaCount(size_t size);
+void  arenaSeal(int fatal);
+void  arenaReport(const char *when);
+
+#endif // ARENA_H
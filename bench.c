@@ -0,0 +1,1159 @@
+/*********************************************************************
+ *** FILE: bench.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// Storage benchmark (make bench). Pushes made up sweeps for 1 to 64
+// inverters at 1, 10 and 60 second intervals through each way we have
+// of storing them, with day directories rotated as the logger does,
+// and reports for each:
+//
+//   B/smp      bytes on disk per sample (one inverter's sweep)
+//   wr/smp     write system calls per sample, from /proc/self/io
+//   p99 us     99th percentile time to append a sample
+//   sync us    the same with fdatasync() after every sample
+//   MB/yr      disk used by a year of samples
+//   scan s/yr  time to read back and parse a year, page cache dropped
+//
+// A year of 1 s samples from 64 inverters is two billion rows, so only
+// -n rows are written for each and the year figures are scaled up.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+/* INCLUDE FILES */
+#include "csv.h"
+#include "rotate.h"
+#include "binlog.h"
+
+/* DEFINES */
+
+// Where the files go, and how many rows each run writes
+#define BENCH_DIR           "/tmp/fronius-bench"
+#define BENCH_ROWS          100000
+#define BENCH_SYNC_ROWS     200
+
+// Values in a sweep, as main() polls them. The last 11 (phases and
+// fans) aren't there on a small single phase inverter.
+#define BENCH_METRICS       38
+#define BENCH_PRESENT       27
+
+#define BENCH_MAX_INV       64
+
+// Buffer each inverter gets in the buffered writer
+#define BENCH_BUF_SIZE      (64 * 1024)
+
+// Bytes read at a time when scanning
+#define BENCH_READ_SIZE     (64 * 1024)
+
+// Simulated time starts at 2026-01-01 00:00 UTC
+#define BENCH_START         1767225600
+
+#define YEAR_SECS           (365.0 * 86400)
+
+/* TYPEDEFS */
+
+typedef struct bench_s bench_t;
+
+// One way of storing samples. open() and close() are called for every
+// day directory.
+typedef struct
+{
+    const char *name;
+    int  (*open)(bench_t *b);
+    void (*append)(bench_t *b, int inv, time_t t, const struct tm *lt, const float *v);
+    void (*sync)(bench_t *b, int inv);
+    void (*close)(bench_t *b);
+    long (*scan)(bench_t *b, int dirFd, double *sum);
+} backend_t;
+
+struct bench_s
+{
+    const backend_t *be;
+    rotator_t rot;
+    int       inverters;
+    FILE     *f[BENCH_MAX_INV];     // fprintf
+    int       fd[BENCH_MAX_INV];    // csv, csv-buf
+    char     *buf[BENCH_MAX_INV];   // csv-buf
+    int       bufLen[BENCH_MAX_INV];
+    csvRow_t  row;
+    binlog_t  bin;                  // binlog
+    char    (*days)[16];            // Day directories written to
+    int       dayCount;
+    int       dayMax;
+    char      scanBuf[BENCH_READ_SIZE + 1];
+};
+
+/* FUNCTION PROTOTYPES */
+static int  csvOpen(bench_t *b);
+static void csvClose(bench_t *b);
+static long csvScan(bench_t *b, int dirFd, double *sum);
+static int  stdioOpen(bench_t *b);
+static void stdioAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                        const float *v);
+static void stdioSync(bench_t *b, int inv);
+static void stdioClose(bench_t *b);
+static void csvAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                      const float *v);
+static void csvSync(bench_t *b, int inv);
+static void bufAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                      const float *v);
+static void bufSync(bench_t *b, int inv);
+static void bufClose(bench_t *b);
+static int  binOpen(bench_t *b);
+static void binAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                      const float *v);
+static void binSync(bench_t *b, int inv);
+static void binClose(bench_t *b);
+static long binScan(bench_t *b, int dirFd, double *sum);
+
+/* STATIC VARIABLES */
+
+static const backend_t backends[] =
+{
+    // The CSV path as main() first had it: fprintf() per value, fflush()
+    // per row
+    { "fprintf", stdioOpen, stdioAppend, stdioSync, stdioClose, csvScan },
+
+    // The CSV path as it is now: the row is formatted in a csvRow_t and
+    // written with one write()
+    { "csv",     csvOpen,   csvAppend,   csvSync,   csvClose,   csvScan },
+
+    // The same rows, kept in a buffer per file and written when it fills
+    { "csv-buf", csvOpen,   bufAppend,   bufSync,   bufClose,   csvScan },
+
+    // data.bin, one record per value, written once per sample
+    { "binlog",  binOpen,   binAppend,   binSync,   binClose,   binScan },
+};
+
+#define BACKEND_COUNT (sizeof(backends)/sizeof(backends[0]))
+
+static const int intervals[] = { 1, 10, 60 };
+static const int inverterCounts[] = { 1, 4, 16, 64 };
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: usage
+ ***
+ *** DESCRIPTION:
+ ***   Print help about the command line arguments, then exit
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void usage(const char *argv0)
+{
+    printf("usage: %s [-d dir] [-n rows] [-S rows] [-b backend] [-k]\n", argv0);
+    printf("       dir     = scratch directory (default %s)\n", BENCH_DIR);
+    printf("       -n      = rows written for each run (default %d)\n", BENCH_ROWS);
+    printf("       -S      = rows written with fdatasync() after each (default %d)\n",
+           BENCH_SYNC_ROWS);
+    printf("       backend = only run this one\n");
+    printf("       -k      = keep the files written\n");
+    exit(0);
+}
+
+/*********************************************************************
+ *** FUNCTION: nowNs
+ ***
+ *** DESCRIPTION:
+ ***   Read the monotonic clock.
+ ***
+ *** RETURN VALUE:
+ ***   Time in ns.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*********************************************************************
+ *** FUNCTION: writeSyscalls
+ ***
+ *** DESCRIPTION:
+ ***   Get the number of write system calls made so far, which catches
+ ***   the ones stdio makes inside the C library too.
+ ***
+ *** RETURN VALUE:
+ ***   The count, 0 if /proc/self/io can't be read.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static unsigned long long writeSyscalls(void)
+{
+    char buf[512];
+    char *p;
+    int fd, len;
+
+    fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+
+    p = strstr(buf, "syscw:");
+    return (p == NULL) ? 0 : strtoull(p + 6, NULL, 10);
+}
+
+/*********************************************************************
+ *** FUNCTION: makeSample
+ ***
+ *** DESCRIPTION:
+ ***   Make up one inverter's sweep at time t: a power curve over the
+ ***   day with some noise, and the other values roughly in step.
+ ***
+ *** RETURN VALUE:
+ ***   None. The values are returned in v.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void makeSample(int inv, time_t t, float *v)
+{
+    static unsigned int seed = 12345;
+    double hour = (t % 86400) / 3600.0;
+    double sun = sin((hour - 6) * M_PI / 12);
+    float power;
+    int m;
+
+    seed = seed * 1103515245 + 12345;
+    power = (sun > 0) ? sun * (2500 + inv * 10) + ((seed >> 16) % 50) : 0;
+    power = floorf(power * 10) / 10;
+
+    v[0] = power;
+    for (m=1; m<BENCH_PRESENT; m++)
+        v[m] = floorf((power * (m % 7 + 1) / 10 + m * 17.3) * 10) / 10;
+    for ( ; m<BENCH_METRICS; m++)
+        v[m] = NAN;
+}
+
+/*********************************************************************
+ *** FUNCTION: invName
+ ***
+ *** DESCRIPTION:
+ ***   Name of the CSV file for an inverter.
+ ***
+ *** RETURN VALUE:
+ ***   None. The name is returned in name.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void invName(int inv, char *name, int size)
+{
+    snprintf(name, size, "data%02d.csv", inv);
+}
+
+/*********************************************************************
+ *** FUNCTION: stdioOpen
+ ***
+ *** DESCRIPTION:
+ ***   Open a CSV file per inverter in today's directory with fopen().
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int stdioOpen(bench_t *b)
+{
+    char name[16];
+    int i, fd;
+
+    for (i=0; i<b->inverters; i++)
+    {
+        invName(i, name, sizeof(name));
+        fd = rotOpen(&b->rot, name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        b->f[i] = (fd < 0) ? NULL : fdopen(fd, "a");
+        if (b->f[i] == NULL)
+        {
+            printf("open(%s) failed: %s\n", name, strerror(errno));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: stdioAppend
+ ***
+ *** DESCRIPTION:
+ ***   Write a row the way main() first did.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void stdioAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                        const float *v)
+{
+    FILE *f = b->f[inv];
+    int m;
+
+    fprintf(f, "%d-%02d-%02d %02d:%02d:%02d,", lt->tm_year+1900, lt->tm_mon+1,
+            lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec);
+    for (m=0; m<BENCH_METRICS; m++)
+    {
+        if (isnan(v[m]))
+            fprintf(f, ",");
+        else
+            fprintf(f, "%g,", v[m]);
+    }
+    fprintf(f, "\n");
+    fflush(f);
+}
+
+/*********************************************************************
+ *** FUNCTION: stdioSync
+ ***
+ *** DESCRIPTION:
+ ***   Force an inverter's file out to disk.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void stdioSync(bench_t *b, int inv)
+{
+    fflush(b->f[inv]);
+    fdatasync(fileno(b->f[inv]));
+}
+
+/*********************************************************************
+ *** FUNCTION: stdioClose
+ ***
+ *** DESCRIPTION:
+ ***   Close the files.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void stdioClose(bench_t *b)
+{
+    int i;
+
+    for (i=0; i<b->inverters; i++)
+    {
+        if (b->f[i] != NULL)
+            fclose(b->f[i]);
+        b->f[i] = NULL;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: csvOpen
+ ***
+ *** DESCRIPTION:
+ ***   Open a CSV file per inverter in today's directory.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int csvOpen(bench_t *b)
+{
+    char name[16];
+    int i;
+
+    for (i=0; i<b->inverters; i++)
+    {
+        invName(i, name, sizeof(name));
+        b->fd[i] = rotOpen(&b->rot, name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (b->fd[i] < 0)
+        {
+            printf("open(%s) failed: %s\n", name, strerror(errno));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: formatRow
+ ***
+ *** DESCRIPTION:
+ ***   Build a row the way main() does.
+ ***
+ *** RETURN VALUE:
+ ***   None. The row is left in b->row.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void formatRow(bench_t *b, const struct tm *lt, const float *v)
+{
+    int m;
+
+    csvBegin(&b->row);
+    csvTimestamp(&b->row, lt);
+    for (m=0; m<BENCH_METRICS; m++)
+    {
+        if (isnan(v[m]))
+            csvEmpty(&b->row);
+        else
+            csvValue(&b->row, v[m]);
+    }
+    csvEnd(&b->row);
+}
+
+/*********************************************************************
+ *** FUNCTION: csvAppend
+ ***
+ *** DESCRIPTION:
+ ***   Write a row with one write().
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void csvAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                      const float *v)
+{
+    formatRow(b, lt, v);
+    csvWrite(&b->row, b->fd[inv]);
+}
+
+/*********************************************************************
+ *** FUNCTION: csvSync
+ ***
+ *** DESCRIPTION:
+ ***   Force an inverter's file out to disk.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void csvSync(bench_t *b, int inv)
+{
+    fdatasync(b->fd[inv]);
+}
+
+/*********************************************************************
+ *** FUNCTION: csvClose
+ ***
+ *** DESCRIPTION:
+ ***   Close the files.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void csvClose(bench_t *b)
+{
+    int i;
+
+    for (i=0; i<b->inverters; i++)
+    {
+        if (b->fd[i] >= 0)
+            close(b->fd[i]);
+        b->fd[i] = -1;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: bufFlush
+ ***
+ *** DESCRIPTION:
+ ***   Write out what's buffered for an inverter.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void bufFlush(bench_t *b, int inv)
+{
+    if (b->bufLen[inv] > 0)
+    {
+        if (write(b->fd[inv], b->buf[inv], b->bufLen[inv]) != b->bufLen[inv])
+            printf("write failed: %s\n", strerror(errno));
+    }
+    b->bufLen[inv] = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: bufAppend
+ ***
+ *** DESCRIPTION:
+ ***   Add a row to the inverter's buffer, writing the buffer out
+ ***   first if it won't fit.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void bufAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                      const float *v)
+{
+    formatRow(b, lt, v);
+    if (b->bufLen[inv] + b->row.len > BENCH_BUF_SIZE)
+        bufFlush(b, inv);
+    memcpy(b->buf[inv] + b->bufLen[inv], b->row.buf, b->row.len);
+    b->bufLen[inv] += b->row.len;
+}
+
+/*********************************************************************
+ *** FUNCTION: bufSync
+ ***
+ *** DESCRIPTION:
+ ***   Write out an inverter's buffer and force it to disk.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void bufSync(bench_t *b, int inv)
+{
+    bufFlush(b, inv);
+    fdatasync(b->fd[inv]);
+}
+
+/*********************************************************************
+ *** FUNCTION: bufClose
+ ***
+ *** DESCRIPTION:
+ ***   Write out the buffers and close the files.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void bufClose(bench_t *b)
+{
+    int i;
+
+    for (i=0; i<b->inverters; i++)
+    {
+        if (b->fd[i] >= 0)
+            bufFlush(b, i);
+    }
+    csvClose(b);
+}
+
+/*********************************************************************
+ *** FUNCTION: binOpen
+ ***
+ *** DESCRIPTION:
+ ***   Open today's data.bin, shared by all the inverters.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int binOpen(bench_t *b)
+{
+    return binlogOpen(&b->bin, &b->rot);
+}
+
+/*********************************************************************
+ *** FUNCTION: binAppend
+ ***
+ *** DESCRIPTION:
+ ***   Write a record per value, as main() does with -B.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void binAppend(bench_t *b, int inv, time_t t, const struct tm *lt,
+                      const float *v)
+{
+    frStamp_t at;
+    int m;
+
+    at.real.tv_sec  = t;
+    at.real.tv_nsec = 0;
+    at.mono = at.real;
+    for (m=0; m<BENCH_METRICS; m++)
+    {
+        if (!isnan(v[m]))
+            binlogAdd(&b->bin, inv + 1, m, 0, v[m], &at);
+    }
+    binlogFlush(&b->bin);
+}
+
+/*********************************************************************
+ *** FUNCTION: binSync
+ ***
+ *** DESCRIPTION:
+ ***   Force data.bin out to disk.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void binSync(bench_t *b, int inv)
+{
+    fdatasync(b->bin.fd);
+}
+
+/*********************************************************************
+ *** FUNCTION: binClose
+ ***
+ *** DESCRIPTION:
+ ***   Close data.bin.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void binClose(bench_t *b)
+{
+    binlogClose(&b->bin);
+}
+
+/*********************************************************************
+ *** FUNCTION: openCold
+ ***
+ *** DESCRIPTION:
+ ***   Open a file to scan, asking the kernel to drop it from the page
+ ***   cache first so it's read from the disk.
+ ***
+ *** RETURN VALUE:
+ ***   File descriptor, -1 if there's no such file.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int openCold(int dirFd, const char *name)
+{
+    int fd = openat(dirFd, name, O_RDONLY);
+
+    if (fd >= 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    return fd;
+}
+
+/*********************************************************************
+ *** FUNCTION: csvScan
+ ***
+ *** DESCRIPTION:
+ ***   Read back and parse every CSV file in a day directory.
+ ***
+ *** RETURN VALUE:
+ ***   Number of values read. Their sum is added to sum.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static long csvScan(bench_t *b, int dirFd, double *sum)
+{
+    char name[16];
+    char *line, *nl, *p, *end;
+    long values = 0;
+    int fd, i, r;
+    int len;
+
+    for (i=0; i<b->inverters; i++)
+    {
+        invName(i, name, sizeof(name));
+        fd = openCold(dirFd, name);
+        if (fd < 0)
+            continue;
+
+        len = 0;
+        while ((r = read(fd, b->scanBuf + len, BENCH_READ_SIZE - len)) > 0)
+        {
+            len += r;
+            b->scanBuf[len] = '\0';
+
+            for (line = b->scanBuf; (nl = strchr(line, '\n')) != NULL; line = nl + 1)
+            {
+                *nl = '\0';
+
+                // Skip the timestamp, then every non-empty field
+                p = strchr(line, ',');
+                while ((p != NULL) && (*++p != '\0'))
+                {
+                    if (*p != ',')
+                    {
+                        *sum += strtof(p, &end);
+                        values++;
+                        p = end;
+                    }
+                    if (*p != ',')
+                        break;
+                }
+            }
+
+            len -= line - b->scanBuf;
+            memmove(b->scanBuf, line, len);
+        }
+        close(fd);
+    }
+
+    return values;
+}
+
+/*********************************************************************
+ *** FUNCTION: binScan
+ ***
+ *** DESCRIPTION:
+ ***   Read back every record of data.bin in a day directory.
+ ***
+ *** RETURN VALUE:
+ ***   Number of values read. Their sum is added to sum.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static long binScan(bench_t *b, int dirFd, double *sum)
+{
+    binlogFileHeader_t hdr;
+    binlogRecord_t *rec;
+    long values = 0;
+    int fd, r, n, i;
+    int len = 0;
+
+    fd = openCold(dirFd, BINLOG_FILENAME);
+    if (fd < 0)
+        return 0;
+
+    if ((read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) || (hdr.magic != BINLOG_MAGIC))
+    {
+        close(fd);
+        return 0;
+    }
+    lseek(fd, hdr.headerSize, SEEK_SET);
+
+    while ((r = read(fd, b->scanBuf + len, BENCH_READ_SIZE - len)) > 0)
+    {
+        len += r;
+        n = len / sizeof(binlogRecord_t);
+        rec = (binlogRecord_t *)b->scanBuf;
+        for (i=0; i<n; i++)
+            *sum += rec[i].value;
+        values += n;
+
+        len -= n * sizeof(binlogRecord_t);
+        memmove(b->scanBuf, b->scanBuf + n * sizeof(binlogRecord_t), len);
+    }
+    close(fd);
+
+    return values;
+}
+
+/*********************************************************************
+ *** FUNCTION: cmpNs
+ ***
+ *** DESCRIPTION:
+ ***   qsort() comparison for latencies.
+ ***
+ *** RETURN VALUE:
+ ***   <0, 0 or >0.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int cmpNs(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*********************************************************************
+ *** FUNCTION: writeRows
+ ***
+ *** DESCRIPTION:
+ ***   Push rows samples through the backend, rotating day directories
+ ***   as the simulated time goes by, optionally syncing after each.
+ ***
+ *** RETURN VALUE:
+ ***   The 99th percentile append time in ns, -1 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   Records the day directories written to in b->days.
+ *********************************************************************/
+static int64_t writeRows(bench_t *b, int interval, long rows, int sync, int64_t *lat)
+{
+    float v[BENCH_METRICS];
+    char (*days)[16];
+    int dayMax;
+    struct tm lt;
+    time_t t = BENCH_START;
+    long n = 0;
+    int opened = 0;
+    int inv, r;
+    int64_t start;
+
+    b->dayCount = 0;
+    while (n < rows)
+    {
+        r = rotCheck(&b->rot, t);
+        if (r < 0)
+            return -1;
+        if ((r > 0) || !opened)
+        {
+            if (opened)
+                b->be->close(b);
+            if (b->be->open(b) == 0)
+                return -1;
+            opened = 1;
+
+            if (b->dayCount == b->dayMax)
+            {
+                dayMax = b->dayMax ? b->dayMax * 2 : 64;
+                days = realloc(b->days, dayMax * sizeof(b->days[0]));
+                if (days == NULL)
+                {
+                    printf("Out of memory\n");
+                    b->be->close(b);
+                    return -1;
+                }
+                b->days = days;
+                b->dayMax = dayMax;
+            }
+            snprintf(b->days[b->dayCount++], sizeof(b->days[0]), "%04d/%02d/%02d",
+                     b->rot.year, b->rot.mon, b->rot.mday);
+        }
+
+        rotLocalTime(&b->rot, t, &lt);
+        for (inv=0; (inv < b->inverters) && (n < rows); inv++, n++)
+        {
+            makeSample(inv, t, v);
+            start = nowNs();
+            b->be->append(b, inv, t, &lt, v);
+            if (sync)
+                b->be->sync(b, inv);
+            lat[n] = nowNs() - start;
+        }
+        t += interval;
+    }
+    if (opened)
+        b->be->close(b);
+
+    qsort(lat, rows, sizeof(lat[0]), cmpNs);
+    return lat[rows * 99 / 100];
+}
+
+/*********************************************************************
+ *** FUNCTION: diskBytes
+ ***
+ *** DESCRIPTION:
+ ***   Add up the size of the files in the day directories written to.
+ ***
+ *** RETURN VALUE:
+ ***   Total size in bytes.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static long long diskBytes(bench_t *b)
+{
+    struct stat statbuf;
+    char path[48];
+    char name[16];
+    long long total = 0;
+    int d, i;
+
+    for (d=0; d<b->dayCount; d++)
+    {
+        for (i=0; i<b->inverters; i++)
+        {
+            invName(i, name, sizeof(name));
+            snprintf(path, sizeof(path), "%s/%s", b->days[d], name);
+            if (fstatat(b->rot.rootFd, path, &statbuf, 0) == 0)
+                total += statbuf.st_size;
+        }
+        snprintf(path, sizeof(path), "%s/%s", b->days[d], BINLOG_FILENAME);
+        if (fstatat(b->rot.rootFd, path, &statbuf, 0) == 0)
+            total += statbuf.st_size;
+    }
+
+    return total;
+}
+
+/*********************************************************************
+ *** FUNCTION: removeDays
+ ***
+ *** DESCRIPTION:
+ ***   Delete the files written, so the next run starts clean.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void removeDays(bench_t *b)
+{
+    char path[48];
+    char name[16];
+    int d, i;
+
+    for (d=0; d<b->dayCount; d++)
+    {
+        for (i=0; i<b->inverters; i++)
+        {
+            invName(i, name, sizeof(name));
+            snprintf(path, sizeof(path), "%s/%s", b->days[d], name);
+            unlinkat(b->rot.rootFd, path, 0);
+        }
+        snprintf(path, sizeof(path), "%s/%s", b->days[d], BINLOG_FILENAME);
+        unlinkat(b->rot.rootFd, path, 0);
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: scanDays
+ ***
+ *** DESCRIPTION:
+ ***   Read back everything written, timed.
+ ***
+ *** RETURN VALUE:
+ ***   Time taken in seconds.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static double scanDays(bench_t *b, long *values)
+{
+    double sum = 0;
+    int64_t start;
+    int d, fd;
+
+    sync();
+
+    *values = 0;
+    start = nowNs();
+    for (d=0; d<b->dayCount; d++)
+    {
+        fd = openat(b->rot.rootFd, b->days[d], O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+            continue;
+        *values += b->be->scan(b, fd, &sum);
+        close(fd);
+    }
+
+    return (nowNs() - start) / 1e9;
+}
+
+/*********************************************************************
+ *** FUNCTION: main
+ ***
+ *** DESCRIPTION:
+ ***   Run every backend over every interval and inverter count.
+ ***
+ *** RETURN VALUE:
+ ***   0 for success, 1 if a run failed.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int main(int argc, char *argv[])
+{
+    static bench_t b;
+    const char *dir = BENCH_DIR;
+    const char *only = NULL;
+    long rows = BENCH_ROWS;
+    long syncRows = BENCH_SYNC_ROWS;
+    int keep = 0;
+    int64_t *lat;
+    int64_t p99, p99Sync;
+    unsigned long long writes;
+    long long bytes;
+    long values;
+    double scanSecs, yearRows;
+    int i, k, n, iv;
+
+    for (i=0; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-d") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                dir = argv[i+1];
+        }
+        if (strcmp(argv[i], "-n") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                rows = atol(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-S") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                syncRows = atol(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-b") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                only = argv[i+1];
+        }
+        if (strcmp(argv[i], "-k") == 0)
+        {
+            keep = 1;
+        }
+        if (strcmp(argv[i], "-h") == 0)
+        {
+            usage(argv[0]);
+        }
+    }
+    if (rows < 1)
+        rows = 1;
+    if (syncRows < 1)
+        syncRows = 1;
+
+    if (rotInit(&b.rot, dir) == 0)
+        return 1;
+    binlogInit(&b.bin);
+    for (i=0; i<BENCH_MAX_INV; i++)
+    {
+        b.fd[i] = -1;
+        b.buf[i] = malloc(BENCH_BUF_SIZE);
+        if (b.buf[i] == NULL)
+        {
+            printf("Out of memory\n");
+            return 1;
+        }
+    }
+    lat = malloc(((rows > syncRows) ? rows : syncRows) * sizeof(lat[0]));
+    if (lat == NULL)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    printf("%ld rows per run, %ld with fdatasync(). A sample is one inverter's "
+           "sweep of %d values.\n\n", rows, syncRows, BENCH_METRICS);
+    printf("%-8s %5s %4s %8s %7s %8s %9s %9s %10s\n", "backend", "secs", "inv",
+           "B/smp", "wr/smp", "p99 us", "sync us", "MB/yr", "scan s/yr");
+
+    for (k=0; k<BACKEND_COUNT; k++)
+    {
+        b.be = &backends[k];
+        if ((only != NULL) && (strcmp(only, b.be->name) != 0))
+            continue;
+
+        for (iv=0; iv<sizeof(intervals)/sizeof(intervals[0]); iv++)
+        {
+            for (n=0; n<sizeof(inverterCounts)/sizeof(inverterCounts[0]); n++)
+            {
+                b.inverters = inverterCounts[n];
+                yearRows = YEAR_SECS / intervals[iv] * b.inverters;
+
+                // Latency with fdatasync() after every sample, on its own
+                // so the slow part is kept short
+                p99Sync = writeRows(&b, intervals[iv], syncRows, 1, lat);
+                removeDays(&b);
+
+                writes = writeSyscalls();
+                p99 = writeRows(&b, intervals[iv], rows, 0, lat);
+                writes = writeSyscalls() - writes;
+                if ((p99 < 0) || (p99Sync < 0))
+                    return 1;
+
+                bytes = diskBytes(&b);
+                scanSecs = scanDays(&b, &values);
+                if (!keep)
+                    removeDays(&b);
+
+                printf("%-8s %5d %4d %8.1f %7.3f %8.1f %9.1f %9.0f %10.1f\n",
+                       b.be->name, intervals[iv], b.inverters, (double)bytes / rows,
+                       (double)writes / rows, p99 / 1e3, p99Sync / 1e3,
+                       bytes * (yearRows / rows) / 1e6, scanSecs * (yearRows / rows));
+                fflush(stdout);
+
+                if (values < rows * BENCH_PRESENT)
+                    printf("         only %ld of %ld values read back\n", values,
+                           rows * BENCH_PRESENT);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
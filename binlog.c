@@ -0,0 +1,211 @@
+/*********************************************************************
+ *** FILE: binlog.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* INCLUDE FILES */
+#include "binlog.h"
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: binlogInit
+ ***
+ *** DESCRIPTION:
+ ***   Set up a binary data file that isn't open yet.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void binlogInit(binlog_t *bl)
+{
+    bl->fd = -1;
+    bl->count = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: binlogOpen
+ ***
+ *** DESCRIPTION:
+ ***   Open the binary data file in the current day directory, writing
+ ***   the file header if it's a new file.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   Closes the previous file, writing out anything buffered for it.
+ *********************************************************************/
+int binlogOpen(binlog_t *bl, const rotator_t *rot)
+{
+    binlogFileHeader_t hdr;
+
+    binlogClose(bl);
+
+    bl->fd = rotOpen(rot, BINLOG_FILENAME, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (bl->fd < 0)
+    {
+        printf("open(%s) failed: %s\n", BINLOG_FILENAME, strerror(errno));
+        return 0;
+    }
+
+    if (lseek(bl->fd, 0, SEEK_END) == 0)
+    {
+        hdr.magic      = BINLOG_MAGIC;
+        hdr.version    = BINLOG_VERSION;
+        hdr.headerSize = sizeof(hdr);
+        if (write(bl->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+            printf("write(%s) failed: %s\n", BINLOG_FILENAME, strerror(errno));
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: binlogAdd
+ ***
+ *** DESCRIPTION:
+ ***   Buffer a reading. Nothing is written until binlogFlush(), unless
+ ***   the buffer fills up.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void binlogAdd(binlog_t *bl, unsigned char inverter, unsigned char command, int flags,
+               float value, const frStamp_t *at)
+{
+    binlogRecord_t *rec;
+
+    if ((bl->count == BINLOG_MAX_RECORDS) && (binlogFlush(bl) == 0))
+        return;
+
+    rec = &bl->rec[bl->count++];
+    rec->sec      = at->real.tv_sec;
+    rec->usec     = at->real.tv_nsec / 1000;
+    rec->monoSec  = at->mono.tv_sec;
+    rec->monoNsec = at->mono.tv_nsec;
+    rec->inverter = inverter;
+    rec->command  = command;
+    rec->flags    = flags;
+    rec->reserved = 0;
+    rec->value    = value;
+}
+
+/*********************************************************************
+ *** FUNCTION: binlogFlush
+ ***
+ *** DESCRIPTION:
+ ***   Write out the buffered readings in one go, unless the write comes
+ ***   up short. If the rest can't be written the file is cut back to
+ ***   where it was, so it still ends on a whole record and the records
+ ***   written after it line up.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure with errno set. The readings are
+ ***   dropped either way.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int binlogFlush(binlog_t *bl)
+{
+    size_t len = bl->count * sizeof(binlogRecord_t);
+    size_t done = 0;
+    off_t start;
+    ssize_t r;
+    int err;
+
+    bl->count = 0;
+    if (bl->fd < 0)
+    {
+        errno = EBADF;
+        return 0;
+    }
+    if (len == 0)
+        return 1;
+
+    start = lseek(bl->fd, 0, SEEK_END);
+
+    while (done < len)
+    {
+        r = write(bl->fd, (const char *)bl->rec + done, len - done);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+        if (r <= 0)
+        {
+            err = (r < 0) ? errno : ENOSPC;
+            if (start >= 0)
+                ftruncate(bl->fd, start);
+            errno = err;
+            return 0;
+        }
+        done += r;
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: binlogClose
+ ***
+ *** DESCRIPTION:
+ ***   Write out anything buffered and close the file.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void binlogClose(binlog_t *bl)
+{
+    if (bl->fd < 0)
+        return;
+
+    if (binlogFlush(bl) == 0)
+        printf("write(%s) failed: %s\n", BINLOG_FILENAME, strerror(errno));
+    fdatasync(bl->fd);
+    close(bl->fd);
+    bl->fd = -1;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,88 @@
+/*********************************************************************
+ *** FILE: binlog.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stdint.h>
+
+/* INCLUDE FILES */
+#include "fronius.h"
+#include "rotate.h"
+
+/* DEFINES */
+
+// A binary data file is a binlogFileHeader_t followed by one
+// binlogRecord_t per reading. All fields are in host byte order.
+#define BINLOG_MAGIC        0x4e494246  // "FBIN"
+#define BINLOG_VERSION      1
+
+// Name of the daily binary data file, kept next to data.csv
+#define BINLOG_FILENAME     "data.bin"
+
+// Readings buffered before they have to be written out
+#define BINLOG_MAX_RECORDS  128
+
+// Record flags
+#define BINLOG_FLAG_RETRIED 0x01    // Read on a retry later in the sweep
+#define BINLOG_FLAG_DERIVED 0x02    // Worked out locally, not read
+#define BINLOG_FLAG_MISSING 0x04    // Change only: no longer read, value is NaN
+
+/* TYPEDEFS */
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;    // sizeof(binlogFileHeader_t)
+} __attribute__((__packed__)) binlogFileHeader_t;
+
+typedef struct
+{
+    uint32_t sec;           // Wall clock time the reply came in
+    uint32_t usec;
+    uint32_t monoSec;       // CLOCK_MONOTONIC at the same moment
+    uint32_t monoNsec;
+    uint8_t  inverter;      // Inverter number
+    uint8_t  command;       // cmd_t
+    uint8_t  flags;         // BINLOG_FLAG_*
+    uint8_t  reserved;
+    float    value;
+} __attribute__((__packed__)) binlogRecord_t;
+
+// The open data file and the readings not written to it yet
+typedef struct
+{
+    int            fd;
+    int            count;
+    binlogRecord_t rec[BINLOG_MAX_RECORDS];
+} binlog_t;
+
+/* FUNCTION PROTOTYPES */
+void binlogInit(binlog_t *bl);
+int  binlogOpen(binlog_t *bl, const rotator_t *rot);
+void binlogAdd(binlog_t *bl, unsigned char inverter, unsigned char command, int flags,
+               float value, const frStamp_t *at);
+int  binlogFlush(binlog_t *bl);
+void binlogClose(binlog_t *bl);
+
+#endif // BINLOG_H
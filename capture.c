@@ -0,0 +1,811 @@
+/*********************************************************************
+ *** FILE: capture.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* INCLUDE FILES */
+#include "capture.h"
+#include "rotate.h"
+
+/* DEFINES */
+
+// Write the ring out once this much is queued...
+#define CAPTURE_FLUSH_BYTES    (64 * 1024)
+
+// ...or once the oldest queued record is this old (seconds)
+#define CAPTURE_FLUSH_SECS     60
+
+/* TYPEDEFS */
+
+// State of the capture writer. The poll loop is the only producer and
+// the writer thread the only consumer. The lock is only held while the
+// head and tail are moved and bytes are copied in, never during I/O.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t       thread;
+    int             running;
+    int             stopping;
+
+    unsigned char  *ring;
+    size_t          size;
+    size_t          head;       // Producer writes here
+    size_t          tail;       // Consumer reads from here
+    size_t          used;       // Bytes between tail and head
+
+    unsigned long   dropped;    // Records dropped because the ring was full
+
+    rotator_t       rot;        // Day directories the files go in
+    int             fd;         // Current capture file, -1 if none
+} captureWriter_t;
+
+/* STATIC VARIABLES */
+static captureWriter_t cw = { .fd = -1 };
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: ringCopyOut
+ ***
+ *** DESCRIPTION:
+ ***   Copy bytes out of the ring starting at offset pos, wrapping at
+ ***   the end of the ring.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void ringCopyOut(size_t pos, void *dst, size_t len)
+{
+    size_t first = cw.size - pos;
+
+    if (first >= len)
+    {
+        memcpy(dst, cw.ring + pos, len);
+    }
+    else
+    {
+        memcpy(dst, cw.ring + pos, first);
+        memcpy((unsigned char *)dst + first, cw.ring, len - first);
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: ringCopyIn
+ ***
+ *** DESCRIPTION:
+ ***   Copy bytes into the ring at the head, wrapping at the end of the
+ ***   ring. The caller has checked that there is room.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Advances the head.
+ *********************************************************************/
+static void ringCopyIn(const void *src, size_t len)
+{
+    size_t first = cw.size - cw.head;
+
+    if (first >= len)
+    {
+        memcpy(cw.ring + cw.head, src, len);
+    }
+    else
+    {
+        memcpy(cw.ring + cw.head, src, first);
+        memcpy(cw.ring, (const unsigned char *)src + first, len - first);
+    }
+    cw.head = (cw.head + len) % cw.size;
+}
+
+/*********************************************************************
+ *** FUNCTION: openCaptureFile
+ ***
+ *** DESCRIPTION:
+ ***   Open the capture file in the current day directory, writing the
+ ***   file header if it's a new file.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   Closes the previous capture file.
+ *********************************************************************/
+static int openCaptureFile(void)
+{
+    captureFileHeader_t hdr;
+
+    if (cw.fd >= 0)
+    {
+        close(cw.fd);
+        cw.fd = -1;
+    }
+
+    cw.fd = rotOpen(&cw.rot, CAPTURE_FILENAME, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (cw.fd < 0)
+    {
+        printf("open(%s) failed: %s\n", CAPTURE_FILENAME, strerror(errno));
+        return 0;
+    }
+
+    if (lseek(cw.fd, 0, SEEK_END) == 0)
+    {
+        hdr.magic      = CAPTURE_MAGIC;
+        hdr.version    = CAPTURE_VERSION;
+        hdr.headerSize = sizeof(hdr);
+        if (write(cw.fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+            printf("write(%s) failed: %s\n", CAPTURE_FILENAME, strerror(errno));
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: writeOut
+ ***
+ *** DESCRIPTION:
+ ***   Write len bytes of the ring starting at pos to the capture file,
+ ***   with one writev() even when the bytes wrap around unless it comes
+ ***   up short. If the rest can't be written (a full SD card, say) the
+ ***   file is cut back to where it was, so it still ends on a whole
+ ***   record and the records written after it replay.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void writeOut(size_t pos, size_t len)
+{
+    size_t first, at, done = 0;
+    struct iovec iov[2];
+    off_t start;
+    ssize_t r;
+
+    if ((len == 0) || (cw.fd < 0))
+        return;
+
+    start = lseek(cw.fd, 0, SEEK_END);
+
+    while (done < len)
+    {
+        at = (pos + done) % cw.size;
+        first = cw.size - at;
+        if (first > len - done)
+            first = len - done;
+
+        iov[0].iov_base = cw.ring + at;
+        iov[0].iov_len  = first;
+        iov[1].iov_base = cw.ring;
+        iov[1].iov_len  = len - done - first;
+
+        r = writev(cw.fd, iov, (len - done > first) ? 2 : 1);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+        if (r <= 0)
+        {
+            printf("capture write failed: %s, %lu bytes dropped\n",
+                   (r < 0) ? strerror(errno) : "nothing written", (unsigned long)len);
+            if ((start >= 0) && (ftruncate(cw.fd, start) != 0))
+                printf("capture truncate failed: %s\n", strerror(errno));
+            return;
+        }
+        done += r;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: flushRing
+ ***
+ *** DESCRIPTION:
+ ***   Write len bytes of queued records starting at tail to disk,
+ ***   switching to a new file whenever a record belongs to a new day.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void flushRing(size_t tail, size_t len)
+{
+    captureRecord_t rec;
+    size_t start = tail;
+    size_t pending = 0;
+    size_t recLen;
+
+    // Only the record headers are looked at, to find day boundaries.
+    // Everything in between goes out in one piece.
+    while (len > 0)
+    {
+        ringCopyOut(tail, &rec, sizeof(rec));
+        recLen = sizeof(rec) + rec.length;
+
+        if ((rotCheck(&cw.rot, rec.sec) != 0) || (cw.fd < 0))
+        {
+            writeOut(start, pending);
+            openCaptureFile();
+            start = tail;
+            pending = 0;
+        }
+
+        pending += recLen;
+        tail = (tail + recLen) % cw.size;
+        len -= recLen;
+    }
+
+    writeOut(start, pending);
+}
+
+/*********************************************************************
+ *** FUNCTION: writerThread
+ ***
+ *** DESCRIPTION:
+ ***   Background thread that drains the ring to the capture files.
+ ***
+ *** RETURN VALUE:
+ ***   NULL.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void *writerThread(void *arg)
+{
+    struct timespec deadline;
+    size_t tail, len;
+    int stopping;
+
+    pthread_mutex_lock(&cw.lock);
+    for ( ; ; )
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CAPTURE_FLUSH_SECS;
+
+        while ((cw.used < CAPTURE_FLUSH_BYTES) && !cw.stopping)
+        {
+            if (pthread_cond_timedwait(&cw.cond, &cw.lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        // Take a snapshot. The producer only ever writes into the free
+        // part of the ring, so these bytes stay put while we write them.
+        tail = cw.tail;
+        len = cw.used;
+        stopping = cw.stopping;
+        pthread_mutex_unlock(&cw.lock);
+
+        flushRing(tail, len);
+
+        pthread_mutex_lock(&cw.lock);
+        cw.tail = (cw.tail + len) % cw.size;
+        cw.used -= len;
+
+        if (stopping && (cw.used == 0))
+            break;
+    }
+    pthread_mutex_unlock(&cw.lock);
+
+    return NULL;
+}
+
+/*********************************************************************
+ *** FUNCTION: captureStart
+ ***
+ *** DESCRIPTION:
+ ***   Start recording every frame to daily capture files under dir,
+ ***   queueing them in the ringSize bytes at ring. The ring belongs to
+ ***   the caller and must stay put until captureStop().
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   Starts the writer thread. The ring is flushed at exit.
+ *********************************************************************/
+int captureStart(const char *dir, void *ring, size_t ringSize)
+{
+    if (cw.running)
+        return 1;
+
+    cw.ring = ring;
+    cw.size = ringSize;
+    cw.head = cw.tail = cw.used = 0;
+    cw.fd = -1;
+    if (rotInit(&cw.rot, dir) == 0)
+    {
+        cw.ring = NULL;
+        return 0;
+    }
+
+    pthread_mutex_init(&cw.lock, NULL);
+    pthread_cond_init(&cw.cond, NULL);
+
+    if (pthread_create(&cw.thread, NULL, writerThread, NULL) != 0)
+    {
+        printf("capture: can't start writer thread\n");
+        cw.ring = NULL;
+        return 0;
+    }
+    cw.running = 1;
+
+    atexit(captureStop);
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: captureFrame
+ ***
+ *** DESCRIPTION:
+ ***   Queue a frame for the capture file. Cheap enough to call for
+ ***   every frame: one lock, two timestamps and a memcpy.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   The frame is dropped and counted if the ring is full. The poll
+ ***   loop never waits for the disk.
+ *********************************************************************/
+void captureFrame(captureDir_t dir, int port, const unsigned char *buf, int len,
+                  int flags)
+{
+    captureRecord_t rec;
+    struct timeval now;
+    struct timespec mono;
+
+    if (!cw.running || (len < 0))
+        return;
+
+    gettimeofday(&now, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+
+    rec.sec      = now.tv_sec;
+    rec.usec     = now.tv_usec;
+    rec.monoSec  = mono.tv_sec;
+    rec.monoNsec = mono.tv_nsec;
+    rec.dir      = dir;
+    rec.port     = port;
+    rec.flags    = flags;
+    rec.reserved = 0;
+    rec.length   = len;
+
+    pthread_mutex_lock(&cw.lock);
+    if (cw.used + sizeof(rec) + len > cw.size)
+    {
+        cw.dropped++;
+    }
+    else
+    {
+        ringCopyIn(&rec, sizeof(rec));
+        ringCopyIn(buf, len);
+        cw.used += sizeof(rec) + len;
+        if (cw.used >= CAPTURE_FLUSH_BYTES)
+            pthread_cond_signal(&cw.cond);
+    }
+    pthread_mutex_unlock(&cw.lock);
+}
+
+/*********************************************************************
+ *** FUNCTION: captureStop
+ ***
+ *** DESCRIPTION:
+ ***   Flush everything that is queued and stop the writer thread.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void captureStop(void)
+{
+    if (!cw.running)
+        return;
+
+    pthread_mutex_lock(&cw.lock);
+    cw.stopping = 1;
+    pthread_cond_signal(&cw.cond);
+    pthread_mutex_unlock(&cw.lock);
+
+    pthread_join(cw.thread, NULL);
+    cw.running = 0;
+
+    if (cw.fd >= 0)
+    {
+        close(cw.fd);
+        cw.fd = -1;
+    }
+    rotClose(&cw.rot);
+    if (cw.dropped != 0)
+        printf("capture: %lu records dropped, ring full\n", cw.dropped);
+
+    cw.ring = NULL;
+}
+
+/*********************************************************************
+ *** FUNCTION: recordAt
+ ***
+ *** DESCRIPTION:
+ ***   Find the capture record starting at offset pos.
+ ***
+ *** RETURN VALUE:
+ ***   Pointer to the record, or NULL if there is no complete record
+ ***   at pos.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static const captureRecord_t *recordAt(const replay_t *r, size_t pos)
+{
+    const captureRecord_t *rec;
+
+    if (pos + sizeof(captureRecord_t) > r->size)
+        return NULL;
+
+    rec = (const captureRecord_t *)(r->base + pos);
+    if (pos + sizeof(captureRecord_t) + rec->length > r->size)
+    {
+        // Truncated record at the end of the file, most likely the
+        // capture was cut off while it was being written.
+        return NULL;
+    }
+
+    return rec;
+}
+
+/*********************************************************************
+ *** FUNCTION: consume
+ ***
+ *** DESCRIPTION:
+ ***   Advance the replay clock to the time of a record.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void consume(replay_t *r, const captureRecord_t *rec)
+{
+    r->now.tv_sec   = rec->sec;
+    r->now.tv_usec  = rec->usec;
+    r->mono.tv_sec  = rec->monoSec;
+    r->mono.tv_nsec = rec->monoNsec;
+    r->records++;
+}
+
+/*********************************************************************
+ *** FUNCTION: replayOpen
+ ***
+ *** DESCRIPTION:
+ ***   Map a capture file into memory and get ready to replay it.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int replayOpen(replay_t *r, const char *path)
+{
+    const captureFileHeader_t *hdr;
+    const captureRecord_t *first;
+    struct stat statbuf;
+    void *base;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("open(%s) failed: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    if (fstat(fd, &statbuf) != 0)
+    {
+        printf("fstat(%s) failed: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    if (statbuf.st_size < sizeof(captureFileHeader_t))
+    {
+        printf("%s: not a capture file\n", path);
+        close(fd);
+        return 0;
+    }
+
+    base = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        printf("mmap(%s) failed: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    // We only ever walk forwards through the file
+    madvise(base, statbuf.st_size, MADV_SEQUENTIAL);
+
+    r->base = base;
+    r->size = statbuf.st_size;
+
+    hdr = (const captureFileHeader_t *)r->base;
+    if ((hdr->magic != CAPTURE_MAGIC) || (hdr->version != CAPTURE_VERSION) ||
+        (hdr->headerSize < sizeof(*hdr)) || (hdr->headerSize > r->size))
+    {
+        printf("%s: unsupported capture file\n", path);
+        replayClose(r);
+        return 0;
+    }
+    r->pos = hdr->headerSize;
+
+    // Start the clock at the first record so the very first timestamp
+    // taken during the replay is already in the past of the capture.
+    first = recordAt(r, r->pos);
+    if (first == NULL)
+    {
+        r->done = 1;
+    }
+    else
+    {
+        r->now.tv_sec   = first->sec;
+        r->now.tv_usec  = first->usec;
+        r->mono.tv_sec  = first->monoSec;
+        r->mono.tv_nsec = first->monoNsec;
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: replayClose
+ ***
+ *** DESCRIPTION:
+ ***   Release a capture file opened with replayOpen().
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void replayClose(replay_t *r)
+{
+    if (r->base != NULL)
+        munmap((void *)r->base, r->size);
+
+    r->base = NULL;
+    r->size = 0;
+    r->done = 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: findTx
+ ***
+ *** DESCRIPTION:
+ ***   Look for a sent message among the next REPLAY_LOOKAHEAD + 1 sent
+ ***   in the capture.
+ ***
+ *** RETURN VALUE:
+ ***   Offset of the record, 0 if it isn't there.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static size_t findTx(const replay_t *r, const unsigned char *buf, int len)
+{
+    const captureRecord_t *rec;
+    size_t pos = r->pos;
+    int tx = 0;
+
+    while (((rec = recordAt(r, pos)) != NULL) && (tx <= REPLAY_LOOKAHEAD))
+    {
+        if (rec->dir == CAPTURE_TX)
+        {
+            if ((rec->length == len) && (memcmp(rec + 1, buf, len) == 0))
+                return pos;
+            tx++;
+        }
+        pos += sizeof(*rec) + rec->length;
+    }
+
+    return 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: replayNextTx
+ ***
+ *** DESCRIPTION:
+ ***   Stands in for a write to the serial port. Skips to the next
+ ***   message that was sent during the capture, dropping whatever was
+ ***   received before it and not read by the parser. If that message
+ ***   isn't the one in buf, up to REPLAY_LOOKAHEAD messages that aren't
+ ***   sent any more (the handshakes night mode leaves out, say) are
+ ***   skipped to find it. Failing that (a retry that wasn't needed when
+ ***   the capture was taken) the capture is left where it is and this
+ ***   request gets no reply. buf may be NULL to take the next message
+ ***   whatever it is.
+ ***
+ *** RETURN VALUE:
+ ***   1 if a sent message was found, 0 if the capture is exhausted.
+ ***
+ *** SIDE EFFECTS:
+ ***   Sets done when the end of the capture is reached.
+ *********************************************************************/
+int replayNextTx(replay_t *r, const unsigned char *buf, int len)
+{
+    const captureRecord_t *rec;
+    size_t pos;
+
+    // Drop whatever was received and not read
+    r->rxOffset = 0;
+    while (((rec = recordAt(r, r->pos)) != NULL) && (rec->dir != CAPTURE_TX))
+        r->pos += sizeof(*rec) + rec->length;
+
+    if (rec == NULL)
+    {
+        r->done = 1;
+        return 0;
+    }
+
+    if ((buf != NULL) && (r->inARow < REPLAY_MAX_UNMATCHED))
+    {
+        pos = findTx(r, buf, len);
+        if (pos == 0)
+        {
+            r->unmatched++;
+            r->inARow++;
+            return 1;
+        }
+
+        // Requests sent then but not now are skipped along with their
+        // replies.
+        while (r->pos != pos)
+        {
+            rec = recordAt(r, r->pos);
+            if (rec->dir == CAPTURE_TX)
+                r->skipped++;
+            r->pos += sizeof(*rec) + rec->length;
+        }
+        rec = recordAt(r, r->pos);
+    }
+
+    r->pos += sizeof(*rec) + rec->length;
+    r->inARow = 0;
+    consume(r, rec);
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: replayRead
+ ***
+ *** DESCRIPTION:
+ ***   Stands in for a read from the serial port. Hands out the bytes
+ ***   that were received after the last sent message, in the chunks
+ ***   they were captured in.
+ ***
+ *** RETURN VALUE:
+ ***   The number of bytes copied into buf. Returns 0 once everything
+ ***   up to the next sent message has been delivered, which is what a
+ ***   read timeout looked like when the capture was taken.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int replayRead(replay_t *r, unsigned char *buf, int len)
+{
+    const captureRecord_t *rec;
+    int n;
+
+    // Skip over any empty records
+    while (((rec = recordAt(r, r->pos)) != NULL) &&
+           (rec->dir == CAPTURE_RX) && (rec->length == 0))
+    {
+        r->pos += sizeof(*rec);
+        consume(r, rec);
+    }
+
+    if ((rec == NULL) || (rec->dir != CAPTURE_RX) || (len <= 0))
+        return 0;
+
+    n = rec->length - r->rxOffset;
+    if (n > len)
+        n = len;
+
+    memcpy(buf, (const unsigned char *)(rec + 1) + r->rxOffset, n);
+    r->rxOffset += n;
+    r->rxBytes  += n;
+
+    if (r->rxOffset == rec->length)
+    {
+        r->pos += sizeof(*rec) + rec->length;
+        r->rxOffset = 0;
+        consume(r, rec);
+    }
+
+    return n;
+}
+
+/*********************************************************************
+ *** FUNCTION: replayGetTime
+ ***
+ *** DESCRIPTION:
+ ***   Get the wall clock time as seen by the capture being replayed.
+ ***
+ *** RETURN VALUE:
+ ***   Time of the last record consumed is returned in tv.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void replayGetTime(const replay_t *r, struct timeval *tv)
+{
+    *tv = r->now;
+}
+
+/*********************************************************************
+ *** FUNCTION: replayGetMono
+ ***
+ *** DESCRIPTION:
+ ***   Get the monotonic clock as seen by the capture being replayed.
+ ***
+ *** RETURN VALUE:
+ ***   CLOCK_MONOTONIC time of the last record consumed is returned in
+ ***   ts.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void replayGetMono(const replay_t *r, struct timespec *ts)
+{
+    *ts = r->mono;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,115 @@
+/*********************************************************************
+ *** FILE: capture.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* DEFINES */
+
+// A capture file is a captureFileHeader_t followed by any number of
+// captureRecord_t, each one immediately followed by 'length' bytes of
+// raw serial data. All fields are in host byte order.
+#define CAPTURE_MAGIC         0x50414346    // "FCAP"
+#define CAPTURE_VERSION       1
+
+// Record flags
+#define CAPTURE_FLAG_BAD_CKSUM  0x01    // Frame failed the checksum test
+#define CAPTURE_FLAG_INCOMPLETE 0x02    // Bytes left over when a read timed out
+
+// Name of the daily capture file, kept next to data.csv
+#define CAPTURE_FILENAME       "capture.bin"
+
+// Default size of the in-memory ring the frames are queued in
+#define CAPTURE_RING_SIZE      (1024 * 1024)
+
+// Requests in a row the capture has no match for before replay decides
+// it's out of step and moves on anyway
+#define REPLAY_MAX_UNMATCHED   256
+
+// Requests in the capture that replay will skip over to find the one
+// being sent
+#define REPLAY_LOOKAHEAD       2
+
+/* TYPEDEFS */
+
+// Direction of the bytes in a record
+typedef enum
+{
+    CAPTURE_TX = 0,     // Sent to the interface card
+    CAPTURE_RX = 1      // Received from the interface card
+} captureDir_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;    // sizeof(captureFileHeader_t)
+} __attribute__((__packed__)) captureFileHeader_t;
+
+typedef struct
+{
+    uint32_t sec;           // Wall clock time the bytes went over the wire
+    uint32_t usec;
+    uint32_t monoSec;       // CLOCK_MONOTONIC at the same moment
+    uint32_t monoNsec;
+    uint8_t  dir;           // captureDir_t
+    uint8_t  port;          // Port number, 0 for the first port
+    uint8_t  flags;         // CAPTURE_FLAG_*
+    uint8_t  reserved;
+    uint16_t length;        // Number of data bytes that follow
+} __attribute__((__packed__)) captureRecord_t;
+
+// Replay state for a capture file that has been mapped into memory
+typedef struct
+{
+    const unsigned char *base;      // Start of the mapped file
+    size_t               size;      // Size of the mapped file
+    size_t               pos;       // Offset of the next record to look at
+    size_t               rxOffset;  // Bytes of the current RX record already delivered
+    struct timeval       now;       // Time of the last record consumed
+    struct timespec      mono;      // Its CLOCK_MONOTONIC time
+    unsigned long        records;   // Records consumed so far
+    unsigned long        rxBytes;   // RX bytes handed to the parser so far
+    unsigned long        unmatched; // Requests the capture didn't send
+    int                  inARow;    // Of those, since the last match
+    unsigned long        skipped;   // Requests in the capture not sent
+    int                  done;      // Set once the capture is exhausted
+} replay_t;
+
+/* FUNCTION PROTOTYPES */
+int  captureStart(const char *dir, void *ring, size_t ringSize);
+void captureFrame(captureDir_t dir, int port, const unsigned char *buf, int len,
+                  int flags);
+void captureStop(void);
+
+int  replayOpen(replay_t *r, const char *path);
+void replayClose(replay_t *r);
+int  replayNextTx(replay_t *r, const unsigned char *buf, int len);
+int  replayRead(replay_t *r, unsigned char *buf, int len);
+void replayGetTime(const replay_t *r, struct timeval *tv);
+void replayGetMono(const replay_t *r, struct timespec *ts);
+
+#endif // CAPTURE_H
@@ -0,0 +1,155 @@
+/*********************************************************************
+ *** FILE: checkpoint.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// The day's running state lives in a file mapped into memory, so after
+// a restart it is picked up again as it was instead of starting over.
+// Nothing is copied in or out; main() works on the mapping directly.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* INCLUDE FILES */
+#include "checkpoint.h"
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: ckptOpen
+ ***
+ *** DESCRIPTION:
+ ***   Map the checkpoint file in rootFd, creating it if need be. A file
+ ***   of the wrong size or layout is started over.
+ ***
+ *** RETURN VALUE:
+ ***   1 if the checkpoint from the last run was kept, 0 if it starts
+ ***   empty, -1 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int ckptOpen(ckpt_t *c, int rootFd, size_t storeSize)
+{
+    struct stat statbuf;
+    void *mem;
+    int kept;
+
+    c->size = CKPT_STORE_OFFSET + storeSize;
+    c->fd = openat(rootFd, CKPT_FILENAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (c->fd < 0)
+    {
+        printf("open(%s) failed: %s\n", CKPT_FILENAME, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(c->fd, &statbuf) != 0)
+        goto fail;
+
+    kept = (statbuf.st_size == c->size);
+    if (!kept && ((ftruncate(c->fd, 0) != 0) || (ftruncate(c->fd, c->size) != 0)))
+        goto fail;
+
+    mem = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (mem == MAP_FAILED)
+        goto fail;
+
+    c->hdr   = mem;
+    c->store = (unsigned char *)mem + CKPT_STORE_OFFSET;
+
+    if (!kept || (c->hdr->magic != CKPT_MAGIC) || (c->hdr->version != CKPT_VERSION) ||
+        (c->hdr->size != c->size))
+    {
+        memset(mem, 0, c->size);
+        c->hdr->magic   = CKPT_MAGIC;
+        c->hdr->version = CKPT_VERSION;
+        c->hdr->size    = c->size;
+        kept = 0;
+    }
+
+    return kept;
+
+fail:
+    printf("Can't map %s: %s\n", CKPT_FILENAME, strerror(errno));
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+}
+
+/*********************************************************************
+ *** FUNCTION: ckptSync
+ ***
+ *** DESCRIPTION:
+ ***   Write the checkpoint out to disk and wait for it, so it
+ ***   survives the power going. Every CKPT_SYNC_SECS, so the wait
+ ***   hardly matters.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void ckptSync(ckpt_t *c)
+{
+    if (c->fd >= 0)
+        msync(c->hdr, c->size, MS_SYNC);
+}
+
+/*********************************************************************
+ *** FUNCTION: ckptClose
+ ***
+ *** DESCRIPTION:
+ ***   Write the checkpoint out and unmap it.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void ckptClose(ckpt_t *c)
+{
+    if (c->fd < 0)
+        return;
+
+    msync(c->hdr, c->size, MS_SYNC);
+    munmap(c->hdr, c->size);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
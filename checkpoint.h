@@ -0,0 +1,74 @@
+/*********************************************************************
+ *** FILE: checkpoint.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stdint.h>
+#include <stddef.h>
+
+/* DEFINES */
+#define CKPT_MAGIC          0x54504b43  // "CKPT"
+#define CKPT_VERSION        1
+
+// Name of the checkpoint file, kept in the root directory
+#define CKPT_FILENAME       "state.ckpt"
+
+// Where the sample store starts in the file
+#define CKPT_STORE_OFFSET   64
+
+// How often the checkpoint is forced out to disk with msync(MS_SYNC),
+// in seconds. It's in the page cache as soon as it's written, so this
+// only matters if the power goes.
+#define CKPT_SYNC_SECS      600
+
+/* TYPEDEFS */
+
+// The scalars main() keeps for the day. The sample store follows at
+// CKPT_STORE_OFFSET.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;          // Size of the whole file
+    int32_t  dayKey;        // yyyymmdd the values below are for
+    int32_t  firstPower;    // Set once there's been a power reading today
+    int64_t  startTime;     // Time of the first power reading today
+    float    energyNow;     // Last power reading
+    float    energyDay;     // Highest ENERGY_DAY today
+} ckptHeader_t;
+
+// A checkpoint file mapped into memory
+typedef struct
+{
+    int           fd;
+    size_t        size;
+    ckptHeader_t *hdr;
+    void         *store;    // storeFootprint() bytes for storeAttach()
+} ckpt_t;
+
+/* FUNCTION PROTOTYPES */
+int  ckptOpen(ckpt_t *c, int rootFd, size_t storeSize);
+void ckptSync(ckpt_t *c);
+void ckptClose(ckpt_t *c);
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,499 @@
+/*********************************************************************
+ *** FILE: csv.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* INCLUDE FILES */
+#include "csv.h"
+
+/* DEFINES */
+
+// Values at or above this are rounded to 6 significant digits, the
+// same precision "%g" used to give them.
+#define CSV_BIG         1000000LL
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: putDigits
+ ***
+ *** DESCRIPTION:
+ ***   Write an unsigned number in decimal.
+ ***
+ *** RETURN VALUE:
+ ***   Number of characters written to buf.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int putDigits(char *buf, unsigned long long n)
+{
+    char tmp[20];
+    int len = 0;
+    int i;
+
+    do
+    {
+        tmp[len++] = '0' + (n % 10);
+        n /= 10;
+    } while (n != 0);
+
+    for (i=0; i<len; i++)
+        buf[i] = tmp[len - 1 - i];
+
+    return len;
+}
+
+/*********************************************************************
+ *** FUNCTION: put2
+ ***
+ *** DESCRIPTION:
+ ***   Write a number from 0 to 99 as two digits.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void put2(char *buf, int n)
+{
+    buf[0] = '0' + (n / 10);
+    buf[1] = '0' + (n % 10);
+}
+
+/*********************************************************************
+ *** FUNCTION: csvFormatNumber
+ ***
+ *** DESCRIPTION:
+ ***   Format a value read from the inverter. The inverter sends a 16
+ ***   bit mantissa with a power of ten from -3 to 10, so three decimal
+ ***   places in fixed point never lose anything. Trailing zeros are
+ ***   dropped, which matches what "%g" printed for every value below
+ ***   a million. Bigger values come out as plain integers rounded to
+ ***   6 significant digits instead of "%g"'s exponent notation.
+ ***
+ *** RETURN VALUE:
+ ***   Number of characters written to buf (at most 24). Nothing is
+ ***   written for NaN or infinity.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int csvFormatNumber(char *buf, float value)
+{
+    double v = value;
+    unsigned long long n, p;
+    unsigned int frac;
+    int len = 0;
+    int digits;
+
+    // NaN and infinity
+    if ((v != v) || (v - v != 0))
+        return 0;
+
+    if (v < 0)
+    {
+        buf[len++] = '-';
+        v = -v;
+    }
+
+    if (v >= CSV_BIG)
+    {
+        if (v >= 1e19)
+            return 0;
+
+        n = (unsigned long long)(v + 0.5);
+        for (p = n, digits = 0; p != 0; p /= 10)
+            digits++;
+        for (p = 1; digits > 6; digits--)
+            p *= 10;
+        n = (n + p / 2) / p * p;
+
+        return len + putDigits(&buf[len], n);
+    }
+
+    // Fixed point, thousandths
+    n = (unsigned long long)(v * 1000 + 0.5);
+    frac = n % 1000;
+    len += putDigits(&buf[len], n / 1000);
+
+    if ((len == 2) && (buf[0] == '-') && (buf[1] == '0') && (frac == 0))
+    {
+        // Don't print -0
+        buf[0] = '0';
+        return 1;
+    }
+
+    if (frac != 0)
+    {
+        buf[len++] = '.';
+        buf[len++] = '0' + frac / 100;
+        frac %= 100;
+        if (frac != 0)
+        {
+            buf[len++] = '0' + frac / 10;
+            frac %= 10;
+            if (frac != 0)
+                buf[len++] = '0' + frac;
+        }
+    }
+
+    return len;
+}
+
+/*********************************************************************
+ *** FUNCTION: csvBegin
+ ***
+ *** DESCRIPTION:
+ ***   Start a new row.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvBegin(csvRow_t *row)
+{
+    row->len = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: csvTimestamp
+ ***
+ *** DESCRIPTION:
+ ***   Add a "YYYY-MM-DD HH:MM:SS," column.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvTimestamp(csvRow_t *row, const struct tm *tmTime)
+{
+    char *p = &row->buf[row->len];
+    int year = tmTime->tm_year + 1900;
+
+    if ((year < 1000) || (year > 9999))
+        year = 0;
+
+    put2(p,      year / 100);
+    put2(p + 2,  year % 100);
+    p[4] = '-';
+    put2(p + 5,  tmTime->tm_mon + 1);
+    p[7] = '-';
+    put2(p + 8,  tmTime->tm_mday);
+    p[10] = ' ';
+    put2(p + 11, tmTime->tm_hour);
+    p[13] = ':';
+    put2(p + 14, tmTime->tm_min);
+    p[16] = ':';
+    put2(p + 17, tmTime->tm_sec);
+    p[19] = ',';
+
+    row->len += 20;
+}
+
+/*********************************************************************
+ *** FUNCTION: csvValue
+ ***
+ *** DESCRIPTION:
+ ***   Add a numeric column.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvValue(csvRow_t *row, float value)
+{
+    if (row->len + 26 > CSV_LINE_MAX)
+        return;
+
+    row->len += csvFormatNumber(&row->buf[row->len], value);
+    row->buf[row->len++] = ',';
+}
+
+/*********************************************************************
+ *** FUNCTION: csvMask
+ ***
+ *** DESCRIPTION:
+ ***   Add a column of flag bits, in hex.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvMask(csvRow_t *row, unsigned long long mask)
+{
+    char tmp[16];
+    int len = 0;
+
+    if (row->len + 18 > CSV_LINE_MAX)
+        return;
+
+    do
+    {
+        tmp[len++] = "0123456789abcdef"[mask & 0xF];
+        mask >>= 4;
+    } while (mask != 0);
+
+    while (len > 0)
+        row->buf[row->len++] = tmp[--len];
+    row->buf[row->len++] = ',';
+}
+
+/*********************************************************************
+ *** FUNCTION: csvOffsets
+ ***
+ *** DESCRIPTION:
+ ***   Add a column holding a list of millisecond offsets separated by
+ ***   spaces. A negative offset, for a value we couldn't read, comes
+ ***   out as "-".
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvOffsets(csvRow_t *row, const int *ms, int count)
+{
+    int i;
+
+    for (i=0; i<count; i++)
+    {
+        if (row->len + 13 > CSV_LINE_MAX)
+            break;
+
+        if (i > 0)
+            row->buf[row->len++] = ' ';
+        if (ms[i] < 0)
+            row->buf[row->len++] = '-';
+        else
+            row->len += putDigits(&row->buf[row->len], ms[i]);
+    }
+    row->buf[row->len++] = ',';
+}
+
+/*********************************************************************
+ *** FUNCTION: csvEmpty
+ ***
+ *** DESCRIPTION:
+ ***   Add an empty column, for a value we couldn't read.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvEmpty(csvRow_t *row)
+{
+    if (row->len + 2 > CSV_LINE_MAX)
+        return;
+
+    row->buf[row->len++] = ',';
+}
+
+/*********************************************************************
+ *** FUNCTION: csvMissing
+ ***
+ *** DESCRIPTION:
+ ***   Add a column saying a value has gone missing, for change only
+ ***   rows where an empty column means it hasn't changed.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvMissing(csvRow_t *row)
+{
+    if (row->len + 5 > CSV_LINE_MAX)
+        return;
+
+    memcpy(&row->buf[row->len], "NaN,", 4);
+    row->len += 4;
+}
+
+/*********************************************************************
+ *** FUNCTION: csvEnd
+ ***
+ *** DESCRIPTION:
+ ***   Finish the row.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvEnd(csvRow_t *row)
+{
+    if (row->len >= CSV_LINE_MAX)
+        row->len = CSV_LINE_MAX - 1;
+
+    row->buf[row->len++] = '\n';
+}
+
+/*********************************************************************
+ *** FUNCTION: csvText
+ ***
+ *** DESCRIPTION:
+ ***   printf() free text, such as the header lines, onto the row.
+ ***
+ *** RETURN VALUE:
+ ***   None. Anything past CSV_LINE_MAX is cut off.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void csvText(csvRow_t *row, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(row->buf + row->len, CSV_LINE_MAX - row->len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return;
+    row->len += n;
+    if (row->len >= CSV_LINE_MAX)
+        row->len = CSV_LINE_MAX - 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: csvWrite
+ ***
+ *** DESCRIPTION:
+ ***   Write a finished row with a single write(), unless it comes up
+ ***   short. If the rest can't be written the file is cut back to where
+ ***   it was, so a half row isn't left for the next one to be appended
+ ***   to. The file should be opened for appending so rows never
+ ***   interleave.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure with errno set.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int csvWrite(const csvRow_t *row, int fd)
+{
+    off_t start;
+    int done = 0;
+    int r, err;
+
+    if (row->len == 0)
+        return 1;
+
+    start = lseek(fd, 0, SEEK_END);
+
+    while (done < row->len)
+    {
+        r = write(fd, row->buf + done, row->len - done);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+        if (r <= 0)
+        {
+            err = (r < 0) ? errno : ENOSPC;
+            if ((done > 0) && (start >= 0))
+                ftruncate(fd, start);
+            errno = err;
+            return 0;
+        }
+        done += r;
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: csvHeaderNames
+ ***
+ *** DESCRIPTION:
+ ***   Pick the metric names out of a header line, without the padding
+ ***   spaces. The first column is the timestamp; metric m is in column
+ ***   m + 1. Anything past CSV_METRICS_MAX is left out.
+ ***
+ *** RETURN VALUE:
+ ***   Number of metrics.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int csvHeaderNames(const char *line, char names[][CSV_NAME_MAX])
+{
+    const char *p = line;
+    const char *end;
+    int col = 0;
+    int count = 0;
+    int len;
+
+    while ((*p != '\0') && (*p != '\n') && (*p != '\r') && (count < CSV_METRICS_MAX))
+    {
+        end = p;
+        while ((*end != ',') && (*end != '\0') && (*end != '\n') && (*end != '\r'))
+            end++;
+        len = end - p;
+        while ((len > 0) && (p[len-1] == ' '))
+            len--;
+
+        if (col > 0)
+        {
+            if (len >= CSV_NAME_MAX)
+                len = CSV_NAME_MAX - 1;
+            memcpy(names[count], p, len);
+            names[count][len] = '\0';
+            count++;
+        }
+        col++;
+
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return count;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,60 @@
+/*********************************************************************
+ *** FILE: csv.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef CSV_H
+#define CSV_H
+
+/* SYSTEM INCLUDE FILES */
+#include <time.h>
+
+/* DEFINES */
+
+// Longest row we'll ever build. A timestamp plus 38 columns of at most
+// 25 characters each and the optional columns fit with room to spare.
+#define CSV_LINE_MAX    2048
+
+// Most metrics a header can name, and the longest name kept
+#define CSV_METRICS_MAX 64
+#define CSV_NAME_MAX    32
+
+/* TYPEDEFS */
+
+// A CSV row being built. Reused from one sweep to the next.
+typedef struct
+{
+    char buf[CSV_LINE_MAX];
+    int  len;
+} csvRow_t;
+
+/* FUNCTION PROTOTYPES */
+void csvBegin(csvRow_t *row);
+void csvTimestamp(csvRow_t *row, const struct tm *tmTime);
+void csvValue(csvRow_t *row, float value);
+void csvMask(csvRow_t *row, unsigned long long mask);
+void csvOffsets(csvRow_t *row, const int *ms, int count);
+void csvEmpty(csvRow_t *row);
+void csvMissing(csvRow_t *row);
+void csvEnd(csvRow_t *row);
+void csvText(csvRow_t *row, const char *fmt, ...);
+int  csvWrite(const csvRow_t *row, int fd);
+int  csvFormatNumber(char *buf, float value);
+int  csvHeaderNames(const char *line, char names[][CSV_NAME_MAX]);
+
+#endif // CSV_H
@@ -0,0 +1,246 @@
+/*********************************************************************
+ *** FILE: csvbench.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// CSV row encoder check and benchmark (make csvbench).
+//
+// First every value the inverter can send, a 16 bit mantissa (signed
+// for the temperature) times a power of ten from -3 to 10, is put
+// through csvFormatNumber() and compared with "%g". Below a million
+// the text has to be the same; above it the encoder prints a plain
+// integer where "%g" goes to an exponent, and the two have to parse to
+// the same number. Any difference fails the run.
+//
+// Then -n rows of 38 columns are written to /dev/null, once the way
+// main() used to with an fprintf() per column and an fflush() per row,
+// and once with the row encoder and a single write().
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+/* INCLUDE FILES */
+#include "csv.h"
+
+/* DEFINES */
+
+// Rows written by each way, and the columns in each
+#define CSVBENCH_ROWS       200000
+#define CSVBENCH_COLUMNS    38
+
+// Differences printed before just counting them
+#define CSVBENCH_SHOW       5
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: usage
+ ***
+ *** DESCRIPTION:
+ ***   Print help about the command line arguments, then exit
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void usage(const char *argv0)
+{
+    printf("usage: %s [-n rows]\n", argv0);
+    printf("       rows = rows written by each way (default %d)\n", CSVBENCH_ROWS);
+    exit(1);
+}
+
+/*********************************************************************
+ *** FUNCTION: now
+ ***
+ *** DESCRIPTION:
+ ***   Read the monotonic clock.
+ ***
+ *** RETURN VALUE:
+ ***   Seconds.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*********************************************************************
+ *** FUNCTION: checkNumbers
+ ***
+ *** DESCRIPTION:
+ ***   Compare csvFormatNumber() with "%g" for every value the inverter
+ ***   can send.
+ ***
+ *** RETURN VALUE:
+ ***   Number of values that differ.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static long checkNumbers(void)
+{
+    char ours[64], theirs[64];
+    long total = 0, bad = 0;
+    float f;
+    int e, m, n, neg;
+
+    for (e=-3; e<=10; e++)
+    {
+        for (m=0; m<65536; m++)
+        {
+            for (neg=0; neg<2; neg++)
+            {
+                // Only the temperature is signed, its mantissa is a short
+                if (neg && ((short)m >= 0))
+                    continue;
+                f = (neg ? (short)m : (unsigned short)m) * powf(10, e);
+
+                n = csvFormatNumber(ours, f);
+                ours[n] = '\0';
+                snprintf(theirs, sizeof(theirs), "%g", f);
+                total++;
+
+                if (strcmp(ours, theirs) == 0)
+                    continue;
+                if ((fabsf(f) >= 1e6) && (strtod(ours, NULL) == strtod(theirs, NULL)))
+                    continue;
+
+                if (bad++ < CSVBENCH_SHOW)
+                    printf("  %s, %%g gives %s\n", ours, theirs);
+            }
+        }
+    }
+
+    printf("Checked %ld values against %%g, %ld differ\n", total, bad);
+    return bad;
+}
+
+/*********************************************************************
+ *** FUNCTION: main
+ ***
+ *** DESCRIPTION:
+ ***   Check the number printer, then time both ways of writing rows.
+ ***
+ *** RETURN VALUE:
+ ***   0 if the check passed, 1 if not.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int main(int argc, char *argv[])
+{
+    static csvRow_t row;
+    float values[CSVBENCH_COLUMNS];
+    struct tm tmTime;
+    long rows = CSVBENCH_ROWS;
+    double t0, t1, t2;
+    long bad;
+    FILE *fp;
+    int fd;
+    long r;
+    int i, j;
+
+    for (i=0; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                rows = atol(argv[i+1]);
+        }
+    }
+    if (rows < 1)
+        usage(argv[0]);
+
+    bad = checkNumbers();
+
+    // A spread of magnitudes and decimal places, like a real sweep
+    for (j=0; j<CSVBENCH_COLUMNS; j++)
+        values[j] = (j * 3719 % 65535) * powf(10, (j % 5) - 2);
+    memset(&tmTime, 0, sizeof(tmTime));
+    tmTime.tm_year = 126;
+    tmTime.tm_mday = 1;
+
+    fd = open("/dev/null", O_WRONLY);
+    fp = fdopen(dup(fd), "a");
+    if ((fd < 0) || (fp == NULL))
+    {
+        printf("Can't open /dev/null\n");
+        return 1;
+    }
+
+    t0 = now();
+    for (r=0; r<rows; r++)
+    {
+        fprintf(fp, "%d-%02d-%02d %02d:%02d:%02d,", tmTime.tm_year+1900, tmTime.tm_mon+1,
+                tmTime.tm_mday, tmTime.tm_hour, tmTime.tm_min, tmTime.tm_sec);
+        for (j=0; j<CSVBENCH_COLUMNS; j++)
+            fprintf(fp, "%g,", values[j]);
+        fprintf(fp, "\n");
+        fflush(fp);
+    }
+    t1 = now();
+    for (r=0; r<rows; r++)
+    {
+        csvBegin(&row);
+        csvTimestamp(&row, &tmTime);
+        for (j=0; j<CSVBENCH_COLUMNS; j++)
+            csvValue(&row, values[j]);
+        csvEnd(&row);
+        csvWrite(&row, fd);
+    }
+    t2 = now();
+
+    printf("%ld rows of %d columns to /dev/null:\n", rows, CSVBENCH_COLUMNS);
+    printf("  fprintf + fflush:    %6.2f us/row\n", (t1 - t0) / rows * 1e6);
+    printf("  row encoder + write: %6.2f us/row (%.1fx)\n", (t2 - t1) / rows * 1e6,
+           (t1 - t0) / (t2 - t1));
+
+    fclose(fp);
+    close(fd);
+
+    return (bad == 0) ? 0 : 1;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
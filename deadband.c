@@ -0,0 +1,236 @@
+/*********************************************************************
+ *** FILE: deadband.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// Change only recording. Most of a sweep is the same as the one before
+// it: the day, year and total counters and maxima, fans standing still,
+// phases the inverter doesn't have. A value is only passed on to be
+// written when it has moved more than its band from the last value
+// written, when it goes missing or comes back, or when the heartbeat
+// has passed since it was last written. Whoever reads the output holds
+// each value until the next one, which gives back the whole step
+// function to within the band.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* INCLUDE FILES */
+#include "deadband.h"
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: bandInit
+ ***
+ *** DESCRIPTION:
+ ***   Set up for count metrics, every one written whenever it changes
+ ***   at all.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void bandInit(deadband_t *db, int count, int heartbeat)
+{
+    memset(db, 0, sizeof(*db));
+    db->count = (count < BAND_METRICS_MAX) ? count : BAND_METRICS_MAX;
+    db->heartbeat = (heartbeat > 0) ? heartbeat : 0;
+    bandReset(db);
+}
+
+/*********************************************************************
+ *** FUNCTION: columnOf
+ ***
+ *** DESCRIPTION:
+ ***   Find a column name in the CSV header. Names are padded with
+ ***   spaces there.
+ ***
+ *** RETURN VALUE:
+ ***   The metric, which is the column less the timestamp, -1 if the
+ ***   name isn't there.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int columnOf(const char *header, const char *name, int len)
+{
+    const char *p = header;
+    int col = 0;
+
+    for ( ; ; )
+    {
+        if ((strncmp(p, name, len) == 0) &&
+            ((p[len] == ' ') || (p[len] == ',') || (p[len] == '\0')))
+        {
+            return col - 1;
+        }
+
+        p = strchr(p, ',');
+        if (p == NULL)
+            return -1;
+        p++;
+        col++;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: bandParse
+ ***
+ *** DESCRIPTION:
+ ***   Set the bands from a comma separated list. A plain number is the
+ ***   band for every metric, NAME=number the band for the one column
+ ***   of the CSV header with that name. Later entries win, so
+ ***   "0.5,POWER_NOW=10" works as expected.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 if the list can't be understood.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int bandParse(deadband_t *db, const char *spec, const char *header)
+{
+    const char *p = spec;
+    const char *eq, *comma;
+    char *end;
+    float band;
+    int metric, i;
+
+    while (*p != '\0')
+    {
+        comma = strchr(p, ',');
+        if (comma == NULL)
+            comma = p + strlen(p);
+        eq = memchr(p, '=', comma - p);
+
+        band = strtof((eq != NULL) ? eq + 1 : p, &end);
+        if ((end != comma) || (end == ((eq != NULL) ? eq + 1 : p)))
+        {
+            printf("Bad deadband \"%.*s\"\n", (int)(comma - p), p);
+            return 0;
+        }
+
+        if (eq == NULL)
+        {
+            for (i=0; i<db->count; i++)
+                db->band[i] = band;
+        }
+        else
+        {
+            metric = columnOf(header, p, eq - p);
+            if ((metric < 0) || (metric >= db->count))
+            {
+                printf("No column called %.*s\n", (int)(eq - p), p);
+                return 0;
+            }
+            db->band[metric] = band;
+        }
+
+        p = (*comma == ',') ? comma + 1 : comma;
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: bandReset
+ ***
+ *** DESCRIPTION:
+ ***   Forget what was written, so the next sweep is written in full.
+ ***   Called for every new file, so each one stands on its own.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void bandReset(deadband_t *db)
+{
+    int i;
+
+    for (i=0; i<db->count; i++)
+    {
+        db->last[i] = NAN;
+        db->lastAt[i] = 0;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: bandCheck
+ ***
+ *** DESCRIPTION:
+ ***   Decide which of a sweep's values need writing. A metric that
+ ***   was missing and still is needs nothing; after a reset they all
+ ***   count as missing.
+ ***
+ *** RETURN VALUE:
+ ***   A bit for each metric to write, 0 if the whole sweep can be
+ ***   left out.
+ ***
+ *** SIDE EFFECTS:
+ ***   The values marked are remembered as the last ones written.
+ *********************************************************************/
+unsigned long long bandCheck(deadband_t *db, const float *values, time_t now)
+{
+    unsigned long long mask = 0;
+    float v, last;
+    int i;
+
+    for (i=0; i<db->count; i++)
+    {
+        v = values[i];
+        last = db->last[i];
+
+        if (isnan(v))
+        {
+            if (isnan(last))
+                continue;
+        }
+        else if (!isnan(last) && (db->band[i] >= 0) && (fabsf(v - last) <= db->band[i]) &&
+                 ((db->heartbeat == 0) || (now - db->lastAt[i] < db->heartbeat)))
+        {
+            continue;
+        }
+
+        mask |= 1ULL << i;
+        db->last[i] = v;
+        db->lastAt[i] = now;
+    }
+
+    return mask;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
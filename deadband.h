@@ -0,0 +1,59 @@
+/*********************************************************************
+ *** FILE: deadband.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+/* SYSTEM INCLUDE FILES */
+#include <time.h>
+
+/* DEFINES */
+
+// Most metrics a deadband can cover, one bit each in a mask
+#define BAND_METRICS_MAX        64
+
+// Default time after which an unchanged value is written again, in
+// seconds
+#define BAND_HEARTBEAT_SECS     900
+
+// Line written to data.csv ahead of change only rows
+#define BAND_CSV_MARKER         "Change only: an empty field repeats the last value, " \
+                                "NaN marks a missing one"
+
+/* TYPEDEFS */
+
+// The last value written of every metric and how far each may move
+// before it's written again
+typedef struct
+{
+    int            count;
+    int            heartbeat;                   // Seconds, 0 for none
+    float          band[BAND_METRICS_MAX];      // Negative to write every sweep
+    float          last[BAND_METRICS_MAX];      // NaN while missing
+    time_t         lastAt[BAND_METRICS_MAX];
+} deadband_t;
+
+/* FUNCTION PROTOTYPES */
+void               bandInit(deadband_t *db, int count, int heartbeat);
+int                bandParse(deadband_t *db, const char *spec, const char *header);
+void               bandReset(deadband_t *db);
+unsigned long long bandCheck(deadband_t *db, const float *values, time_t now);
+
+#endif // DEADBAND_H
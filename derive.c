@@ -0,0 +1,483 @@
+/*********************************************************************
+ *** FILE: derive.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+// Keeps the inverter's day, year and total counters up to date from
+// the *_NOW readings, so they don't have to be read over the bus every
+// sweep. The real registers are read every so often and always win.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+/* INCLUDE FILES */
+#include "fronius.h"
+#include "derive.h"
+
+/* DEFINES */
+
+// Power readings further apart than this aren't integrated (seconds).
+// The inverter was off or we weren't running.
+#define DERIVE_MAX_GAP_SECS     (15 * 60)
+
+// How often the state file is written (seconds)
+#define DERIVE_SAVE_SECS        (10 * 60)
+
+// The operating hours registers count hours
+#define DERIVE_HOUR_SECS        3600.0
+
+/* TYPEDEFS */
+
+// What a counter is derived from
+typedef enum
+{
+    AGG_ENERGY,     // Integral of the power, Wh
+    AGG_YIELD,      // Energy times the tariff learnt from the inverter
+    AGG_MAX_POWER,
+    AGG_MAX_AC,
+    AGG_MIN_AC,
+    AGG_MAX_DC,
+    AGG_HOURS       // Time the inverter was producing
+} aggKind_t;
+
+// When a counter starts over
+typedef enum
+{
+    PERIOD_DAY,
+    PERIOD_YEAR,
+    PERIOD_TOTAL
+} period_t;
+
+typedef struct
+{
+    unsigned char cmd;
+    aggKind_t     kind;
+    period_t      period;
+} deriveRule_t;
+
+/* STATIC VARIABLES */
+static const deriveRule_t rules[DERIVE_RULES] =
+{
+    { GET_ENERGY_DAY,            AGG_ENERGY,    PERIOD_DAY   },
+    { GET_ENERGY_YEAR,           AGG_ENERGY,    PERIOD_YEAR  },
+    { GET_ENERGY_TOTAL,          AGG_ENERGY,    PERIOD_TOTAL },
+    { GET_YIELD_DAY,             AGG_YIELD,     PERIOD_DAY   },
+    { GET_YIELD_YEAR,            AGG_YIELD,     PERIOD_YEAR  },
+    { GET_YIELD_TOTAL,           AGG_YIELD,     PERIOD_TOTAL },
+    { GET_MAX_POWER_DAY,         AGG_MAX_POWER, PERIOD_DAY   },
+    { GET_MAX_POWER_YEAR,        AGG_MAX_POWER, PERIOD_YEAR  },
+    { GET_MAX_POWER_TOTAL,       AGG_MAX_POWER, PERIOD_TOTAL },
+    { GET_MAX_AC_VOLTAGE_DAY,    AGG_MAX_AC,    PERIOD_DAY   },
+    { GET_MAX_AC_VOLTAGE_YEAR,   AGG_MAX_AC,    PERIOD_YEAR  },
+    { GET_MAX_AC_VOLTAGE_TOTAL,  AGG_MAX_AC,    PERIOD_TOTAL },
+    { GET_MIN_AC_VOLTAGE_DAY,    AGG_MIN_AC,    PERIOD_DAY   },
+    { GET_MIN_AC_VOLTAGE_YEAR,   AGG_MIN_AC,    PERIOD_YEAR  },
+    { GET_MIN_AC_VOLTAGE_TOTAL,  AGG_MIN_AC,    PERIOD_TOTAL },
+    { GET_MAX_DC_VOLTAGE_DAY,    AGG_MAX_DC,    PERIOD_DAY   },
+    { GET_MAX_DC_VOLTAGE_YEAR,   AGG_MAX_DC,    PERIOD_YEAR  },
+    { GET_MAX_DC_VOLTAGE_TOTAL,  AGG_MAX_DC,    PERIOD_TOTAL },
+    { GET_OPERATING_HOURS_DAY,   AGG_HOURS,     PERIOD_DAY   },
+    { GET_OPERATING_HOURS_YEAR,  AGG_HOURS,     PERIOD_YEAR  },
+    { GET_OPERATING_HOURS_TOTAL, AGG_HOURS,     PERIOD_TOTAL }
+};
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: ruleOf
+ ***
+ *** DESCRIPTION:
+ ***   Find the rule for a command.
+ ***
+ *** RETURN VALUE:
+ ***   Index into rules[], -1 if the command isn't derived.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int ruleOf(unsigned char cmd)
+{
+    int i;
+
+    for (i=0; i<DERIVE_RULES; i++)
+    {
+        if (rules[i].cmd == cmd)
+            return i;
+    }
+
+    return -1;
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveInit
+ ***
+ *** DESCRIPTION:
+ ***   Set up the derived counters, loading the state saved by the
+ ***   last run from the state file in rootFd.
+ ***
+ *** RETURN VALUE:
+ ***   1 if saved state was loaded, 0 if starting from scratch.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int deriveInit(derive_t *d, int rootFd, int reconcileMins)
+{
+    int fd;
+    int r = 0;
+
+    memset(d, 0, sizeof(*d));
+    d->rootFd = rootFd;
+    d->reconcileSecs = reconcileMins * 60;
+
+    fd = openat(rootFd, DERIVE_FILENAME, O_RDONLY);
+    if (fd >= 0)
+    {
+        r = (read(fd, &d->st, sizeof(d->st)) == sizeof(d->st)) &&
+            (d->st.magic == DERIVE_MAGIC) && (d->st.version == DERIVE_VERSION);
+        close(fd);
+    }
+
+    if (!r)
+    {
+        // Nothing is valid, so everything gets read from the inverter
+        // on the first sweep.
+        memset(&d->st, 0, sizeof(d->st));
+        d->st.magic   = DERIVE_MAGIC;
+        d->st.version = DERIVE_VERSION;
+    }
+
+    return r;
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveIsDerived
+ ***
+ *** DESCRIPTION:
+ ***   Check whether a command is one of the derived counters.
+ ***
+ *** RETURN VALUE:
+ ***   1 if it is, 0 if it always has to be read from the inverter.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int deriveIsDerived(unsigned char cmd)
+{
+    return ruleOf(cmd) >= 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveReconcileDue
+ ***
+ *** DESCRIPTION:
+ ***   Check whether it's time to read the real registers again. That
+ ***   includes straight after a restart if the saved state is older
+ ***   than the reconcile interval.
+ ***
+ *** RETURN VALUE:
+ ***   1 if the registers should be read this sweep, 0 otherwise.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int deriveReconcileDue(const derive_t *d, int64_t nowMs)
+{
+    return (d->st.lastReconcileMs == 0) ||
+           (nowMs >= d->st.lastReconcileMs + (int64_t)d->reconcileSecs * 1000) ||
+           (nowMs < d->st.lastReconcileMs);
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveSetRegister
+ ***
+ *** DESCRIPTION:
+ ***   Take the value of a register read from the inverter. It replaces
+ ***   whatever we had worked out.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void deriveSetRegister(derive_t *d, unsigned char cmd, float value)
+{
+    int i = ruleOf(cmd);
+
+    if (i < 0)
+        return;
+
+    d->st.value[i] = value;
+    d->st.valid[i] = 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveReconciled
+ ***
+ *** DESCRIPTION:
+ ***   Called after a sweep that read the real registers. Works out the
+ ***   tariff from the total yield and energy, and saves the state.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Writes the state file.
+ *********************************************************************/
+void deriveReconciled(derive_t *d, int64_t nowMs)
+{
+    int energy = ruleOf(GET_ENERGY_TOTAL);
+    int yield  = ruleOf(GET_YIELD_TOTAL);
+
+    if (d->st.valid[energy] && d->st.valid[yield] && (d->st.value[energy] > 0))
+        d->st.yieldRate = d->st.value[yield] / d->st.value[energy];
+
+    d->st.lastReconcileMs = nowMs;
+    deriveSave(d);
+}
+
+/*********************************************************************
+ *** FUNCTION: startPeriod
+ ***
+ *** DESCRIPTION:
+ ***   Start the counters of a period over.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void startPeriod(derive_t *d, period_t period)
+{
+    int i;
+
+    for (i=0; i<DERIVE_RULES; i++)
+    {
+        if (rules[i].period != period)
+            continue;
+
+        d->st.value[i] = 0;
+        switch (rules[i].kind)
+        {
+            case AGG_ENERGY:
+            case AGG_YIELD:
+            case AGG_HOURS:
+                d->st.valid[i] = 1;
+                break;
+
+            default:
+                // No maximum or minimum until there's a reading
+                d->st.valid[i] = 0;
+                break;
+        }
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: track
+ ***
+ *** DESCRIPTION:
+ ***   Fold a reading into a maximum or minimum counter.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void track(derive_t *d, int i, float reading, int wantMax)
+{
+    if (isnan(reading))
+        return;
+
+    if (!d->st.valid[i] ||
+        (wantMax ? (reading > d->st.value[i]) : (reading < d->st.value[i])))
+    {
+        d->st.value[i] = reading;
+        d->st.valid[i] = 1;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveUpdate
+ ***
+ *** DESCRIPTION:
+ ***   Bring the counters up to date with this sweep's readings.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Saves the state every DERIVE_SAVE_SECS.
+ *********************************************************************/
+void deriveUpdate(derive_t *d, int64_t nowMs, const struct tm *lt,
+                  const deriveInputs_t *in)
+{
+    int32_t dayKey  = (lt->tm_year+1900) * 10000 + (lt->tm_mon+1) * 100 + lt->tm_mday;
+    int32_t yearKey = lt->tm_year+1900;
+    double dt = 0;
+    double wh = 0;
+    int i;
+
+    if (d->st.dayKey != dayKey)
+    {
+        startPeriod(d, PERIOD_DAY);
+        d->st.dayKey = dayKey;
+    }
+    if (d->st.yearKey != yearKey)
+    {
+        startPeriod(d, PERIOD_YEAR);
+        d->st.yearKey = yearKey;
+    }
+
+    // Trapezoid rule between this power reading and the last one
+    if (!isnan(in->power) && (d->st.lastMs != 0) && !isnan(d->st.lastPower) &&
+        (nowMs > d->st.lastMs) && (nowMs - d->st.lastMs <= DERIVE_MAX_GAP_SECS * 1000))
+    {
+        dt = (nowMs - d->st.lastMs) / 1000.0;
+        wh = (d->st.lastPower + in->power) / 2 * dt / 3600;
+    }
+
+    for (i=0; i<DERIVE_RULES; i++)
+    {
+        switch (rules[i].kind)
+        {
+            case AGG_ENERGY:
+                d->st.value[i] += wh;
+                break;
+
+            case AGG_YIELD:
+                d->st.value[i] += wh * d->st.yieldRate;
+                break;
+
+            case AGG_MAX_POWER:
+                track(d, i, in->power, 1);
+                break;
+
+            case AGG_MAX_AC:
+                track(d, i, in->acVoltage, 1);
+                break;
+
+            case AGG_MIN_AC:
+                // 0 V is the inverter not feeding in, not a minimum
+                if (in->acVoltage > 0)
+                    track(d, i, in->acVoltage, 0);
+                break;
+
+            case AGG_MAX_DC:
+                track(d, i, in->dcVoltage, 1);
+                break;
+
+            case AGG_HOURS:
+                d->st.value[i] += dt / DERIVE_HOUR_SECS;
+                break;
+        }
+    }
+
+    if (!isnan(in->power))
+    {
+        d->st.lastMs    = nowMs;
+        d->st.lastPower = in->power;
+    }
+
+    if (nowMs >= d->nextSaveMs)
+    {
+        if (d->nextSaveMs != 0)
+            deriveSave(d);
+        d->nextSaveMs = nowMs + DERIVE_SAVE_SECS * 1000;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveGet
+ ***
+ *** DESCRIPTION:
+ ***   Get the current value of a derived counter.
+ ***
+ *** RETURN VALUE:
+ ***   1 if the value is known and returned in value, 0 if it has to
+ ***   be read from the inverter.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int deriveGet(const derive_t *d, unsigned char cmd, float *value)
+{
+    int i = ruleOf(cmd);
+
+    if ((i < 0) || !d->st.valid[i])
+        return 0;
+
+    // No yield until the tariff has been learnt
+    if ((rules[i].kind == AGG_YIELD) && (d->st.yieldRate <= 0))
+        return 0;
+
+    *value = d->st.value[i];
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: deriveSave
+ ***
+ *** DESCRIPTION:
+ ***   Write the state file. It's written to a temporary file first and
+ ***   renamed, so a crash never leaves half a file behind.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void deriveSave(derive_t *d)
+{
+    int fd;
+    int r;
+
+    fd = openat(d->rootFd, DERIVE_FILENAME ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("open(%s.tmp) failed: %s\n", DERIVE_FILENAME, strerror(errno));
+        return;
+    }
+
+    r = (write(fd, &d->st, sizeof(d->st)) == sizeof(d->st)) && (fdatasync(fd) == 0);
+    close(fd);
+
+    if (!r || (renameat(d->rootFd, DERIVE_FILENAME ".tmp", d->rootFd, DERIVE_FILENAME) != 0))
+        printf("Failed to save %s: %s\n", DERIVE_FILENAME, strerror(errno));
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
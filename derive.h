@@ -0,0 +1,83 @@
+/*********************************************************************
+ *** FILE: derive.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef DERIVE_H
+#define DERIVE_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stdint.h>
+#include <time.h>
+
+/* DEFINES */
+#define DERIVE_MAGIC        0x56495244  // "DRIV"
+#define DERIVE_VERSION      1
+
+// Number of day/year/total registers that can be derived
+#define DERIVE_RULES        21
+
+// Name of the state file, kept in the root directory
+#define DERIVE_FILENAME     "derived.state"
+
+/* TYPEDEFS */
+
+// The instantaneous readings the counters are derived from. NaN for
+// anything that couldn't be read this sweep.
+typedef struct
+{
+    float power;        // GET_POWER_NOW, W
+    float acVoltage;    // GET_AC_VOLTAGE_NOW, V
+    float dcVoltage;    // GET_DC_VOLTAGE_NOW, V
+} deriveInputs_t;
+
+// Everything that is saved across restarts
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t  dayKey;                // yyyymmdd the day counters are for
+    int32_t  yearKey;               // yyyy the year counters are for
+    int64_t  lastMs;                // Time of the last power reading
+    int64_t  lastReconcileMs;       // Time the registers were last read
+    float    lastPower;             // The last power reading
+    float    yieldRate;             // Yield per Wh, learnt from the inverter
+    double   value[DERIVE_RULES];   // Current value of every counter
+    uint8_t  valid[DERIVE_RULES];   // Set once a counter has a value
+} deriveState_t;
+
+typedef struct
+{
+    deriveState_t st;
+    int      rootFd;            // Directory the state file is in
+    int      reconcileSecs;     // How often to read the real registers
+    int64_t  nextSaveMs;        // When to save the state next
+} derive_t;
+
+/* FUNCTION PROTOTYPES */
+int  deriveInit(derive_t *d, int rootFd, int reconcileMins);
+int  deriveIsDerived(unsigned char cmd);
+int  deriveReconcileDue(const derive_t *d, int64_t nowMs);
+void deriveReconciled(derive_t *d, int64_t nowMs);
+void deriveSetRegister(derive_t *d, unsigned char cmd, float value);
+void deriveUpdate(derive_t *d, int64_t nowMs, const struct tm *lt,
+                  const deriveInputs_t *in);
+int  deriveGet(const derive_t *d, unsigned char cmd, float *value);
+void deriveSave(derive_t *d);
+
+#endif // DERIVE_H
@@ -0,0 +1,1511 @@
+/*********************************************************************
+ *** FILE: fronius.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+/* SYSTEM INCLUDE FILES */
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <arpa/inet.h>
+
+/* INCLUDE FILES */
+#include "fronius.h"
+
+/* TYPEDEFS */
+typedef struct
+{
+    int     baud;
+    speed_t speed;
+} frBaud_t;
+
+/* STATIC VARIABLES */
+
+// Line rates to try, fastest first
+static const frBaud_t bauds[] =
+{
+    { 115200, B115200 },
+    {  57600, B57600  },
+    {  38400, B38400  },
+    {  19200, B19200  },
+    {   9600, B9600   },
+    {   4800, B4800   },
+    {   2400, B2400   }
+};
+
+#define BAUD_COUNT  (sizeof(bauds)/sizeof(bauds[0]))
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: setSpeed
+ ***
+ *** DESCRIPTION:
+ ***   Set the line rate of a serial port.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure with errno set.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int setSpeed(int fd, int baud)
+{
+    struct termios t;
+    int i;
+
+    for (i=0; i<BAUD_COUNT; i++)
+    {
+        if (bauds[i].baud == baud)
+            break;
+    }
+    if (i == BAUD_COUNT)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if (tcgetattr(fd, &t) != 0)
+        return 0;
+
+    cfmakeraw(&t);
+    if (cfsetispeed(&t, bauds[i].speed) != 0)
+        return 0;
+
+    if (cfsetospeed(&t, bauds[i].speed) != 0)
+        return 0;
+
+    return (tcsetattr(fd, TCSANOW, &t) == 0);
+}
+
+/*********************************************************************
+ *** FUNCTION: getSpeed
+ ***
+ *** DESCRIPTION:
+ ***   Find out the line rate a serial port is set to.
+ ***
+ *** RETURN VALUE:
+ ***   The rate, 0 if it isn't a serial port or the rate isn't one we
+ ***   know.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int getSpeed(int fd)
+{
+    struct termios t;
+    int i;
+
+    if ((fd < 0) || (tcgetattr(fd, &t) != 0))
+        return 0;
+
+    for (i=0; i<BAUD_COUNT; i++)
+    {
+        if (bauds[i].speed == cfgetospeed(&t))
+            return bauds[i].baud;
+    }
+
+    return 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: frOpenPort
+ ***
+ *** DESCRIPTION:
+ ***   Open the serial port, set the IO modes and the line rate.
+ ***
+ *** RETURN VALUE:
+ ***   The file descriptor to use for the serial port, or FR_EOPEN if
+ ***   anything fails. errno is left set to the reason.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frOpenPort(const char *port, int baud)
+{
+    int fd;
+    int err;
+
+    fd = open(port, O_NONBLOCK | O_RDWR | O_NOCTTY);
+    if (fd < 0)
+        return FR_EOPEN;
+
+    // Set the IO modes on the serial port
+    if (setSpeed(fd, baud) == 0)
+    {
+        err = errno;
+        close(fd);
+        errno = err;
+        return FR_EOPEN;
+    }
+
+    return fd;
+}
+
+/*********************************************************************
+ *** FUNCTION: frParseEndpoint
+ ***
+ *** DESCRIPTION:
+ ***   Work out where a port is from "tcp:host:port" ("tcp:[v6]:port"
+ ***   for an IPv6 address) or the path of a serial port. The host is
+ ***   looked up now.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK, FR_EINVAL if the spec is too long, has no port or the host
+ ***   can't be found.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frParseEndpoint(const char *spec, frEndpoint_t *ep)
+{
+    struct addrinfo hints, *res;
+    char host[FR_ENDPOINT_MAX];
+    const char *p, *colon;
+    int len;
+
+    memset(ep, 0, sizeof(*ep));
+    if (strlen(spec) >= sizeof(ep->spec))
+        return FR_EINVAL;
+    strcpy(ep->spec, spec);
+
+    if (strncmp(spec, FR_TCP_PREFIX, strlen(FR_TCP_PREFIX)) != 0)
+    {
+        ep->transport = FR_TRANSPORT_TTY;
+        return FR_OK;
+    }
+    ep->transport = FR_TRANSPORT_TCP;
+
+    p = spec + strlen(FR_TCP_PREFIX);
+    if (*p == '[')
+    {
+        colon = strchr(p, ']');
+        if ((colon == NULL) || (colon[1] != ':'))
+            return FR_EINVAL;
+        p++;
+        len = colon - p;
+        colon++;
+    }
+    else
+    {
+        colon = strrchr(p, ':');
+        if (colon == NULL)
+            return FR_EINVAL;
+        len = colon - p;
+    }
+    memcpy(host, p, len);
+    host[len] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        return FR_EINVAL;
+
+    memcpy(&ep->addr, res->ai_addr, res->ai_addrlen);
+    ep->addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: frOpenEndpoint
+ ***
+ *** DESCRIPTION:
+ ***   Open a port. A serial port is set to baud. A converter is
+ ***   connected to without waiting for the connection to come up;
+ ***   until it does, requests wait to be sent and time out as usual.
+ ***   Nagle is turned off, every frame goes out in one write and
+ ***   there's nothing to gain by holding it back.
+ ***
+ *** RETURN VALUE:
+ ***   The file descriptor, or FR_EOPEN with errno set.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frOpenEndpoint(const frEndpoint_t *ep, int baud)
+{
+    int fd;
+    int on = 1;
+    int err;
+
+    if (ep->transport == FR_TRANSPORT_TTY)
+        return frOpenPort(ep->spec, baud);
+
+    fd = socket(ep->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return FR_EOPEN;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+    if ((connect(fd, (const struct sockaddr *)&ep->addr, ep->addrLen) != 0) &&
+        (errno != EINPROGRESS))
+    {
+        err = errno;
+        close(fd);
+        errno = err;
+        return FR_EOPEN;
+    }
+
+    return fd;
+}
+
+/*********************************************************************
+ *** FUNCTION: transportOf
+ ***
+ *** DESCRIPTION:
+ ***   Find out what an fd is connected to.
+ ***
+ *** RETURN VALUE:
+ ***   FR_TRANSPORT_TCP for a socket, else FR_TRANSPORT_TTY.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int transportOf(int fd)
+{
+    struct stat statbuf;
+
+    if ((fd >= 0) && (fstat(fd, &statbuf) == 0) && S_ISSOCK(statbuf.st_mode))
+        return FR_TRANSPORT_TCP;
+
+    return FR_TRANSPORT_TTY;
+}
+
+/*********************************************************************
+ *** FUNCTION: frInit
+ ***
+ *** DESCRIPTION:
+ ***   Set up a protocol context for a port that is already open.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void frInit(frCtx_t *ctx, int fd)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->fd = fd;
+    ctx->transport = transportOf(fd);
+    ctx->timeoutMs = FR_TIMEOUT_MS;
+    ctx->baud = getSpeed(fd);
+}
+
+/*********************************************************************
+ *** FUNCTION: frSetFd
+ ***
+ *** DESCRIPTION:
+ ***   Move a context to another fd, such as a new connection after the
+ ***   old one dropped, or -1 while there's none. Requests queued or on
+ ***   the wire are thrown away, finished ones not yet collected too.
+ ***   The hooks, timeout and counters stay. Closing the old fd is up
+ ***   to the caller.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void frSetFd(frCtx_t *ctx, int fd)
+{
+    ctx->fd         = fd;
+    ctx->transport  = transportOf(fd);
+    ctx->baud       = getSpeed(fd);
+    ctx->queueHead  = 0;
+    ctx->queueCount = 0;
+    ctx->busy       = 0;
+    ctx->rxLen      = 0;
+    ctx->doneHead   = 0;
+    ctx->doneCount  = 0;
+
+    ctx->baudTxFrames    = ctx->stats.txFrames;
+    ctx->baudCksumErrors = ctx->stats.cksumErrors;
+}
+
+/*********************************************************************
+ *** FUNCTION: frSetIo
+ ***
+ *** DESCRIPTION:
+ ***   Replace the reads and writes on the fd with the given hooks.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void frSetIo(frCtx_t *ctx, const frIo_t *io)
+{
+    ctx->io = *io;
+}
+
+/*********************************************************************
+ *** FUNCTION: frSetFrameHook
+ ***
+ *** DESCRIPTION:
+ ***   Register a function to be called with every frame sent or
+ ***   received on the context.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void frSetFrameHook(frCtx_t *ctx, frFrameHook_t hook, void *arg)
+{
+    ctx->frameHook = hook;
+    ctx->frameArg  = arg;
+}
+
+/*********************************************************************
+ *** FUNCTION: frSetBaud
+ ***
+ *** DESCRIPTION:
+ ***   Change the line rate of the port. Anything half received at the
+ ***   old rate is thrown away. Only allowed while nothing is on the
+ ***   wire.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK, FR_EBUSY if a request is in progress, FR_EINVAL if the
+ ***   context isn't on a serial port or the rate isn't supported.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frSetBaud(frCtx_t *ctx, int baud)
+{
+    if (ctx->busy)
+        return FR_EBUSY;
+
+    if ((ctx->fd < 0) || (setSpeed(ctx->fd, baud) == 0))
+        return FR_EINVAL;
+
+    tcflush(ctx->fd, TCIOFLUSH);
+    ctx->rxLen = 0;
+    ctx->baud  = baud;
+
+    // Start counting errors at the new rate afresh
+    ctx->baudTxFrames    = ctx->stats.txFrames;
+    ctx->baudCksumErrors = ctx->stats.cksumErrors;
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: frStrError
+ ***
+ *** DESCRIPTION:
+ ***   Convert an FR_E* code to a string.
+ ***
+ *** RETURN VALUE:
+ ***   Constant string.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+const char *frStrError(int err)
+{
+    switch (err)
+    {
+        case FR_OK:         return "success";
+        case FR_EIO:        return "I/O error";
+        case FR_ETIMEDOUT:  return "timed out";
+        case FR_ECKSUM:     return "bad checksum";
+        case FR_EPROTO:     return "unexpected reply";
+        case FR_EBUSY:      return "request queue full";
+        case FR_EINVAL:     return "invalid argument";
+        case FR_EOPEN:      return "can't open port";
+        default:            return "unknown error";
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: frTypeIdToStr
+ ***
+ *** DESCRIPTION:
+ ***   Convert the typeId of the inverter to a string.
+ ***
+ *** RETURN VALUE:
+ ***   Constant string name.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+const char *frTypeIdToStr(unsigned char typeId)
+{
+    switch (typeId)
+    {
+        case 0xFE:
+        return "FRONIUS IG 15";
+
+        case 0xFD:
+        return "FRONIUS IG 20";
+
+        case 0xFC:
+        return "FRONIUS IG 30";
+
+        case 0xFB:
+        return "FRONIUS IG 30 Dummy";
+
+        case 0xFA:
+        return "FRONIUS IG 40";
+
+        case 0xF9:
+        return "FRONIUS IG 60/IG 60 HV";
+
+        case 0xF6:
+        return "FRONIUS IG 300";
+
+        case 0xF5:
+        return "FRONIUS IG 400";
+
+        case 0xF4:
+        return "FRONIUS IG 500";
+
+        case 0xF3:
+        return "FRONIUS IG 60/IG 60 HV";
+
+        case 0xEE:
+        return "FRONIUS IG 2000";
+
+        case 0xED:
+        return "FRONIUS IG 3000";
+
+        case 0xEB:
+        return "FRONIUS IG 4000";
+
+        case 0xEA:
+        return "FRONIUS IG 5100";
+
+        case 0xE5:
+        return "FRONIUS IG 2500-LV";
+
+        case 0xE3:
+        return "FRONIUS IG 4500-LV";
+
+        case 0xFF:
+        default:
+        return "Unknown device";
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: setDeadline
+ ***
+ *** DESCRIPTION:
+ ***   Restart the reply timeout for the request on the wire.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void setDeadline(frCtx_t *ctx)
+{
+    clock_gettime(CLOCK_MONOTONIC, &ctx->deadline);
+    ctx->deadline.tv_sec  += ctx->timeoutMs / 1000;
+    ctx->deadline.tv_nsec += (ctx->timeoutMs % 1000) * 1000000L;
+    if (ctx->deadline.tv_nsec >= 1000000000L)
+    {
+        ctx->deadline.tv_sec++;
+        ctx->deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: msUntilDeadline
+ ***
+ *** DESCRIPTION:
+ ***   Work out how long until the request on the wire times out.
+ ***
+ *** RETURN VALUE:
+ ***   Milliseconds, 0 if the deadline has passed.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int msUntilDeadline(const frCtx_t *ctx)
+{
+    struct timespec now;
+    long long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (long long)(ctx->deadline.tv_sec - now.tv_sec) * 1000000000LL +
+         (ctx->deadline.tv_nsec - now.tv_nsec);
+    if (ns <= 0)
+        return 0;
+
+    // Round up so we don't spin on the last millisecond
+    return (ns + 999999) / 1000000;
+}
+
+/*********************************************************************
+ *** FUNCTION: doRead
+ ***
+ *** DESCRIPTION:
+ ***   Read whatever is available on the port.
+ ***
+ *** RETURN VALUE:
+ ***   Number of bytes read, 0 if there's nothing to read or FR_EIO.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int doRead(frCtx_t *ctx, unsigned char *buf, int len)
+{
+    int r;
+
+    if (ctx->io.read != NULL)
+    {
+        r = ctx->io.read(ctx->io.arg, buf, len);
+        return (r < 0) ? FR_EIO : r;
+    }
+
+    r = read(ctx->fd, buf, len);
+    if (r < 0)
+        return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : FR_EIO;
+    if (r == 0)
+        return FR_EIO;
+
+    return r;
+}
+
+/*********************************************************************
+ *** FUNCTION: doWrite
+ ***
+ *** DESCRIPTION:
+ ***   Write as much as the port will take right now.
+ ***
+ *** RETURN VALUE:
+ ***   Number of bytes written, which may be 0, or FR_EIO.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int doWrite(frCtx_t *ctx, const unsigned char *buf, int len)
+{
+    int r;
+
+    // A converter that has gone away mustn't raise SIGPIPE
+    if (ctx->io.write != NULL)
+        r = ctx->io.write(ctx->io.arg, buf, len);
+    else if (ctx->transport == FR_TRANSPORT_TCP)
+        r = send(ctx->fd, buf, len, MSG_NOSIGNAL);
+    else
+        r = write(ctx->fd, buf, len);
+
+    if (r < 0)
+        return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : FR_EIO;
+
+    return r;
+}
+
+/*********************************************************************
+ *** FUNCTION: finish
+ ***
+ *** DESCRIPTION:
+ ***   Move the request on the wire to the completion queue.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   The context is free for the next request.
+ *********************************************************************/
+static void finish(frCtx_t *ctx, frCompletion_t *c, int status)
+{
+    int slot = (ctx->doneHead + ctx->doneCount) % FR_QUEUE_LEN;
+
+    c->req = ctx->cur;
+    c->status = status;
+    if (ctx->io.now != NULL)
+    {
+        ctx->io.now(ctx->io.arg, &c->at);
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &c->at.mono);
+        clock_gettime(CLOCK_REALTIME, &c->at.real);
+    }
+    ctx->done[slot] = *c;
+    ctx->doneCount++;
+
+    ctx->busy  = 0;
+    ctx->rxLen = 0;
+
+    switch (status)
+    {
+        case FR_ETIMEDOUT:  ctx->stats.timeouts++;      break;
+        case FR_ECKSUM:     ctx->stats.cksumErrors++;   break;
+        case FR_EPROTO:     ctx->stats.protoErrors++;   break;
+        default:                                        break;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: fail
+ ***
+ *** DESCRIPTION:
+ ***   Finish the request on the wire with an error.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void fail(frCtx_t *ctx, int status)
+{
+    frCompletion_t c;
+
+    memset(&c.u, 0, sizeof(c.u));
+    finish(ctx, &c, status);
+}
+
+/*********************************************************************
+ *** FUNCTION: decode
+ ***
+ *** DESCRIPTION:
+ ***   Decode the reply to the request on the wire.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK or FR_EPROTO. The result is returned in c.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int decode(const msgHeader_t *hdr, frCompletion_t *c)
+{
+    short value;
+    signed char exponent;
+
+    memset(&c->u, 0, sizeof(c->u));
+
+    switch (hdr->command)
+    {
+        case GET_VERSION:
+        {
+            if (hdr->length < 3)
+                return FR_EPROTO;
+
+            c->u.version.major   = hdr->data[0];
+            c->u.version.minor   = hdr->data[1];
+            c->u.version.release = hdr->data[2];
+        }
+        break;
+
+        case GET_ACTIVE_INVERTER:
+        {
+            // An empty list means no inverter is active
+            c->u.active = (hdr->length == 0) ? 0 : hdr->data[0];
+        }
+        break;
+
+        case GET_DEVICE_TYPE:
+        {
+            if (hdr->length != 1)
+                return FR_EPROTO;
+
+            c->u.typeId = hdr->data[0];
+        }
+        break;
+
+        default:
+        {
+            if (hdr->length != 3)
+                return FR_EPROTO;
+
+            memcpy(&value, hdr->data, 2);
+            value = ntohs(value);
+            exponent = (signed char)hdr->data[2];
+            if ((exponent < -3) || (exponent > 10))
+                return FR_EPROTO;
+
+            // Only the temperature command returns a signed value
+            if (hdr->command != GET_AMBIENT_TEMPERATURE)
+                c->u.value = (unsigned short)value * powf(10, exponent);
+            else
+                c->u.value = value * powf(10, exponent);
+        }
+        break;
+    }
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: parse
+ ***
+ *** DESCRIPTION:
+ ***   Look for a complete reply in the receive buffer. Bytes in front
+ ***   of the start flag are thrown away, so the parser resyncs after
+ ***   line noise.
+ ***
+ *** RETURN VALUE:
+ ***   1 if the request on the wire was finished, 0 if more bytes are
+ ***   needed.
+ ***
+ *** SIDE EFFECTS:
+ ***   Consumes bytes from the receive buffer.
+ *********************************************************************/
+static int parse(frCtx_t *ctx)
+{
+    static const unsigned char start[] = { 0x80, 0x80, 0x80 };
+    msgHeader_t *hdr;
+    frCompletion_t c;
+    unsigned char cksum;
+    int frameLen;
+    int i, j;
+
+    for ( ; ; )
+    {
+        // Find the start flag
+        for (i=0; i+3<=ctx->rxLen; i++)
+        {
+            if (memcmp(&ctx->rx[i], start, 3) == 0)
+                break;
+        }
+        if (i > 0)
+        {
+            memmove(ctx->rx, &ctx->rx[i], ctx->rxLen - i);
+            ctx->rxLen -= i;
+        }
+
+        // Check if there's enough in the buffer before processing
+        if (ctx->rxLen < sizeof(msgHeader_t))
+            return 0;
+
+        hdr = (msgHeader_t *)ctx->rx;
+        frameLen = sizeof(msgHeader_t) + hdr->length + 1;
+        if (ctx->rxLen < frameLen)
+            return 0;
+
+        // Checksum covers everything after the start flag
+        cksum = 0;
+        for (j=sizeof(hdr->start); j<frameLen-1; j++)
+            cksum += ctx->rx[j];
+
+        if (cksum != ctx->rx[frameLen-1])
+        {
+            if (ctx->frameHook != NULL)
+                ctx->frameHook(ctx->frameArg, FR_FRAME_RX, ctx->rx, ctx->rxLen,
+                               FR_FRAME_BAD_CKSUM);
+            fail(ctx, FR_ECKSUM);
+            return 1;
+        }
+
+        ctx->stats.rxFrames++;
+        if (ctx->frameHook != NULL)
+            ctx->frameHook(ctx->frameArg, FR_FRAME_RX, ctx->rx, frameLen, 0);
+
+        // A late reply to an earlier request that timed out. Drop it
+        // and keep waiting for ours.
+        if (hdr->command != ctx->cur.command)
+        {
+            ctx->stats.protoErrors++;
+            memmove(ctx->rx, &ctx->rx[frameLen], ctx->rxLen - frameLen);
+            ctx->rxLen -= frameLen;
+            continue;
+        }
+
+        finish(ctx, &c, decode(hdr, &c));
+        return 1;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: startNext
+ ***
+ *** DESCRIPTION:
+ ***   Take the next request off the queue and build its frame.
+ ***
+ *** RETURN VALUE:
+ ***   1 if a request was started, 0 if the queue is empty.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int startNext(frCtx_t *ctx)
+{
+    msgHeader_t *hdr = (msgHeader_t *)ctx->tx;
+    unsigned char cksum = 0;
+    int i;
+
+    if (ctx->busy || (ctx->queueCount == 0))
+        return 0;
+
+    ctx->cur = ctx->queue[ctx->queueHead];
+    ctx->queueHead = (ctx->queueHead + 1) % FR_QUEUE_LEN;
+    ctx->queueCount--;
+
+    // Build the header. None of the requests carry any data.
+    hdr->start[0] = 0x80;
+    hdr->start[1] = 0x80;
+    hdr->start[2] = 0x80;
+    hdr->length   = 0;
+    hdr->device   = ctx->cur.device;
+    hdr->number   = ctx->cur.number;
+    hdr->command  = ctx->cur.command;
+
+    // Compute the checksum
+    for (i=sizeof(hdr->start); i<sizeof(*hdr); i++)
+    {
+        cksum += ctx->tx[i];
+    }
+    ctx->tx[i] = cksum;
+
+    ctx->txLen = sizeof(*hdr) + 1;
+    ctx->txOff = 0;
+
+    // Anything still sitting in the receive buffer belongs to an
+    // earlier request.
+    ctx->rxLen = 0;
+    ctx->busy  = 1;
+    setDeadline(ctx);
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: frSubmit
+ ***
+ *** DESCRIPTION:
+ ***   Queue a request. Nothing is sent until frProcess() is called.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK, or FR_EBUSY if there are already FR_QUEUE_LEN requests
+ ***   that haven't been collected with frComplete().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frSubmit(frCtx_t *ctx, const frRequest_t *req)
+{
+    if (ctx->queueCount + ctx->busy + ctx->doneCount >= FR_QUEUE_LEN)
+        return FR_EBUSY;
+
+    ctx->queue[(ctx->queueHead + ctx->queueCount) % FR_QUEUE_LEN] = *req;
+    ctx->queueCount++;
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: frSubmitVersion
+ ***
+ *** DESCRIPTION:
+ ***   Queue a request for the software version of the interface card.
+ ***
+ *** RETURN VALUE:
+ ***   See frSubmit().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frSubmitVersion(frCtx_t *ctx, int tag)
+{
+    frRequest_t req = { FR_DEVICE_IFCARD, 0, GET_VERSION, tag };
+
+    return frSubmit(ctx, &req);
+}
+
+/*********************************************************************
+ *** FUNCTION: frSubmitActiveInverter
+ ***
+ *** DESCRIPTION:
+ ***   Queue a request for the number of the active inverter.
+ ***
+ *** RETURN VALUE:
+ ***   See frSubmit().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frSubmitActiveInverter(frCtx_t *ctx, int tag)
+{
+    frRequest_t req = { FR_DEVICE_IFCARD, 0, GET_ACTIVE_INVERTER, tag };
+
+    return frSubmit(ctx, &req);
+}
+
+/*********************************************************************
+ *** FUNCTION: frSubmitDeviceType
+ ***
+ *** DESCRIPTION:
+ ***   Queue a request for the device type of an inverter.
+ ***
+ *** RETURN VALUE:
+ ***   See frSubmit().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frSubmitDeviceType(frCtx_t *ctx, unsigned char number, int tag)
+{
+    frRequest_t req = { FR_DEVICE_INVERTER, number, GET_DEVICE_TYPE, tag };
+
+    return frSubmit(ctx, &req);
+}
+
+/*********************************************************************
+ *** FUNCTION: frSubmitNumeric
+ ***
+ *** DESCRIPTION:
+ ***   Queue a request for one of the numeric parameters of an inverter.
+ ***
+ *** RETURN VALUE:
+ ***   See frSubmit(). FR_EINVAL if cmd isn't a numeric command.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frSubmitNumeric(frCtx_t *ctx, unsigned char number, unsigned char cmd, int tag)
+{
+    frRequest_t req = { FR_DEVICE_INVERTER, number, cmd, tag };
+
+    if ((cmd < GET_POWER_NOW) || (cmd > GET_REAR_RIGHT_FAN_SPEED))
+        return FR_EINVAL;
+
+    return frSubmit(ctx, &req);
+}
+
+/*********************************************************************
+ *** FUNCTION: frFd
+ ***
+ *** DESCRIPTION:
+ ***   Get the fd the caller's event loop should wait on.
+ ***
+ *** RETURN VALUE:
+ ***   The fd, or -1 if the context has no pollable fd.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frFd(const frCtx_t *ctx)
+{
+    return ctx->fd;
+}
+
+/*********************************************************************
+ *** FUNCTION: frEvents
+ ***
+ *** DESCRIPTION:
+ ***   Get the poll() events to wait for on frFd().
+ ***
+ *** RETURN VALUE:
+ ***   POLLIN and/or POLLOUT, 0 if the context is idle.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frEvents(const frCtx_t *ctx)
+{
+    if (!ctx->busy)
+        return 0;
+
+    return (ctx->txOff < ctx->txLen) ? POLLOUT : POLLIN;
+}
+
+/*********************************************************************
+ *** FUNCTION: frTimeout
+ ***
+ *** DESCRIPTION:
+ ***   Get the longest time the caller's event loop may wait before
+ ***   calling frProcess() again.
+ ***
+ *** RETURN VALUE:
+ ***   Milliseconds, or -1 if there's nothing to do.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frTimeout(const frCtx_t *ctx)
+{
+    if (ctx->busy)
+        return msUntilDeadline(ctx);
+
+    return (ctx->queueCount > 0) ? 0 : -1;
+}
+
+/*********************************************************************
+ *** FUNCTION: frProcess
+ ***
+ *** DESCRIPTION:
+ ***   Do whatever I/O the port is ready for: send queued requests,
+ ***   read and parse replies and time out requests that got no reply.
+ ***   Never blocks.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK, or FR_EIO if reading or writing the port failed. The
+ ***   request on the wire is completed with the same error.
+ ***
+ *** SIDE EFFECTS:
+ ***   Finished requests are queued for frComplete().
+ *********************************************************************/
+int frProcess(frCtx_t *ctx)
+{
+    int ret = FR_OK;
+    int r;
+
+    for ( ; ; )
+    {
+        if (!ctx->busy && !startNext(ctx))
+            break;
+
+        // Send the request
+        if (ctx->txOff < ctx->txLen)
+        {
+            r = doWrite(ctx, &ctx->tx[ctx->txOff], ctx->txLen - ctx->txOff);
+            if (r < 0)
+            {
+                fail(ctx, FR_EIO);
+                ret = FR_EIO;
+                continue;
+            }
+            ctx->txOff += r;
+            if (ctx->txOff < ctx->txLen)
+            {
+                // A connection that never comes up, or a port that
+                // never drains
+                if ((ctx->fd >= 0) && (msUntilDeadline(ctx) == 0))
+                {
+                    fail(ctx, FR_ETIMEDOUT);
+                    continue;
+                }
+                break;
+            }
+
+            ctx->stats.txFrames++;
+            if (ctx->frameHook != NULL)
+                ctx->frameHook(ctx->frameArg, FR_FRAME_TX, ctx->tx, ctx->txLen, 0);
+            setDeadline(ctx);
+        }
+
+        // Read whatever has arrived
+        for ( ; ; )
+        {
+            r = doRead(ctx, &ctx->rx[ctx->rxLen], sizeof(ctx->rx) - ctx->rxLen);
+            if (r <= 0)
+                break;
+
+            ctx->rxLen += r;
+            setDeadline(ctx);
+            if (parse(ctx))
+                break;
+
+            // A full buffer that doesn't parse is noise
+            if (ctx->rxLen == sizeof(ctx->rx))
+                ctx->rxLen = 0;
+        }
+        if (r < 0)
+        {
+            fail(ctx, FR_EIO);
+            ret = FR_EIO;
+            continue;
+        }
+        if (!ctx->busy)
+            continue;
+
+        // Without an fd to wait on, a dry source is as good as a timeout
+        if ((ctx->fd < 0) || (msUntilDeadline(ctx) == 0))
+        {
+            if ((ctx->rxLen > 0) && (ctx->frameHook != NULL))
+                ctx->frameHook(ctx->frameArg, FR_FRAME_RX, ctx->rx, ctx->rxLen,
+                               FR_FRAME_INCOMPLETE);
+            fail(ctx, FR_ETIMEDOUT);
+            continue;
+        }
+        break;
+    }
+
+    return ret;
+}
+
+/*********************************************************************
+ *** FUNCTION: frComplete
+ ***
+ *** DESCRIPTION:
+ ***   Collect the result of a finished request.
+ ***
+ *** RETURN VALUE:
+ ***   1 if a result was returned in c, 0 if nothing has finished.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frComplete(frCtx_t *ctx, frCompletion_t *c)
+{
+    if (ctx->doneCount == 0)
+        return 0;
+
+    *c = ctx->done[ctx->doneHead];
+    ctx->doneHead = (ctx->doneHead + 1) % FR_QUEUE_LEN;
+    ctx->doneCount--;
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: frPending
+ ***
+ *** DESCRIPTION:
+ ***   Count the requests that haven't been collected yet.
+ ***
+ *** RETURN VALUE:
+ ***   Queued, in flight and finished requests.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frPending(const frCtx_t *ctx)
+{
+    return ctx->queueCount + ctx->busy + ctx->doneCount;
+}
+
+/*********************************************************************
+ *** FUNCTION: frWait
+ ***
+ *** DESCRIPTION:
+ ***   Block until the next request finishes.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK with the result in c, or FR_EINVAL if nothing is pending.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frWait(frCtx_t *ctx, frCompletion_t *c)
+{
+    struct pollfd pfd;
+
+    for ( ; ; )
+    {
+        frProcess(ctx);
+        if (frComplete(ctx, c))
+            return FR_OK;
+
+        if (frPending(ctx) == 0)
+            return FR_EINVAL;
+
+        if (ctx->fd >= 0)
+        {
+            pfd.fd = ctx->fd;
+            pfd.events = frEvents(ctx);
+            pfd.revents = 0;
+            poll(&pfd, 1, frTimeout(ctx));
+        }
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: waitFor
+ ***
+ *** DESCRIPTION:
+ ***   Submit a request and block until it's finished.
+ ***
+ *** RETURN VALUE:
+ ***   Status of the request. The result is returned in c.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int waitFor(frCtx_t *ctx, const frRequest_t *req, frCompletion_t *c)
+{
+    int r;
+
+    r = frSubmit(ctx, req);
+    if (r != FR_OK)
+        return r;
+
+    r = frWait(ctx, c);
+    if (r != FR_OK)
+        return r;
+
+    return c->status;
+}
+
+/*********************************************************************
+ *** FUNCTION: frGetVersion
+ ***
+ *** DESCRIPTION:
+ ***   Get the software version of the interface card. Blocking, don't
+ ***   mix with the frSubmit*() calls on the same context.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK or FR_E*. Software versions are returned in major, minor
+ ***   and release.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frGetVersion(frCtx_t *ctx, unsigned char *major, unsigned char *minor,
+                 unsigned char *release)
+{
+    frRequest_t req = { FR_DEVICE_IFCARD, 0, GET_VERSION, 0 };
+    frCompletion_t c;
+    int r;
+
+    r = waitFor(ctx, &req, &c);
+    if (r != FR_OK)
+        return r;
+
+    *major   = c.u.version.major;
+    *minor   = c.u.version.minor;
+    *release = c.u.version.release;
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: frGetActiveInverter
+ ***
+ *** DESCRIPTION:
+ ***   Get the number of the active inverter. Blocking.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK or FR_E*. ID number of active inverter is returned in
+ ***   active, 0 if no inverters are active.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frGetActiveInverter(frCtx_t *ctx, unsigned char *active)
+{
+    frRequest_t req = { FR_DEVICE_IFCARD, 0, GET_ACTIVE_INVERTER, 0 };
+    frCompletion_t c;
+    int r;
+
+    r = waitFor(ctx, &req, &c);
+    if (r != FR_OK)
+        return r;
+
+    *active = c.u.active;
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: frGetDeviceType
+ ***
+ *** DESCRIPTION:
+ ***   Get the device type of an inverter. Blocking.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK or FR_E*. Device type returned in typeId.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frGetDeviceType(frCtx_t *ctx, unsigned char number, unsigned char *typeId)
+{
+    frRequest_t req = { FR_DEVICE_INVERTER, number, GET_DEVICE_TYPE, 0 };
+    frCompletion_t c;
+    int r;
+
+    r = waitFor(ctx, &req, &c);
+    if (r != FR_OK)
+        return r;
+
+    *typeId = c.u.typeId;
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: frGetNumeric
+ ***
+ *** DESCRIPTION:
+ ***   Get a numeric parameter from an inverter. Blocking.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK or FR_E*. Value returned in f.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frGetNumeric(frCtx_t *ctx, unsigned char number, unsigned char cmd, float *f)
+{
+    return frGetNumericAt(ctx, number, cmd, f, NULL);
+}
+
+/*********************************************************************
+ *** FUNCTION: frGetNumericAt
+ ***
+ *** DESCRIPTION:
+ ***   Get a numeric parameter from an inverter along with the time the
+ ***   reply came in. Blocking.
+ ***
+ *** RETURN VALUE:
+ ***   FR_OK or FR_E*. Value returned in f, the time in at unless at is
+ ***   NULL.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frGetNumericAt(frCtx_t *ctx, unsigned char number, unsigned char cmd, float *f,
+                   frStamp_t *at)
+{
+    frRequest_t req = { FR_DEVICE_INVERTER, number, cmd, 0 };
+    frCompletion_t c;
+    int r;
+
+    if ((cmd < GET_POWER_NOW) || (cmd > GET_REAR_RIGHT_FAN_SPEED))
+        return FR_EINVAL;
+
+    r = waitFor(ctx, &req, &c);
+    if (r != FR_OK)
+        return r;
+
+    *f = c.u.value;
+    if (at != NULL)
+        *at = c.at;
+
+    return FR_OK;
+}
+
+/*********************************************************************
+ *** FUNCTION: frNegotiateBaud
+ ***
+ *** DESCRIPTION:
+ ***   Find the fastest line rate the interface card answers on without
+ ***   errors. Each rate slower than below (0 for any rate) is tried in
+ ***   turn with a burst of FR_BAUD_BURST version requests, every one of
+ ***   which has to come back. Blocking.
+ ***
+ *** RETURN VALUE:
+ ***   The rate picked, left set on the port. FR_E* if no rate worked,
+ ***   in which case the port is put back to the rate it was on.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frNegotiateBaud(frCtx_t *ctx, int below)
+{
+    unsigned char major, minor, release;
+    int oldBaud = ctx->baud;
+    int oldTimeout = ctx->timeoutMs;
+    int r = FR_EINVAL;
+    int i, k;
+
+    // A converter's line rate is set on the converter
+    if ((ctx->fd < 0) || (ctx->transport != FR_TRANSPORT_TTY) || frPending(ctx))
+        return FR_EINVAL;
+
+    // A wrong rate gets no sensible reply at all, don't wait long for it
+    ctx->timeoutMs = FR_BAUD_PROBE_MS;
+
+    for (i=0; i<BAUD_COUNT; i++)
+    {
+        if ((below != 0) && (bauds[i].baud >= below))
+            continue;
+
+        r = frSetBaud(ctx, bauds[i].baud);
+        if (r != FR_OK)
+            continue;
+
+        for (k=0; k<FR_BAUD_BURST; k++)
+        {
+            r = frGetVersion(ctx, &major, &minor, &release);
+            if (r != FR_OK)
+                break;
+        }
+
+        if (r == FR_OK)
+        {
+            ctx->timeoutMs = oldTimeout;
+
+            // The burst doesn't count against the new rate
+            frSetBaud(ctx, bauds[i].baud);
+            return bauds[i].baud;
+        }
+    }
+
+    ctx->timeoutMs = oldTimeout;
+    if (oldBaud != 0)
+        frSetBaud(ctx, oldBaud);
+
+    return r;
+}
+
+/*********************************************************************
+ *** FUNCTION: frCheckBaud
+ ***
+ *** DESCRIPTION:
+ ***   Drop to a slower line rate if too many replies have failed the
+ ***   checksum since the last check. Call every so often between
+ ***   requests. Blocking if it has to renegotiate.
+ ***
+ *** RETURN VALUE:
+ ***   The rate picked if it had to negotiate again, 0 if it didn't,
+ ***   FR_E* if no rate could be found.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int frCheckBaud(frCtx_t *ctx)
+{
+    unsigned long errors;
+    int r;
+
+    if ((ctx->baud == 0) || (ctx->stats.txFrames - ctx->baudTxFrames < FR_BAUD_WINDOW))
+        return 0;
+
+    errors = ctx->stats.cksumErrors - ctx->baudCksumErrors;
+    ctx->baudTxFrames    = ctx->stats.txFrames;
+    ctx->baudCksumErrors = ctx->stats.cksumErrors;
+    if (errors <= FR_BAUD_MAX_ERRORS)
+        return 0;
+
+    // Try slower rates first. If none of those answer, the card may
+    // have been set up again, so try them all.
+    r = frNegotiateBaud(ctx, ctx->baud);
+    if (r < 0)
+        r = frNegotiateBaud(ctx, 0);
+
+    return r;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,305 @@
+/*********************************************************************
+ *** FILE: fronius.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+// Fronius interface card protocol library.
+//
+// Requests are queued with the frSubmit*() calls and never block. The
+// caller's event loop waits for frEvents() on frFd() (or until
+// frTimeout() runs out), then calls frProcess() and collects results
+// with frComplete(). Nothing in here ever exits; every error comes back
+// as one of the FR_E* codes.
+//
+// frGetVersion() and friends are blocking wrappers for simple callers.
+//
+// A port is a local serial port or a TCP connection to a serial to
+// Ethernet converter. Past opening them, both are just an fd.
+
+#ifndef FRONIUS_H
+#define FRONIUS_H
+
+/* SYSTEM INCLUDE FILES */
+#include <time.h>
+#include <sys/socket.h>
+
+/* DEFINES */
+
+// Return codes
+#define FR_OK           0
+#define FR_EIO         -1   // Read or write on the port failed
+#define FR_ETIMEDOUT   -2   // No reply in time
+#define FR_ECKSUM      -3   // Reply failed the checksum test
+#define FR_EPROTO      -4   // Reply didn't make sense for the request
+#define FR_EBUSY       -5   // Request queue is full
+#define FR_EINVAL      -6   // Bad argument
+#define FR_EOPEN       -7   // Couldn't open or set up the port
+
+// Devices that can be addressed
+#define FR_DEVICE_IFCARD    0
+#define FR_DEVICE_INVERTER  1
+
+// Requests that can be queued on a context before FR_EBUSY
+#define FR_QUEUE_LEN        64
+
+// Largest frame: header, 255 data bytes and the checksum
+#define FR_MAX_FRAME        (sizeof(msgHeader_t) + 255 + 1)
+
+// Default reply timeout, restarted whenever bytes arrive
+#define FR_TIMEOUT_MS       1000
+
+// Rate the interface card ships configured for
+#define FR_BAUD_DEFAULT     19200
+
+// Baud negotiation. Each rate has to answer FR_BAUD_BURST version
+// requests in a row, FR_BAUD_PROBE_MS apart at most. Once running, more
+// than FR_BAUD_MAX_ERRORS bad checksums in FR_BAUD_WINDOW received
+// frames drops to a slower rate.
+#define FR_BAUD_BURST       20
+#define FR_BAUD_PROBE_MS    250
+#define FR_BAUD_WINDOW      200
+#define FR_BAUD_MAX_ERRORS  5
+
+// Directions passed to the frame hook
+#define FR_FRAME_TX         0
+#define FR_FRAME_RX         1
+
+// Flags passed to the frame hook
+#define FR_FRAME_BAD_CKSUM  0x01
+#define FR_FRAME_INCOMPLETE 0x02
+
+// What a context's fd is connected to
+#define FR_TRANSPORT_TTY    0   // A local serial port
+#define FR_TRANSPORT_TCP    1   // A serial to Ethernet converter
+
+// An endpoint given as "tcp:host:port" is a converter (ser2net and the
+// like), anything else is the path of a serial port
+#define FR_TCP_PREFIX       "tcp:"
+#define FR_ENDPOINT_MAX     128
+
+/* TYPEDEFS */
+
+// Commands supported by the inverter
+typedef enum
+{
+    GET_VERSION               = 0x01,
+    GET_DEVICE_TYPE           = 0x02,
+    GET_ACTIVE_INVERTER       = 0x04,
+    GET_POWER_NOW             = 0x10,
+    GET_ENERGY_TOTAL          = 0x11,
+    GET_ENERGY_DAY            = 0x12,
+    GET_ENERGY_YEAR           = 0x13,
+    GET_AC_CURRENT_NOW        = 0x14,
+    GET_AC_VOLTAGE_NOW        = 0x15,
+    GET_AC_FREQUENCY_NOW      = 0x16,
+    GET_DC_CURRENT_NOW        = 0x17,
+    GET_DC_VOLTAGE_NOW        = 0x18,
+    GET_YIELD_DAY             = 0x19,
+    GET_MAX_POWER_DAY         = 0x1A,
+    GET_MAX_AC_VOLTAGE_DAY    = 0x1B,
+    GET_MIN_AC_VOLTAGE_DAY    = 0x1C,
+    GET_MAX_DC_VOLTAGE_DAY    = 0x1D,
+    GET_OPERATING_HOURS_DAY   = 0x1E,
+    GET_YIELD_YEAR            = 0x1F,
+    GET_MAX_POWER_YEAR        = 0x20,
+    GET_MAX_AC_VOLTAGE_YEAR   = 0x21,
+    GET_MIN_AC_VOLTAGE_YEAR   = 0x22,
+    GET_MAX_DC_VOLTAGE_YEAR   = 0x23,
+    GET_OPERATING_HOURS_YEAR  = 0x24,
+    GET_YIELD_TOTAL           = 0x25,
+    GET_MAX_POWER_TOTAL       = 0x26,
+    GET_MAX_AC_VOLTAGE_TOTAL  = 0x27,
+    GET_MIN_AC_VOLTAGE_TOTAL  = 0x28,
+    GET_MAX_DC_VOLTAGE_TOTAL  = 0x29,
+    GET_OPERATING_HOURS_TOTAL = 0x2A,
+    GET_PHASE_1_CURRENT       = 0x2B,
+    GET_PHASE_2_CURRENT       = 0x2C,
+    GET_PHASE_3_CURRENT       = 0x2D,
+    GET_PHASE_1_VOLTAGE       = 0x2E,
+    GET_PHASE_2_VOLTAGE       = 0x2F,
+    GET_PHASE_3_VOLTAGE       = 0x30,
+    GET_AMBIENT_TEMPERATURE   = 0x31,
+    GET_FRONT_LEFT_FAN_SPEED  = 0x32,
+    GET_FRONT_RIGHT_FAN_SPEED = 0x33,
+    GET_REAR_LEFT_FAN_SPEED   = 0x34,
+    GET_REAR_RIGHT_FAN_SPEED  = 0x35
+} cmd_t;
+
+// Fronius message header
+typedef struct
+{
+    unsigned char start[3];
+    unsigned char length;
+    unsigned char device;
+    unsigned char number;
+    unsigned char command;
+    unsigned char data[0];
+} __attribute__((__packed__)) msgHeader_t;
+
+// A queued request
+typedef struct
+{
+    unsigned char device;   // FR_DEVICE_*
+    unsigned char number;   // Inverter number, 0 for the interface card
+    unsigned char command;  // cmd_t
+    int           tag;      // Passed back untouched in the completion
+} frRequest_t;
+
+// When something happened, on both clocks
+typedef struct
+{
+    struct timespec mono;   // CLOCK_MONOTONIC
+    struct timespec real;   // CLOCK_REALTIME
+} frStamp_t;
+
+// The result of a request
+typedef struct
+{
+    frRequest_t req;
+    int         status;     // FR_OK or FR_E*
+    frStamp_t   at;         // When the reply came in or the request failed
+    union
+    {
+        struct
+        {
+            unsigned char major;
+            unsigned char minor;
+            unsigned char release;
+        } version;          // GET_VERSION
+        unsigned char active;   // GET_ACTIVE_INVERTER, 0 if none active
+        unsigned char typeId;   // GET_DEVICE_TYPE
+        float value;            // All the numeric commands
+    } u;
+} frCompletion_t;
+
+// Where a port is. A converter's address is looked up once, when the
+// endpoint is parsed, so reconnecting never has to.
+typedef struct
+{
+    int                     transport;  // FR_TRANSPORT_*
+    char                    spec[FR_ENDPOINT_MAX];  // As given
+    struct sockaddr_storage addr;       // FR_TRANSPORT_TCP
+    socklen_t               addrLen;
+} frEndpoint_t;
+
+// Byte I/O. By default the context reads and writes its fd, these let
+// something else stand in for the port (a replayed capture for example).
+// read returns the number of bytes read, 0 if there's nothing to read
+// right now or < 0 on error. write returns the number of bytes written
+// or < 0 on error. A context without a pollable fd never waits: once
+// read has nothing more to give, the request has timed out. now, if
+// set, stands in for the clocks the completions are stamped with.
+typedef struct
+{
+    int  (*read)(void *arg, unsigned char *buf, int len);
+    int  (*write)(void *arg, const unsigned char *buf, int len);
+    void  *arg;
+    void (*now)(void *arg, frStamp_t *at);
+} frIo_t;
+
+// Called with every frame sent or received, for logging or capture
+typedef void (*frFrameHook_t)(void *arg, int dir, const unsigned char *buf, int len,
+                              int flags);
+
+// Counters kept by each context
+typedef struct
+{
+    unsigned long txFrames;
+    unsigned long rxFrames;
+    unsigned long timeouts;
+    unsigned long cksumErrors;
+    unsigned long protoErrors;
+} frStats_t;
+
+// Protocol state for one port. Everything is inline, a context never
+// allocates memory.
+typedef struct
+{
+    int            fd;          // -1 if the port has no pollable fd
+    int            transport;   // FR_TRANSPORT_*
+    frIo_t         io;
+    frFrameHook_t  frameHook;
+    void          *frameArg;
+    int            timeoutMs;
+    int            baud;        // Line rate, 0 if not a serial port
+
+    // Submitted requests waiting to go out
+    frRequest_t    queue[FR_QUEUE_LEN];
+    int            queueHead;
+    int            queueCount;
+
+    // Request currently on the wire
+    int            busy;
+    frRequest_t    cur;
+    unsigned char  tx[FR_MAX_FRAME];
+    int            txLen;
+    int            txOff;
+    unsigned char  rx[2 * FR_MAX_FRAME];
+    int            rxLen;
+    struct timespec deadline;
+
+    // Finished requests waiting for frComplete()
+    frCompletion_t done[FR_QUEUE_LEN];
+    int            doneHead;
+    int            doneCount;
+
+    frStats_t      stats;
+
+    // Counters when the error rate was last checked by frCheckBaud()
+    unsigned long  baudTxFrames;
+    unsigned long  baudCksumErrors;
+} frCtx_t;
+
+/* FUNCTION PROTOTYPES */
+int  frOpenPort(const char *port, int baud);
+int  frParseEndpoint(const char *spec, frEndpoint_t *ep);
+int  frOpenEndpoint(const frEndpoint_t *ep, int baud);
+void frInit(frCtx_t *ctx, int fd);
+void frSetFd(frCtx_t *ctx, int fd);
+void frSetIo(frCtx_t *ctx, const frIo_t *io);
+void frSetFrameHook(frCtx_t *ctx, frFrameHook_t hook, void *arg);
+int  frSetBaud(frCtx_t *ctx, int baud);
+const char *frStrError(int err);
+const char *frTypeIdToStr(unsigned char typeId);
+
+// Non-blocking interface
+int  frSubmit(frCtx_t *ctx, const frRequest_t *req);
+int  frSubmitVersion(frCtx_t *ctx, int tag);
+int  frSubmitActiveInverter(frCtx_t *ctx, int tag);
+int  frSubmitDeviceType(frCtx_t *ctx, unsigned char number, int tag);
+int  frSubmitNumeric(frCtx_t *ctx, unsigned char number, unsigned char cmd, int tag);
+int  frFd(const frCtx_t *ctx);
+int  frEvents(const frCtx_t *ctx);
+int  frTimeout(const frCtx_t *ctx);
+int  frProcess(frCtx_t *ctx);
+int  frComplete(frCtx_t *ctx, frCompletion_t *c);
+int  frPending(const frCtx_t *ctx);
+
+// Blocking interface
+int  frWait(frCtx_t *ctx, frCompletion_t *c);
+int  frGetVersion(frCtx_t *ctx, unsigned char *major, unsigned char *minor,
+                  unsigned char *release);
+int  frGetActiveInverter(frCtx_t *ctx, unsigned char *active);
+int  frGetDeviceType(frCtx_t *ctx, unsigned char number, unsigned char *typeId);
+int  frGetNumeric(frCtx_t *ctx, unsigned char number, unsigned char cmd, float *f);
+int  frGetNumericAt(frCtx_t *ctx, unsigned char number, unsigned char cmd, float *f,
+                    frStamp_t *at);
+int  frNegotiateBaud(frCtx_t *ctx, int below);
+int  frCheckBaud(frCtx_t *ctx);
+
+#endif // FRONIUS_H
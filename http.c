@@ -0,0 +1,1259 @@
+/*********************************************************************
+ *** FILE: http.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// A small HTTP server, on its own thread, answering range queries over
+// the history for charts:
+//
+//   GET /metrics
+//   GET /query?metric=POWER_NOW&from=2026-06-01&to=2026-06-30&step=300
+//
+// from and to are seconds since the epoch or local times written as
+// yyyy-mm-dd[Thh:mm[:ss]]; a date on its own for to means the end of
+// that day. step is the bucket size in seconds, 0 (the default) for
+// every sample, and agg picks avg (the default), min or max per bucket.
+//
+// Samples still in the store come from there, older ones from data.csv
+// in the day directories. A day file is decoded once per metric and
+// kept in a small LRU cache. The answer is sent as a chunked JSON
+// document as it's worked out, so it takes the same memory whatever
+// the range. One client is served at a time.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+/* INCLUDE FILES */
+#include "http.h"
+#include "csv.h"
+#include "deadband.h"
+
+/* DEFINES */
+
+// Room kept in front of a chunk for its length line
+#define CHUNK_HEAD          10
+
+// Ways of combining the samples in a bucket
+#define AGG_AVG             0
+#define AGG_MIN             1
+#define AGG_MAX             2
+
+/* TYPEDEFS */
+
+// One metric of one day file, decoded
+typedef struct
+{
+    int           dayKey;   // yyyymmdd, 0 if the slot is free
+    int           metric;
+    off_t         size;     // data.csv as it was when decoded
+    time_t        mtime;
+    unsigned long used;     // When it was last used, for the LRU
+    int           count;    // Samples held
+    int           stride;   // Rows per sample kept
+    int64_t      *t;        // Sample times, seconds since the epoch
+    float        *v;
+} dayBlock_t;
+
+// Where the metric is in a day file, and in a change only file the
+// last value written, which holds until the next one
+typedef struct
+{
+    int   col;
+    int   changeOnly;
+    float held;
+} decode_t;
+
+// A bucket being filled
+typedef struct
+{
+    int64_t step;       // Seconds, 0 for every sample
+    int     agg;
+    int64_t start;      // Start of the bucket
+    int     n;
+    double  sum;
+    float   min;
+    float   max;
+    int     points;     // Points sent so far
+} bucket_t;
+
+// Everything the server thread has. The buffers all live in the block
+// handed to httpStart().
+typedef struct
+{
+    httpConfig_t  cfg;
+    pthread_t     thread;
+    int           listenFd;
+    int           metrics;
+    char          names[CSV_METRICS_MAX][CSV_NAME_MAX];
+    dayBlock_t    block[HTTP_CACHE_BLOCKS];
+    unsigned long clock;
+
+    int           fd;       // The client being served
+    int           failed;   // Set once a send to it fails
+    char         *req;      // HTTP_REQUEST_MAX
+    char         *out;      // CHUNK_HEAD + HTTP_CHUNK_MAX + 2
+    int           outLen;
+    char         *in;       // HTTP_READ_MAX
+    int64_t      *batchT;   // HTTP_BATCH
+    float        *batchV;
+} http_t;
+
+/* STATIC VARIABLES */
+static http_t hs;
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: httpFootprint
+ ***
+ *** DESCRIPTION:
+ ***   Work out how much memory the server needs.
+ ***
+ *** RETURN VALUE:
+ ***   Size in bytes of the block to pass to httpStart().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+size_t httpFootprint(void)
+{
+    return HTTP_REQUEST_MAX + (CHUNK_HEAD + HTTP_CHUNK_MAX + 2) + HTTP_READ_MAX +
+           HTTP_BATCH * (sizeof(int64_t) + sizeof(float)) +
+           HTTP_CACHE_BLOCKS * HTTP_DAY_SAMPLES * (sizeof(int64_t) + sizeof(float));
+}
+
+/*********************************************************************
+ *** FUNCTION: daysFromCivil
+ ***
+ *** DESCRIPTION:
+ ***   Count the days from 1970-01-01 to a date. Out of range days and
+ ***   months roll over into the next month or year.
+ ***
+ *** RETURN VALUE:
+ ***   Number of days.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int64_t daysFromCivil(int y, int m, int d)
+{
+    int64_t era;
+    int yoe, doy, doe;
+
+    y += (m - 1) / 12;
+    m = (m - 1) % 12 + 1;
+    y -= (m <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + doe - 719468 + d - 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: localToEpoch
+ ***
+ *** DESCRIPTION:
+ ***   Turn a local date and time into seconds since the epoch, taking
+ ***   the UTC offset from localtime_r(). Used instead of mktime(),
+ ***   which calls tzset() and allocates every time without TZ set.
+ ***
+ *** RETURN VALUE:
+ ***   Seconds since the epoch.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int64_t localToEpoch(int y, int mo, int d, int h, int mi, int s)
+{
+    int64_t utc = daysFromCivil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s;
+    time_t t = utc;
+    struct tm tmTime;
+    int i;
+
+    // Twice, in case the offset at the first guess is on the other
+    // side of a DST change
+    for (i=0; i<2; i++)
+    {
+        localtime_r(&t, &tmTime);
+        t = utc - tmTime.tm_gmtoff;
+    }
+
+    return t;
+}
+
+/*********************************************************************
+ *** FUNCTION: parseTime
+ ***
+ *** DESCRIPTION:
+ ***   Parse a from or to parameter.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 if it isn't a time. A date on its own is the
+ ***   start of that day, or its end if endOfDay is set.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int parseTime(const char *s, int endOfDay, int64_t *t)
+{
+    int y, mo, d, h = 0, mi = 0, sec = 0;
+    char sep;
+    char *end;
+    int n;
+
+    if (*s == '\0')
+        return 0;
+
+    *t = strtoll(s, &end, 10);
+    if (*end == '\0')
+        return 1;
+
+    n = sscanf(s, "%d-%d-%d%c%d:%d:%d", &y, &mo, &d, &sep, &h, &mi, &sec);
+    if ((n == 3) || ((n >= 6) && ((sep == 'T') || (sep == ' '))))
+    {
+        if ((n == 3) && endOfDay)
+            d++;
+        *t = localToEpoch(y, mo, d, h, mi, sec);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: sendAll
+ ***
+ *** DESCRIPTION:
+ ***   Send bytes to the client, unless an earlier send failed.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Sets failed if the client has gone or stopped reading.
+ *********************************************************************/
+static void sendAll(const char *buf, int len)
+{
+    int r;
+
+    while (!hs.failed && (len > 0))
+    {
+        r = send(hs.fd, buf, len, MSG_NOSIGNAL);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+        if (r <= 0)
+        {
+            hs.failed = 1;
+            break;
+        }
+        buf += r;
+        len -= r;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: flushChunk
+ ***
+ *** DESCRIPTION:
+ ***   Send what's been put in the output buffer as one chunk.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void flushChunk(void)
+{
+    char head[CHUNK_HEAD + 1];
+    int n;
+
+    if (hs.outLen == 0)
+        return;
+
+    n = snprintf(head, sizeof(head), "%x\r\n", hs.outLen);
+    memcpy(hs.out + CHUNK_HEAD - n, head, n);
+    memcpy(hs.out + CHUNK_HEAD + hs.outLen, "\r\n", 2);
+    sendAll(hs.out + CHUNK_HEAD - n, n + hs.outLen + 2);
+    hs.outLen = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: outAdd
+ ***
+ *** DESCRIPTION:
+ ***   Add bytes to the response, sending a chunk whenever the buffer
+ ***   fills up.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void outAdd(const char *buf, int len)
+{
+    int n;
+
+    while (len > 0)
+    {
+        n = HTTP_CHUNK_MAX - hs.outLen;
+        if (n > len)
+            n = len;
+        memcpy(hs.out + CHUNK_HEAD + hs.outLen, buf, n);
+        hs.outLen += n;
+        buf += n;
+        len -= n;
+        if (hs.outLen == HTTP_CHUNK_MAX)
+            flushChunk();
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: outStr
+ ***
+ *** DESCRIPTION:
+ ***   Add a string to the response.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void outStr(const char *s)
+{
+    outAdd(s, strlen(s));
+}
+
+/*********************************************************************
+ *** FUNCTION: sendError
+ ***
+ *** DESCRIPTION:
+ ***   Answer with an error status and a JSON message.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void sendError(int status, const char *reason, const char *msg)
+{
+    char buf[512];
+    char body[256];
+    int n, len;
+
+    n = snprintf(body, sizeof(body), "{\"error\":\"%s\"}\n", msg);
+    len = snprintf(buf, sizeof(buf),
+                   "HTTP/1.1 %d %s\r\n"
+                   "Content-Type: application/json\r\n"
+                   "Content-Length: %d\r\n"
+                   "Connection: close\r\n"
+                   "\r\n%s", status, reason, n, body);
+    sendAll(buf, len);
+}
+
+/*********************************************************************
+ *** FUNCTION: beginChunked
+ ***
+ *** DESCRIPTION:
+ ***   Send the headers of a streamed JSON response.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void beginChunked(void)
+{
+    static const char head[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
+    sendAll(head, sizeof(head) - 1);
+    hs.outLen = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: endChunked
+ ***
+ *** DESCRIPTION:
+ ***   Send the last of a streamed response and the end marker.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void endChunked(void)
+{
+    flushChunk();
+    sendAll("0\r\n\r\n", 5);
+}
+
+/*********************************************************************
+ *** FUNCTION: findColumn
+ ***
+ *** DESCRIPTION:
+ ***   Find a metric's column in a CSV header line from a day file.
+ ***
+ *** RETURN VALUE:
+ ***   Column number, -1 if the file doesn't have it.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int findColumn(const char *line, const char *name)
+{
+    int col = 0;
+    int len = strlen(name);
+    const char *p = line;
+
+    while ((*p != '\0') && (*p != '\n'))
+    {
+        if ((strncmp(p, name, len) == 0) &&
+            ((p[len] == ' ') || (p[len] == ',') || (p[len] == '\n') ||
+             (p[len] == '\r') || (p[len] == '\0')))
+        {
+            return col;
+        }
+        while ((*p != ',') && (*p != '\0') && (*p != '\n'))
+            p++;
+        if (*p == ',')
+            p++;
+        col++;
+    }
+
+    return -1;
+}
+
+/*********************************************************************
+ *** FUNCTION: blockAdd
+ ***
+ *** DESCRIPTION:
+ ***   Add a sample to a day block. When it's full every other sample
+ ***   is dropped and from then on only every other row is kept.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void blockAdd(dayBlock_t *b, int row, int64_t t, float v)
+{
+    int i;
+
+    if ((row % b->stride) != 0)
+        return;
+
+    if (b->count == HTTP_DAY_SAMPLES)
+    {
+        for (i=0; i<HTTP_DAY_SAMPLES/2; i++)
+        {
+            b->t[i] = b->t[i*2];
+            b->v[i] = b->v[i*2];
+        }
+        b->count = HTTP_DAY_SAMPLES/2;
+        b->stride *= 2;
+        if ((row % b->stride) != 0)
+            return;
+    }
+
+    b->t[b->count] = t;
+    b->v[b->count] = v;
+    b->count++;
+}
+
+/*********************************************************************
+ *** FUNCTION: decodeLine
+ ***
+ *** DESCRIPTION:
+ ***   Decode one line of a day file into the block. The column is
+ ***   updated when a header line names the metric's, and the change
+ ***   only marker makes empty fields repeat the last value.
+ ***
+ *** RETURN VALUE:
+ ***   1 if the line was a row, 0 if not.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int decodeLine(dayBlock_t *b, char *line, decode_t *dec, int row)
+{
+    int y, mo, d, h, mi, s;
+    char *p;
+    char *end;
+    float v;
+    int c;
+
+    if (strncmp(line, "TIMESTAMP", 9) == 0)
+    {
+        dec->col = findColumn(line, hs.names[b->metric]);
+        return 0;
+    }
+
+    if (strcmp(line, BAND_CSV_MARKER) == 0)
+    {
+        dec->changeOnly = 1;
+        dec->held = NAN;
+        return 0;
+    }
+
+    if ((dec->col < 0) ||
+        (sscanf(line, "%4d-%2d-%2d %2d:%2d:%2d,", &y, &mo, &d, &h, &mi, &s) != 6))
+    {
+        return 0;
+    }
+
+    for (p = line, c = 0; c < dec->col; c++)
+    {
+        p = strchr(p, ',');
+        if (p == NULL)
+            return 1;
+        p++;
+    }
+
+    v = strtof(p, &end);
+    if ((end == p) || ((*end != ',') && (*end != '\0')))
+        v = dec->changeOnly ? dec->held : NAN;
+    else if (dec->changeOnly)
+        dec->held = v;
+
+    if (!isnan(v))
+        blockAdd(b, row, localToEpoch(y, mo, d, h, mi, s), v);
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: getBlock
+ ***
+ *** DESCRIPTION:
+ ***   Get one metric of a day, decoding the day file unless it's
+ ***   already in the cache as the file is now.
+ ***
+ *** RETURN VALUE:
+ ***   The block, NULL if there's no file for the day.
+ ***
+ *** SIDE EFFECTS:
+ ***   May throw out the least recently used block.
+ *********************************************************************/
+static dayBlock_t *getBlock(int y, int mo, int d, int metric)
+{
+    struct stat statbuf;
+    dayBlock_t *b = NULL;
+    char path[32];
+    int dayKey = y * 10000 + mo * 100 + d;
+    int fd, i;
+    int len = 0;
+    int r, row;
+    decode_t dec;
+    char *line, *nl;
+
+    snprintf(path, sizeof(path), "%04d/%02d/%02d/data.csv", y, mo, d);
+    fd = openat(hs.cfg.rootFd, path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &statbuf) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // Use what's cached if the file hasn't grown since, else reuse
+    // this day's slot or the one used longest ago
+    for (i=0; i<HTTP_CACHE_BLOCKS; i++)
+    {
+        if ((hs.block[i].dayKey == dayKey) && (hs.block[i].metric == metric))
+        {
+            b = &hs.block[i];
+            if ((b->size == statbuf.st_size) && (b->mtime == statbuf.st_mtime))
+            {
+                close(fd);
+                b->used = ++hs.clock;
+                return b;
+            }
+            break;
+        }
+    }
+    if (b == NULL)
+    {
+        b = &hs.block[0];
+        for (i=1; i<HTTP_CACHE_BLOCKS; i++)
+        {
+            if (hs.block[i].used < b->used)
+                b = &hs.block[i];
+        }
+    }
+
+    b->dayKey = dayKey;
+    b->metric = metric;
+    b->size   = statbuf.st_size;
+    b->mtime  = statbuf.st_mtime;
+    b->used   = ++hs.clock;
+    b->count  = 0;
+    b->stride = 1;
+
+    // Rows written before the header was read use the order we write
+    // them in
+    dec.col = metric + 1;
+    dec.changeOnly = 0;
+    dec.held = NAN;
+    row = 0;
+    for ( ; ; )
+    {
+        r = read(fd, hs.in + len, HTTP_READ_MAX - 1 - len);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+        if (r <= 0)
+            break;
+        len += r;
+        hs.in[len] = '\0';
+
+        line = hs.in;
+        while ((nl = strchr(line, '\n')) != NULL)
+        {
+            *nl = '\0';
+            row += decodeLine(b, line, &dec, row);
+            line = nl + 1;
+        }
+
+        // Keep the partial line for the next read. One that fills the
+        // whole buffer can't be a row of ours.
+        len -= line - hs.in;
+        if (len == HTTP_READ_MAX - 1)
+            len = 0;
+        memmove(hs.in, line, len);
+    }
+    close(fd);
+
+    return b;
+}
+
+/*********************************************************************
+ *** FUNCTION: bucketFlush
+ ***
+ *** DESCRIPTION:
+ ***   Send the bucket being filled, if anything went in it.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void bucketFlush(bucket_t *bk)
+{
+    char buf[64];
+    int len;
+    float v;
+
+    if (bk->n == 0)
+        return;
+
+    if (bk->agg == AGG_MIN)
+        v = bk->min;
+    else if (bk->agg == AGG_MAX)
+        v = bk->max;
+    else
+        v = bk->sum / bk->n;
+
+    len = snprintf(buf, sizeof(buf), "%s[%lld,", (bk->points > 0) ? "," : "",
+                   (long long)bk->start);
+    len += csvFormatNumber(buf + len, v);
+    buf[len++] = ']';
+    outAdd(buf, len);
+
+    bk->points++;
+    bk->n = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: bucketAdd
+ ***
+ *** DESCRIPTION:
+ ***   Feed a sample to the bucket it falls in. Samples must come in
+ ***   time order.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void bucketAdd(bucket_t *bk, int64_t t, float v)
+{
+    if (isnan(v))
+        return;
+
+    if (bk->step == 0)
+    {
+        bucketFlush(bk);
+        bk->start = t;
+    }
+    else if (t >= bk->start + bk->step)
+    {
+        bucketFlush(bk);
+        bk->start += (t - bk->start) / bk->step * bk->step;
+    }
+
+    if (bk->n == 0)
+    {
+        bk->sum = 0;
+        bk->min = v;
+        bk->max = v;
+    }
+    if (v < bk->min)
+        bk->min = v;
+    if (v > bk->max)
+        bk->max = v;
+    bk->sum += v;
+    bk->n++;
+}
+
+/*********************************************************************
+ *** FUNCTION: firstDay
+ ***
+ *** DESCRIPTION:
+ ***   Find the oldest day directory. Each level is probed by name,
+ ***   which is a hundred or so stats at most and, unlike reading the
+ ***   directories, never touches the heap.
+ ***
+ *** RETURN VALUE:
+ ***   Local midnight at the start of that day, -1 if there are none.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int64_t firstDay(void)
+{
+    struct stat st;
+    struct tm tmTime;
+    time_t now = time(NULL);
+    char path[32];
+    int y, m, d;
+
+    localtime_r(&now, &tmTime);
+    for (y=HTTP_FIRST_YEAR; y<=tmTime.tm_year+1900; y++)
+    {
+        snprintf(path, sizeof(path), "%04d", y);
+        if (fstatat(hs.cfg.rootFd, path, &st, 0) != 0)
+            continue;
+
+        for (m=1; m<=12; m++)
+        {
+            for (d=1; d<=31; d++)
+            {
+                snprintf(path, sizeof(path), "%04d/%02d/%02d", y, m, d);
+                if (fstatat(hs.cfg.rootFd, path, &st, 0) == 0)
+                    return localToEpoch(y, m, d, 0, 0, 0);
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*********************************************************************
+ *** FUNCTION: queryFiles
+ ***
+ *** DESCRIPTION:
+ ***   Feed the samples in the day files from time from up to, but not
+ ***   including, time to.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void queryFiles(bucket_t *bk, int metric, int64_t from, int64_t to)
+{
+    struct tm tmTime;
+    dayBlock_t *b;
+    time_t day = from;
+    int64_t next;
+    int lo, hi, mid, i;
+
+    if (from >= to)
+        return;
+
+    localtime_r(&day, &tmTime);
+    for ( ; ; )
+    {
+        next = localToEpoch(tmTime.tm_year+1900, tmTime.tm_mon+1, tmTime.tm_mday + 1,
+                            0, 0, 0);
+
+        b = getBlock(tmTime.tm_year+1900, tmTime.tm_mon+1, tmTime.tm_mday, metric);
+        if (b != NULL)
+        {
+            lo = 0;
+            hi = b->count;
+            while (lo < hi)
+            {
+                mid = lo + (hi - lo) / 2;
+                if (b->t[mid] < from)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            for (i = lo; (i < b->count) && (b->t[i] < to); i++)
+                bucketAdd(bk, b->t[i], b->v[i]);
+        }
+
+        if ((next >= to) || hs.failed)
+            break;
+        day = next;
+        localtime_r(&day, &tmTime);
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: queryStore
+ ***
+ *** DESCRIPTION:
+ ***   Feed the samples in the store from time from up to, but not
+ ***   including, time to. They're copied out a batch at a time so the
+ ***   poll loop is never held up by a slow client.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void queryStore(bucket_t *bk, int metric, int64_t from, int64_t to)
+{
+    const store_t *s = hs.cfg.store;
+    int64_t fromMs = from * 1000;
+    int64_t toMs   = to * 1000;
+    int i, n, count;
+
+    while (!hs.failed)
+    {
+        n = 0;
+        pthread_mutex_lock(hs.cfg.lock);
+        count = storeCount(s);
+        for (i = storeFind(s, fromMs); (i < count) && (n < HTTP_BATCH); i++)
+        {
+            hs.batchT[n] = storeTime(s, i);
+            if (hs.batchT[n] >= toMs)
+                break;
+            hs.batchV[n] = storeValue(s, metric, i);
+            n++;
+        }
+        pthread_mutex_unlock(hs.cfg.lock);
+
+        for (i=0; i<n; i++)
+            bucketAdd(bk, hs.batchT[i] / 1000, hs.batchV[i]);
+
+        if (n < HTTP_BATCH)
+            break;
+        fromMs = hs.batchT[n-1] + 1;
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: getParam
+ ***
+ *** DESCRIPTION:
+ ***   Find a parameter in a query string and decode it into buf.
+ ***
+ *** RETURN VALUE:
+ ***   1 if it's there, 0 if not.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int getParam(const char *query, const char *name, char *buf, int size)
+{
+    const char *p = query;
+    int len = strlen(name);
+    int n = 0;
+    unsigned int c;
+
+    while (p != NULL)
+    {
+        if ((strncmp(p, name, len) == 0) && (p[len] == '='))
+        {
+            for (p += len + 1; (*p != '\0') && (*p != '&') && (n < size - 1); p++)
+            {
+                if ((*p == '%') && (sscanf(p + 1, "%2x", &c) == 1))
+                {
+                    buf[n++] = c;
+                    p += 2;
+                }
+                else
+                    buf[n++] = (*p == '+') ? ' ' : *p;
+            }
+            buf[n] = '\0';
+            return 1;
+        }
+        p = strchr(p, '&');
+        if (p != NULL)
+            p++;
+    }
+
+    return 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: doQuery
+ ***
+ *** DESCRIPTION:
+ ***   Answer GET /query.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void doQuery(const char *query)
+{
+    char buf[64];
+    char head[256];
+    bucket_t bk;
+    int64_t from, to, oldest, first;
+    int metric;
+    int len;
+
+    memset(&bk, 0, sizeof(bk));
+
+    if (!getParam(query, "metric", buf, sizeof(buf)))
+    {
+        sendError(400, "Bad Request", "metric is missing");
+        return;
+    }
+    for (metric=0; metric<hs.metrics; metric++)
+    {
+        if (strcasecmp(buf, hs.names[metric]) == 0)
+            break;
+    }
+    if (metric == hs.metrics)
+    {
+        sendError(404, "Not Found", "no such metric");
+        return;
+    }
+
+    if (!getParam(query, "from", buf, sizeof(buf)) || !parseTime(buf, 0, &from))
+    {
+        sendError(400, "Bad Request", "from is missing or not a time");
+        return;
+    }
+    if (!getParam(query, "to", buf, sizeof(buf)))
+        to = time(NULL) + 1;
+    else if (!parseTime(buf, 1, &to))
+    {
+        sendError(400, "Bad Request", "to is not a time");
+        return;
+    }
+    if (from > to)
+    {
+        sendError(400, "Bad Request", "from is after to");
+        return;
+    }
+
+    // Nothing is older than the first day directory or newer than now,
+    // so there's no walking through days that can't have anything
+    first = firstDay();
+    if (to > time(NULL) + 1)
+        to = time(NULL) + 1;
+    if (getParam(query, "step", buf, sizeof(buf)))
+        bk.step = strtoll(buf, NULL, 10);
+    if (bk.step < 0)
+        bk.step = 0;
+    bk.start = from;
+    if (getParam(query, "agg", buf, sizeof(buf)))
+    {
+        if (strcmp(buf, "min") == 0)
+            bk.agg = AGG_MIN;
+        else if (strcmp(buf, "max") == 0)
+            bk.agg = AGG_MAX;
+        else if (strcmp(buf, "avg") != 0)
+        {
+            sendError(400, "Bad Request", "agg is not avg, min or max");
+            return;
+        }
+    }
+
+    beginChunked();
+    len = snprintf(head, sizeof(head),
+                   "{\"metric\":\"%s\",\"from\":%lld,\"to\":%lld,\"step\":%lld,"
+                   "\"agg\":\"%s\",\"points\":[", hs.names[metric], (long long)from,
+                   (long long)to, (long long)bk.step,
+                   (bk.agg == AGG_MIN) ? "min" : (bk.agg == AGG_MAX) ? "max" : "avg");
+    outAdd(head, len);
+
+    // What the store still has comes from there, the rest from disk
+    pthread_mutex_lock(hs.cfg.lock);
+    if ((metric < hs.cfg.store->hdr->metrics) && (storeCount(hs.cfg.store) > 0))
+        oldest = (storeTime(hs.cfg.store, 0) + 999) / 1000;
+    else
+        oldest = INT64_MAX;
+    pthread_mutex_unlock(hs.cfg.lock);
+
+    if (first >= 0)
+        queryFiles(&bk, metric, (from > first) ? from : first, (to < oldest) ? to : oldest);
+    if (oldest != INT64_MAX)
+        queryStore(&bk, metric, (from > oldest) ? from : oldest, to);
+    bucketFlush(&bk);
+
+    outStr("]}\n");
+    endChunked();
+}
+
+/*********************************************************************
+ *** FUNCTION: doMetrics
+ ***
+ *** DESCRIPTION:
+ ***   Answer GET /metrics with the names that can be queried.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void doMetrics(void)
+{
+    int m;
+
+    beginChunked();
+    outStr("{\"metrics\":[");
+    for (m=0; m<hs.metrics; m++)
+    {
+        if (m > 0)
+            outStr(",");
+        outStr("\"");
+        outStr(hs.names[m]);
+        outStr("\"");
+    }
+    outStr("]}\n");
+    endChunked();
+}
+
+/*********************************************************************
+ *** FUNCTION: serve
+ ***
+ *** DESCRIPTION:
+ ***   Read a request from the client and answer it.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void serve(void)
+{
+    struct timeval tv = { HTTP_TIMEOUT_SECS, 0 };
+    char *path, *query, *end;
+    int len = 0;
+    int r;
+
+    setsockopt(hs.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(hs.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    hs.failed = 0;
+
+    // Only the request line matters, but read up to the end of the
+    // headers so the client doesn't see a reset
+    for ( ; ; )
+    {
+        r = recv(hs.fd, hs.req + len, HTTP_REQUEST_MAX - 1 - len, 0);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+        if (r <= 0)
+            return;
+        len += r;
+        hs.req[len] = '\0';
+        if ((strstr(hs.req, "\r\n\r\n") != NULL) || (strstr(hs.req, "\n\n") != NULL))
+            break;
+        if (len == HTTP_REQUEST_MAX - 1)
+        {
+            sendError(400, "Bad Request", "request too long");
+            return;
+        }
+    }
+
+    if (strncmp(hs.req, "GET ", 4) != 0)
+    {
+        sendError(405, "Method Not Allowed", "only GET is supported");
+        return;
+    }
+    path = hs.req + 4;
+    end = strpbrk(path, " \r\n");
+    if (end != NULL)
+        *end = '\0';
+    query = strchr(path, '?');
+    if (query != NULL)
+        *query++ = '\0';
+    else
+        query = "";
+
+    if (strcmp(path, "/query") == 0)
+        doQuery(query);
+    else if (strcmp(path, "/metrics") == 0)
+        doMetrics();
+    else
+        sendError(404, "Not Found", "try /metrics or /query");
+}
+
+/*********************************************************************
+ *** FUNCTION: serverThread
+ ***
+ *** DESCRIPTION:
+ ***   Take clients one at a time, for ever.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void *serverThread(void *arg)
+{
+    for ( ; ; )
+    {
+        hs.fd = accept(hs.listenFd, NULL, NULL);
+        if (hs.fd < 0)
+            continue;
+        serve();
+        close(hs.fd);
+    }
+
+    return NULL;
+}
+
+/*********************************************************************
+ *** FUNCTION: httpStart
+ ***
+ *** DESCRIPTION:
+ ***   Start answering queries on cfg->port, using the httpFootprint()
+ ***   bytes at mem for every buffer.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   Starts the server thread.
+ *********************************************************************/
+int httpStart(const httpConfig_t *cfg, void *mem)
+{
+    struct sockaddr_in addr;
+    unsigned char *p = mem;
+    int on = 1;
+    int i;
+
+    hs.cfg = *cfg;
+    hs.metrics = csvHeaderNames(cfg->header, hs.names);
+
+    hs.req = (char *)p;
+    p += HTTP_REQUEST_MAX;
+    hs.out = (char *)p;
+    p += CHUNK_HEAD + HTTP_CHUNK_MAX + 2;
+    hs.in = (char *)p;
+    p += HTTP_READ_MAX;
+    hs.batchT = (int64_t *)p;
+    p += HTTP_BATCH * sizeof(int64_t);
+    hs.batchV = (float *)p;
+    p += HTTP_BATCH * sizeof(float);
+    for (i=0; i<HTTP_CACHE_BLOCKS; i++)
+    {
+        hs.block[i].dayKey = 0;
+        hs.block[i].t = (int64_t *)p;
+        p += HTTP_DAY_SAMPLES * sizeof(int64_t);
+        hs.block[i].v = (float *)p;
+        p += HTTP_DAY_SAMPLES * sizeof(float);
+    }
+
+    // Only this machine can ask unless a wider address is given
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(cfg->port);
+    if ((cfg->addr != NULL) && (inet_pton(AF_INET, cfg->addr, &addr.sin_addr) != 1))
+    {
+        printf("http: %s isn't an IPv4 address\n", cfg->addr);
+        return 0;
+    }
+
+    hs.listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (hs.listenFd < 0)
+    {
+        printf("http: socket failed: %s\n", strerror(errno));
+        return 0;
+    }
+    setsockopt(hs.listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if ((bind(hs.listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+        (listen(hs.listenFd, 4) != 0))
+    {
+        printf("http: can't listen on port %d: %s\n", cfg->port, strerror(errno));
+        close(hs.listenFd);
+        return 0;
+    }
+
+    if (pthread_create(&hs.thread, NULL, serverThread, NULL) != 0)
+    {
+        printf("http: can't start server thread\n");
+        close(hs.listenFd);
+        return 0;
+    }
+    pthread_detach(hs.thread);
+
+    return 1;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,72 @@
+/*********************************************************************
+ *** FILE: http.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef HTTP_H
+#define HTTP_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stddef.h>
+#include <pthread.h>
+
+/* INCLUDE FILES */
+#include "store.h"
+
+/* DEFINES */
+
+// Decoded day blocks kept in memory, and the samples each one holds. A
+// day with more rows than that is thinned out to fit.
+#define HTTP_CACHE_BLOCKS   16
+#define HTTP_DAY_SAMPLES    4096
+
+// Longest request we'll read
+#define HTTP_REQUEST_MAX    2048
+
+// Size of each chunk of a response
+#define HTTP_CHUNK_MAX      4096
+
+// Bytes of a day file read at a time
+#define HTTP_READ_MAX       8192
+
+// Samples copied out of the store each time it's locked
+#define HTTP_BATCH          256
+
+// Time a client gets to send its request or take the response
+#define HTTP_TIMEOUT_SECS   10
+
+// No day directory is looked for before this year
+#define HTTP_FIRST_YEAR     2000
+
+/* TYPEDEFS */
+
+typedef struct
+{
+    int              port;      // TCP port to listen on
+    const char      *addr;      // Address to listen on, NULL for loopback only
+    int              rootFd;    // Root of the day directories
+    const store_t   *store;     // Recent samples
+    pthread_mutex_t *lock;      // Held by the writer while it changes the store
+    const char      *header;    // CSV header line naming the columns
+} httpConfig_t;
+
+/* FUNCTION PROTOTYPES */
+size_t httpFootprint(void);
+int    httpStart(const httpConfig_t *cfg, void *mem);
+
+#endif // HTTP_H
@@ -0,0 +1,952 @@
+/*********************************************************************
+ *** FILE: influx.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// Sends every sweep on to a time series database as InfluxDB line
+// protocol:
+//
+//   fronius,inverter=1,site=host_4001 POWER_NOW=1234 <ns>
+//   fronius,inverter=1,site=host_4001 ENERGY_DAY=5.6 <ns>
+//
+// Each value is stamped with the time its reply came in rather than
+// the start of the sweep, which can be most of a minute earlier on a
+// slow line; values that came in at the same time share a line. The
+// site tag is only there when collecting from many ports. Fields are
+// named as in the CSV header and, with -C, only the values written to
+// data.csv are sent.
+//
+// Lines collect in a buffer and go as one batch once enough of them
+// have built up or the first has waited long enough, from a thread of
+// their own so a slow target never holds up a sweep. The target is a
+// POST to an HTTP write endpoint (InfluxDB, Telegraf's listener) or a
+// plain TCP or Unix socket the lines are written to.
+//
+// A batch that can't be sent is added to influx.spool in the root
+// directory, and kept there across restarts. Once the target takes a
+// batch again the spool is sent too, a whole number of lines at a time
+// and no faster than the rate given, so a long outage doesn't flood
+// it. The first line of the spool says how much of it has gone.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* INCLUDE FILES */
+#include "influx.h"
+#include "csv.h"
+
+/* DEFINES */
+
+// Host and path of an HTTP target
+#define HOST_MAX        128
+#define PATH_MAX_LEN    256
+
+// Room for a request's headers, and the start of the response
+#define HEAD_MAX        512
+
+// First line of the spool, padded so it can be written over in place
+#define SPOOL_HEAD_FMT  "# sent %020llu\n"
+#define SPOOL_HEAD_LEN  28
+
+// What became of a batch
+#define SEND_OK         0
+#define SEND_FAILED     1   // Try again later
+#define SEND_REJECTED   2   // The target won't ever take it
+
+/* TYPEDEFS */
+
+typedef struct
+{
+    influxConfig_t          cfg;
+    int                     metrics;
+    char                    names[CSV_METRICS_MAX][CSV_NAME_MAX];
+
+    // Where batches go
+    int                     http;           // Else the lines are just written
+    struct sockaddr_storage addr;
+    socklen_t               addrLen;
+    char                    host[HOST_MAX]; // For the Host header
+    char                    path[PATH_MAX_LEN];
+
+    // Lines from the sweeps. The main thread fills buf[cur] while the
+    // sender has the other.
+    pthread_mutex_t         lock;
+    pthread_cond_t          wake;
+    pthread_t               thread;
+    int                     running;
+    int                     stop;
+    char                   *buf[2];         // INFLUX_BUF_MAX each
+    int                     len[2];
+    int                     cur;
+    double                  flushAt;        // When buf[cur]'s first line has waited enough
+
+    // The sender's own
+    char                   *head;           // HEAD_MAX
+    char                   *replay;         // INFLUX_BUF_MAX
+    char                    why[64];        // Why the last send failed
+    int                     down;
+    double                  retryAt;        // Nothing is sent before this
+    double                  tokens;         // Spooled lines that may go now
+    double                  tokensAt;
+
+    // Batches that couldn't be sent
+    pthread_mutex_t         spoolLock;
+    int                     spoolFd;
+    off_t                   spoolSize;
+    off_t                   spoolSent;      // Everything before this has gone
+} influx_t;
+
+/* STATIC VARIABLES */
+static influx_t is;
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: influxFootprint
+ ***
+ *** DESCRIPTION:
+ ***   Work out how much memory the export needs.
+ ***
+ *** RETURN VALUE:
+ ***   Size in bytes of the block to pass to influxStart().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+size_t influxFootprint(void)
+{
+    return 3 * INFLUX_BUF_MAX + HEAD_MAX;
+}
+
+/*********************************************************************
+ *** FUNCTION: monoNow
+ ***
+ *** DESCRIPTION:
+ ***   Read the monotonic clock.
+ ***
+ *** RETURN VALUE:
+ ***   Seconds.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static double monoNow(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*********************************************************************
+ *** FUNCTION: parseTarget
+ ***
+ *** DESCRIPTION:
+ ***   Work out where batches go from http://host[:port][/path],
+ ***   tcp:host:port or unix:path. A host can be an IPv6 address in
+ ***   brackets. It's looked up now.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 if the target can't be understood.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int parseTarget(const char *target)
+{
+    struct addrinfo hints, *res;
+    struct sockaddr_un *sun;
+    char name[HOST_MAX];
+    const char *p, *end;
+    char *node, *port, *colon;
+
+    if (strncmp(target, INFLUX_UNIX_PREFIX, strlen(INFLUX_UNIX_PREFIX)) == 0)
+    {
+        p = target + strlen(INFLUX_UNIX_PREFIX);
+        sun = (struct sockaddr_un *)&is.addr;
+        if ((*p == '\0') || (strlen(p) >= sizeof(sun->sun_path)))
+            return 0;
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, p);
+        is.addrLen = sizeof(*sun);
+        return 1;
+    }
+
+    if (strncmp(target, INFLUX_HTTP_PREFIX, strlen(INFLUX_HTTP_PREFIX)) == 0)
+    {
+        is.http = 1;
+        p = target + strlen(INFLUX_HTTP_PREFIX);
+    }
+    else if (strncmp(target, INFLUX_TCP_PREFIX, strlen(INFLUX_TCP_PREFIX)) == 0)
+    {
+        p = target + strlen(INFLUX_TCP_PREFIX);
+    }
+    else
+    {
+        return 0;
+    }
+
+    // The host and port, then the path
+    end = p + strcspn(p, "/");
+    if ((end == p) || (end - p >= HOST_MAX) || (!is.http && (*end != '\0')))
+        return 0;
+    memcpy(is.host, p, end - p);
+    is.host[end - p] = '\0';
+    if (strlen(end) >= PATH_MAX_LEN)
+        return 0;
+    strcpy(is.path, (*end == '/') ? end : INFLUX_DEFAULT_PATH);
+
+    strcpy(name, is.host);
+    node = name;
+    if (*node == '[')
+    {
+        node++;
+        colon = strchr(node, ']');
+        if (colon == NULL)
+            return 0;
+        *colon++ = '\0';
+        if ((*colon != ':') && (*colon != '\0'))
+            return 0;
+    }
+    else
+    {
+        colon = strrchr(node, ':');
+    }
+    port = is.http ? "80" : "";
+    if ((colon != NULL) && (*colon == ':'))
+    {
+        *colon = '\0';
+        port = colon + 1;
+    }
+    if (*port == '\0')
+        return 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(node, port, &hints, &res) != 0)
+        return 0;
+
+    memcpy(&is.addr, res->ai_addr, res->ai_addrlen);
+    is.addrLen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: sendAll
+ ***
+ *** DESCRIPTION:
+ ***   Send a block, however many writes it takes.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure with errno set.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int sendAll(int fd, const char *data, int len)
+{
+    int n;
+
+    while (len > 0)
+    {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: sendBatch
+ ***
+ *** DESCRIPTION:
+ ***   Connect to the target and hand it a batch of whole lines. Over
+ ***   HTTP the answer decides what became of it; a client error means
+ ***   the lines will never be taken, anything else is tried again.
+ ***
+ *** RETURN VALUE:
+ ***   SEND_OK, SEND_FAILED or SEND_REJECTED, with the reason in is.why
+ ***   for the last two.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int sendBatch(const char *data, int len)
+{
+    struct timeval tv = { INFLUX_TIMEOUT_SECS, 0 };
+    int fd, n, got, status;
+
+    fd = socket(is.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        snprintf(is.why, sizeof(is.why), "%s", strerror(errno));
+        return SEND_FAILED;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *)&is.addr, is.addrLen) != 0)
+    {
+        snprintf(is.why, sizeof(is.why), "%s", strerror(errno));
+        close(fd);
+        return SEND_FAILED;
+    }
+
+    if (!is.http)
+    {
+        n = sendAll(fd, data, len);
+        if (n == 0)
+            snprintf(is.why, sizeof(is.why), "%s", strerror(errno));
+        close(fd);
+        return n ? SEND_OK : SEND_FAILED;
+    }
+
+    n = snprintf(is.head, HEAD_MAX,
+                 "POST %s HTTP/1.1\r\n"
+                 "Host: %s\r\n"
+                 "Content-Type: text/plain; charset=utf-8\r\n"
+                 "Content-Length: %d\r\n"
+                 "Connection: close\r\n"
+                 "\r\n", is.path, is.host, len);
+    if ((sendAll(fd, is.head, n) == 0) || (sendAll(fd, data, len) == 0))
+    {
+        snprintf(is.why, sizeof(is.why), "%s", strerror(errno));
+        close(fd);
+        return SEND_FAILED;
+    }
+
+    // Only the status line matters
+    got = 0;
+    while (got < HEAD_MAX - 1)
+    {
+        n = recv(fd, is.head + got, HEAD_MAX - 1 - got, 0);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+        is.head[got] = '\0';
+        if (strstr(is.head, "\r\n") != NULL)
+            break;
+    }
+    is.head[got] = '\0';
+    close(fd);
+
+    if (sscanf(is.head, "HTTP/%*d.%*d %d", &status) != 1)
+    {
+        snprintf(is.why, sizeof(is.why), "no answer");
+        return SEND_FAILED;
+    }
+    if ((status >= 200) && (status < 300))
+        return SEND_OK;
+
+    snprintf(is.why, sizeof(is.why), "HTTP status %d", status);
+    if ((status >= 400) && (status < 500) && (status != 408) && (status != 429))
+        return SEND_REJECTED;
+    return SEND_FAILED;
+}
+
+/*********************************************************************
+ *** FUNCTION: linkDown
+ ***
+ *** DESCRIPTION:
+ ***   Note that the target didn't take a batch, and hold off sending
+ ***   for a while.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void linkDown(void)
+{
+    if (!is.down)
+        printf("influx: can't send to %s (%s), spooling\n", is.cfg.target, is.why);
+    is.down = 1;
+    is.retryAt = monoNow() + INFLUX_RETRY_SECS;
+}
+
+/*********************************************************************
+ *** FUNCTION: linkUp
+ ***
+ *** DESCRIPTION:
+ ***   Note that the target took a batch.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void linkUp(void)
+{
+    if (is.down)
+        printf("influx: %s is back\n", is.cfg.target);
+    is.down = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: spoolWriteHead
+ ***
+ *** DESCRIPTION:
+ ***   Record in the spool how much of it has been sent. Called with
+ ***   spoolLock held.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void spoolWriteHead(void)
+{
+    char head[SPOOL_HEAD_LEN + 1];
+
+    snprintf(head, sizeof(head), SPOOL_HEAD_FMT, (unsigned long long)is.spoolSent);
+    if (pwrite(is.spoolFd, head, SPOOL_HEAD_LEN, 0) != SPOOL_HEAD_LEN)
+        printf("influx: can't write %s: %s\n", INFLUX_SPOOL_FILENAME, strerror(errno));
+}
+
+/*********************************************************************
+ *** FUNCTION: spoolOpen
+ ***
+ *** DESCRIPTION:
+ ***   Open the spool, carrying on from wherever the last run got to
+ ***   with sending it.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int spoolOpen(void)
+{
+    char head[SPOOL_HEAD_LEN + 1];
+    unsigned long long sent;
+    struct stat st;
+
+    is.spoolFd = openat(is.cfg.rootFd, INFLUX_SPOOL_FILENAME, O_RDWR | O_CREAT | O_CLOEXEC,
+                        0644);
+    if ((is.spoolFd < 0) || (fstat(is.spoolFd, &st) != 0))
+    {
+        printf("influx: can't open %s: %s\n", INFLUX_SPOOL_FILENAME, strerror(errno));
+        return 0;
+    }
+
+    is.spoolSize = st.st_size;
+    is.spoolSent = SPOOL_HEAD_LEN;
+    if ((is.spoolSize >= SPOOL_HEAD_LEN) &&
+        (pread(is.spoolFd, head, SPOOL_HEAD_LEN, 0) == SPOOL_HEAD_LEN))
+    {
+        head[SPOOL_HEAD_LEN] = '\0';
+        if ((sscanf(head, "# sent %llu", &sent) == 1) && (sent >= SPOOL_HEAD_LEN) &&
+            (sent <= is.spoolSize))
+        {
+            is.spoolSent = sent;
+        }
+    }
+
+    if (is.spoolSent >= is.spoolSize)
+    {
+        if (ftruncate(is.spoolFd, 0) != 0)
+            printf("influx: can't empty %s: %s\n", INFLUX_SPOOL_FILENAME, strerror(errno));
+        is.spoolSize = SPOOL_HEAD_LEN;
+        is.spoolSent = SPOOL_HEAD_LEN;
+    }
+    else
+    {
+        printf("influx: %lld bytes in %s still to send\n",
+               (long long)(is.spoolSize - is.spoolSent), INFLUX_SPOOL_FILENAME);
+    }
+    spoolWriteHead();
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: spoolAppend
+ ***
+ *** DESCRIPTION:
+ ***   Keep a batch that couldn't be sent. It's synced straight away,
+ ***   it's the only copy.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void spoolAppend(const char *data, int len)
+{
+    pthread_mutex_lock(&is.spoolLock);
+    if (pwrite(is.spoolFd, data, len, is.spoolSize) == len)
+    {
+        is.spoolSize += len;
+        fdatasync(is.spoolFd);
+    }
+    else
+    {
+        printf("influx: lost %d bytes, can't write %s: %s\n", len, INFLUX_SPOOL_FILENAME,
+               strerror(errno));
+        if (ftruncate(is.spoolFd, is.spoolSize) != 0)
+            printf("influx: can't trim %s: %s\n", INFLUX_SPOOL_FILENAME, strerror(errno));
+    }
+    pthread_mutex_unlock(&is.spoolLock);
+}
+
+/*********************************************************************
+ *** FUNCTION: spoolAdvance
+ ***
+ *** DESCRIPTION:
+ ***   Mark len more bytes of the spool as sent. Once all of it has
+ ***   gone it's emptied.
+ ***
+ *** RETURN VALUE:
+ ***   1 if there's more to send, 0 if not.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int spoolAdvance(int len)
+{
+    int more = 1;
+
+    pthread_mutex_lock(&is.spoolLock);
+    is.spoolSent += len;
+    if (is.spoolSent >= is.spoolSize)
+    {
+        if (ftruncate(is.spoolFd, SPOOL_HEAD_LEN) != 0)
+            printf("influx: can't empty %s: %s\n", INFLUX_SPOOL_FILENAME, strerror(errno));
+        is.spoolSize = SPOOL_HEAD_LEN;
+        is.spoolSent = SPOOL_HEAD_LEN;
+        printf("influx: %s all sent\n", INFLUX_SPOOL_FILENAME);
+        more = 0;
+    }
+    spoolWriteHead();
+    pthread_mutex_unlock(&is.spoolLock);
+
+    return more;
+}
+
+/*********************************************************************
+ *** FUNCTION: replayStep
+ ***
+ *** DESCRIPTION:
+ ***   Send the next batch from the spool, as many whole lines as the
+ ***   rate allows right now.
+ ***
+ *** RETURN VALUE:
+ ***   1 if more could go straight away, 0 if not.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int replayStep(void)
+{
+    double now = monoNow();
+    off_t at, size;
+    char *nl;
+    int n, len, lines, most, r;
+
+    if (now < is.retryAt)
+        return 0;
+
+    pthread_mutex_lock(&is.spoolLock);
+    at = is.spoolSent;
+    size = is.spoolSize;
+    n = 0;
+    if (at < size)
+        n = pread(is.spoolFd, is.replay,
+                  (size - at < INFLUX_BUF_MAX) ? size - at : INFLUX_BUF_MAX, at);
+    pthread_mutex_unlock(&is.spoolLock);
+    if (n <= 0)
+        return 0;
+
+    // Top up the allowance, up to a second's worth
+    most = INFLUX_BUF_MAX;
+    if (is.cfg.rate > 0)
+    {
+        is.tokens += (now - is.tokensAt) * is.cfg.rate;
+        if (is.tokens > is.cfg.rate)
+            is.tokens = is.cfg.rate;
+        is.tokensAt = now;
+        if (is.tokens < 1)
+            return 0;
+        most = (int)is.tokens;
+    }
+
+    len = 0;
+    lines = 0;
+    while ((lines < most) && ((nl = memchr(is.replay + len, '\n', n - len)) != NULL))
+    {
+        len = nl - is.replay + 1;
+        lines++;
+    }
+
+    // Only a damaged spool has a line too long to send
+    if (len == 0)
+    {
+        printf("influx: skipping %d bytes of %s with no end of line\n", n,
+               INFLUX_SPOOL_FILENAME);
+        return spoolAdvance(n);
+    }
+
+    r = sendBatch(is.replay, len);
+    if (r == SEND_FAILED)
+    {
+        linkDown();
+        return 0;
+    }
+    if (r == SEND_REJECTED)
+        printf("influx: %s turned down %d spooled lines (%s)\n", is.cfg.target, lines,
+               is.why);
+    else
+        linkUp();
+
+    if (is.cfg.rate > 0)
+        is.tokens -= lines;
+
+    return spoolAdvance(len) && ((is.cfg.rate <= 0) || (is.tokens >= 1));
+}
+
+/*********************************************************************
+ *** FUNCTION: flush
+ ***
+ *** DESCRIPTION:
+ ***   Send a batch of new lines, or spool it if the target is down.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void flush(const char *data, int len)
+{
+    int r;
+
+    if (monoNow() < is.retryAt)
+    {
+        spoolAppend(data, len);
+        return;
+    }
+
+    r = sendBatch(data, len);
+    if (r == SEND_FAILED)
+    {
+        linkDown();
+        spoolAppend(data, len);
+    }
+    else if (r == SEND_REJECTED)
+    {
+        printf("influx: %s turned down a batch of %d bytes (%s)\n", is.cfg.target, len,
+               is.why);
+    }
+    else
+    {
+        linkUp();
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: senderThread
+ ***
+ *** DESCRIPTION:
+ ***   Send each batch once it's due, and the spool when there's time,
+ ***   until told to stop. Whatever is waiting then goes first.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void *senderThread(void *arg)
+{
+    struct timespec until;
+    char *out;
+    int len, more;
+
+    pthread_mutex_lock(&is.lock);
+    for ( ; ; )
+    {
+        len = is.len[is.cur];
+        if ((len > 0) && (is.stop || (len >= INFLUX_BATCH_BYTES) || (monoNow() >= is.flushAt)))
+        {
+            // The sweeps carry on into the other buffer meanwhile
+            out = is.buf[is.cur];
+            is.cur = !is.cur;
+            is.len[is.cur] = 0;
+            pthread_mutex_unlock(&is.lock);
+            flush(out, len);
+            pthread_mutex_lock(&is.lock);
+            continue;
+        }
+        if (is.stop)
+            break;
+
+        pthread_mutex_unlock(&is.lock);
+        more = replayStep();
+        pthread_mutex_lock(&is.lock);
+        if (more)
+            continue;
+
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec++;
+        pthread_cond_timedwait(&is.wake, &is.lock, &until);
+    }
+    pthread_mutex_unlock(&is.lock);
+
+    return NULL;
+}
+
+/*********************************************************************
+ *** FUNCTION: influxStart
+ ***
+ *** DESCRIPTION:
+ ***   Start exporting to cfg->target, using the influxFootprint()
+ ***   bytes at mem for every buffer.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   Starts the sender thread.
+ *********************************************************************/
+int influxStart(const influxConfig_t *cfg, void *mem)
+{
+    pthread_condattr_t attr;
+    char *p = mem;
+
+    is.cfg = *cfg;
+    is.metrics = csvHeaderNames(cfg->header, is.names);
+    if (parseTarget(cfg->target) == 0)
+    {
+        printf("influx: can't use target %s\n", cfg->target);
+        return 0;
+    }
+
+    is.buf[0] = p;
+    p += INFLUX_BUF_MAX;
+    is.buf[1] = p;
+    p += INFLUX_BUF_MAX;
+    is.replay = p;
+    p += INFLUX_BUF_MAX;
+    is.head = p;
+
+    if (spoolOpen() == 0)
+        return 0;
+
+    pthread_mutex_init(&is.lock, NULL);
+    pthread_mutex_init(&is.spoolLock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&is.wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    is.tokens = is.cfg.rate;
+    is.tokensAt = monoNow();
+
+    if (pthread_create(&is.thread, NULL, senderThread, NULL) != 0)
+    {
+        printf("influx: can't start sender thread\n");
+        close(is.spoolFd);
+        return 0;
+    }
+    is.running = 1;
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: addEscaped
+ ***
+ *** DESCRIPTION:
+ ***   Add a tag value to a line, escaping what line protocol needs
+ ***   escaped.
+ ***
+ *** RETURN VALUE:
+ ***   New length of the line.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int addEscaped(char *line, int len, int size, const char *s)
+{
+    for ( ; (*s != '\0') && (len < size - 2); s++)
+    {
+        if ((*s == ',') || (*s == ' ') || (*s == '=') || (*s == '\\'))
+            line[len++] = '\\';
+        line[len++] = *s;
+    }
+
+    return len;
+}
+
+/*********************************************************************
+ *** FUNCTION: influxSweep
+ ***
+ *** DESCRIPTION:
+ ***   Queue a sweep's lines, one for each time a reading came in with
+ ***   every value read at that time. Only the values marked in changed
+ ***   that were read are sent, and a sweep with none is left out. site
+ ***   is NULL for the one port.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   If the sender has fallen so far behind that there's no room,
+ ***   what's waiting is spooled.
+ *********************************************************************/
+void influxSweep(const char *site, int inverter, const float *values,
+                 const frStamp_t *stamps, unsigned long long changed)
+{
+    char lines[INFLUX_SWEEP_MAX];
+    char tags[256];
+    char num[32];
+    const struct timespec *at;
+    unsigned long long todo = 0;
+    int len, tagLen, n, i, first;
+    int fields;
+
+    tagLen = snprintf(tags, sizeof(tags), "%s,inverter=%d", INFLUX_MEASUREMENT, inverter);
+    if (site != NULL)
+    {
+        tagLen += snprintf(tags + tagLen, sizeof(tags) - tagLen, ",site=");
+        tagLen = addEscaped(tags, tagLen, sizeof(tags), site);
+    }
+
+    for (i=0; i<is.metrics; i++)
+    {
+        if ((changed & (1ULL << i)) && !isnan(values[i]) && (csvFormatNumber(num, values[i]) > 0))
+            todo |= 1ULL << i;
+    }
+
+    // Values that came in together (those worked out locally, say)
+    // share a line
+    len = 0;
+    for (first=0; (todo != 0) && (first < is.metrics); first++)
+    {
+        if (!(todo & (1ULL << first)))
+            continue;
+        if (len + tagLen + 2 * (CSV_NAME_MAX + 32) > sizeof(lines))
+            break;
+
+        at = &stamps[first].real;
+        memcpy(lines + len, tags, tagLen);
+        len += tagLen;
+        fields = 0;
+        for (i=first; i<is.metrics; i++)
+        {
+            if (!(todo & (1ULL << i)) || (stamps[i].real.tv_sec != at->tv_sec) ||
+                (stamps[i].real.tv_nsec != at->tv_nsec))
+            {
+                continue;
+            }
+            todo &= ~(1ULL << i);
+            if ((fields > 0) && (len + CSV_NAME_MAX + 2 * 32 > sizeof(lines)))
+                continue;
+
+            n = csvFormatNumber(num, values[i]);
+            lines[len++] = (fields++ == 0) ? ' ' : ',';
+            len += sprintf(lines + len, "%s=%.*s", is.names[i], n, num);
+        }
+        len += sprintf(lines + len, " %lld\n",
+                       (long long)at->tv_sec * 1000000000LL + at->tv_nsec);
+    }
+    if (len == 0)
+        return;
+
+    pthread_mutex_lock(&is.lock);
+    if (is.len[is.cur] + len > INFLUX_BUF_MAX)
+    {
+        spoolAppend(is.buf[is.cur], is.len[is.cur]);
+        is.len[is.cur] = 0;
+    }
+    if (is.len[is.cur] == 0)
+        is.flushAt = monoNow() + INFLUX_BATCH_SECS;
+    memcpy(is.buf[is.cur] + is.len[is.cur], lines, len);
+    is.len[is.cur] += len;
+    if (is.len[is.cur] >= INFLUX_BATCH_BYTES)
+        pthread_cond_signal(&is.wake);
+    pthread_mutex_unlock(&is.lock);
+}
+
+/*********************************************************************
+ *** FUNCTION: influxStop
+ ***
+ *** DESCRIPTION:
+ ***   Send or spool whatever is waiting and stop the sender.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Waits for the sender thread to finish.
+ *********************************************************************/
+void influxStop(void)
+{
+    if (!is.running)
+        return;
+
+    pthread_mutex_lock(&is.lock);
+    is.stop = 1;
+    pthread_cond_signal(&is.wake);
+    pthread_mutex_unlock(&is.lock);
+
+    pthread_join(is.thread, NULL);
+    close(is.spoolFd);
+    is.running = 0;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
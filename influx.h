@@ -0,0 +1,83 @@
+/*********************************************************************
+ *** FILE: influx.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef INFLUX_H
+#define INFLUX_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stddef.h>
+
+/* INCLUDE FILES */
+#include "fronius.h"
+
+/* DEFINES */
+
+// Lines waiting to be sent. There are two of these, one filling while
+// the other is on its way.
+#define INFLUX_BUF_MAX          65536
+
+// A batch goes once this many bytes are waiting, or once its first
+// line has waited this many seconds
+#define INFLUX_BATCH_BYTES      16384
+#define INFLUX_BATCH_SECS       30
+
+// Most bytes of lines one sweep makes
+#define INFLUX_SWEEP_MAX        16384
+
+// Default lines a second sent from the spool once the target is back
+#define INFLUX_REPLAY_RATE      500
+
+// Time to wait after a failed send before trying the target again
+#define INFLUX_RETRY_SECS       30
+
+// Time the target gets to take a batch and answer
+#define INFLUX_TIMEOUT_SECS     10
+
+// Batches that couldn't be sent, in the root directory
+#define INFLUX_SPOOL_FILENAME   "influx.spool"
+
+// Measurement every line is for, and the database of a target given
+// without a path
+#define INFLUX_MEASUREMENT      "fronius"
+#define INFLUX_DEFAULT_PATH     "/write?db=" INFLUX_MEASUREMENT
+
+// Target prefixes
+#define INFLUX_HTTP_PREFIX      "http://"
+#define INFLUX_TCP_PREFIX       "tcp:"
+#define INFLUX_UNIX_PREFIX      "unix:"
+
+/* TYPEDEFS */
+
+typedef struct
+{
+    const char *target;     // http://host[:port][/path], tcp:host:port or unix:path
+    int         rootFd;     // Where the spool is kept
+    int         rate;       // Spooled lines sent a second
+    const char *header;     // CSV header line naming the fields
+} influxConfig_t;
+
+/* FUNCTION PROTOTYPES */
+size_t influxFootprint(void);
+int    influxStart(const influxConfig_t *cfg, void *mem);
+void   influxSweep(const char *site, int inverter, const float *values,
+                   const frStamp_t *stamps, unsigned long long changed);
+void   influxStop(void);
+
+#endif // INFLUX_H
@@ -25,62 +25,56 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <termios.h>
 #include <unistd.h>
 #include <errno.h>
 #include <math.h>
-#include <arpa/inet.h>
 #include <sys/time.h>
 #include <time.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 /* INCLUDE FILES */
+#include "fronius.h"
+#include "capture.h"
+#include "csv.h"
+#include "rotate.h"
+#include "store.h"
+#include "derive.h"
+#include "binlog.h"
+#include "night.h"
+#include "checkpoint.h"
+#include "arena.h"
+#include "http.h"
+#include "deadband.h"
+#include "sites.h"
+#include "influx.h"
 
 /* DEFINES */
 
-/* TYPEDEFS */
+// Default time between sweeps, in seconds
+#define SAMPLE_SECS     60
 
-// Commands supported by the inverter
-typedef enum 
-{
-    GET_POWER_NOW             = 0x10,
-    GET_ENERGY_TOTAL          = 0x11,
-    GET_ENERGY_DAY            = 0x12,
-    GET_ENERGY_YEAR           = 0x13,
-    GET_AC_CURRENT_NOW        = 0x14,
-    GET_AC_VOLTAGE_NOW        = 0x15,
-    GET_AC_FREQUENCY_NOW      = 0x16,
-    GET_DC_CURRENT_NOW        = 0x17,
-    GET_DC_VOLTAGE_NOW        = 0x18,
-    GET_YIELD_DAY             = 0x19,
-    GET_MAX_POWER_DAY         = 0x1A,
-    GET_MAX_AC_VOLTAGE_DAY    = 0x1B,
-    GET_MIN_AC_VOLTAGE_DAY    = 0x1C,
-    GET_MAX_DC_VOLTAGE_DAY    = 0x1D,
-    GET_OPERATING_HOURS_DAY   = 0x1E,
-    GET_YIELD_YEAR            = 0x1F,
-    GET_MAX_POWER_YEAR        = 0x20,
-    GET_MAX_AC_VOLTAGE_YEAR   = 0x21,
-    GET_MIN_AC_VOLTAGE_YEAR   = 0x22,
-    GET_MAX_DC_VOLTAGE_YEAR   = 0x23,
-    GET_OPERATING_HOURS_YEAR  = 0x24,
-    GET_YIELD_TOTAL           = 0x25,
-    GET_MAX_POWER_TOTAL       = 0x26,
-    GET_MAX_AC_VOLTAGE_TOTAL  = 0x27,
-    GET_MIN_AC_VOLTAGE_TOTAL  = 0x28,
-    GET_MAX_DC_VOLTAGE_TOTAL  = 0x29,
-    GET_OPERATING_HOURS_TOTAL = 0x2A,
-    GET_PHASE_1_CURRENT       = 0x2B,
-    GET_PHASE_2_CURRENT       = 0x2C,
-    GET_PHASE_3_CURRENT       = 0x2D,
-    GET_PHASE_1_VOLTAGE       = 0x2E,
-    GET_PHASE_2_VOLTAGE       = 0x2F,
-    GET_PHASE_3_VOLTAGE       = 0x30,
-    GET_AMBIENT_TEMPERATURE   = 0x31,
-    GET_FRONT_LEFT_FAN_SPEED  = 0x32,
-    GET_FRONT_RIGHT_FAN_SPEED = 0x33,
-    GET_REAR_LEFT_FAN_SPEED   = 0x34,
-    GET_REAR_RIGHT_FAN_SPEED  = 0x35
-} cmd_t;
+// Default number of hours of samples kept in memory
+#define KEEP_HOURS      48
+
+// Default time a sweep may spend retrying failed commands, in ms
+#define RETRY_BUDGET_MS 10000
+
+// Times a failed command is retried in one sweep
+#define RETRY_TRIES     3
+
+// Number of 15 minute bars on the chart in index.html
+#define CHART_BARS      60
+
+// Largest index.html we build
+#define HTML_MAX        4096
+
+// Share of the time between sweeps a collector sweep may take, percent
+#define COLLECT_BUDGET  90
+
+/* TYPEDEFS */
 
 // Commands that we're going to send to the inverter periodically
 unsigned char cmds[] = 
@@ -127,19 +121,70 @@ unsigned char cmds[] =
 
 #define CMD_COUNT (sizeof(cmds)/sizeof(cmds[0]))
 
-// Fronius message header
-typedef struct
-{
-    unsigned char start[3];
-    unsigned char length;
-    unsigned char device;
-    unsigned char number;
-    unsigned char command;
-    unsigned char data[0];
-} __attribute__((__packed__)) msgHeader_t;
+// Names of the columns in data.csv, the same order as cmds[]
+static const char csvHeader[] =
+    "TIMESTAMP             ,"
+    "POWER_NOW             ,"
+    "ENERGY_TOTAL          ,"
+    "ENERGY_DAY            ,"
+    "ENERGY_YEAR           ,"
+    "AC_CURRENT_NOW        ,"
+    "AC_VOLTAGE_NOW        ,"
+    "AC_FREQUENCY_NOW      ,"
+    "DC_CURRENT_NOW        ,"
+    "DC_VOLTAGE_NOW        ,"
+    "YIELD_DAY             ,"
+    "MAX_POWER_DAY         ,"
+    "MAX_AC_VOLTAGE_DAY    ,"
+    "MIN_AC_VOLTAGE_DAY    ,"
+    "MAX_DC_VOLTAGE_DAY    ,"
+    "OPERATING_HOURS_DAY   ,"
+    "YIELD_YEAR            ,"
+    "MAX_POWER_YEAR        ,"
+    "MAX_AC_VOLTAGE_YEAR   ,"
+    "MIN_AC_VOLTAGE_YEAR   ,"
+    "MAX_DC_VOLTAGE_YEAR   ,"
+    "OPERATING_HOURS_YEAR  ,"
+    "YIELD_TOTAL           ,"
+    "MAX_POWER_TOTAL       ,"
+    "MAX_AC_VOLTAGE_TOTAL  ,"
+    "MIN_AC_VOLTAGE_TOTAL  ,"
+    "MAX_DC_VOLTAGE_TOTAL  ,"
+    "OPERATING_HOURS_TOTAL ,"
+    "PHASE_1_CURRENT       ,"
+    "PHASE_2_CURRENT       ,"
+    "PHASE_3_CURRENT       ,"
+    "PHASE_1_VOLTAGE       ,"
+    "PHASE_2_VOLTAGE       ,"
+    "PHASE_3_VOLTAGE       ,"
+    "AMBIENT_TEMPERATURE   ,"
+    "FRONT_LEFT_FAN_SPEED  ,"
+    "FRONT_RIGHT_FAN_SPEED ,"
+    "REAR_LEFT_FAN_SPEED   ,"
+    "REAR_RIGHT_FAN_SPEED";
 
 /* STATIC VARIABLES */
 
+// Capture being replayed in place of the serial port (-r)
+static replay_t replaySrc;
+static int replaying = 0;
+
+// Time between sweeps, in seconds (-i)
+static int sampleSecs = SAMPLE_SECS;
+
+// Set by SIGINT/SIGTERM so buffered output gets flushed on the way out
+static volatile sig_atomic_t quit = 0;
+
+// index.html is built here, then written in one go
+static char *html;
+
+// Held while the store is changed, the query server reads it too
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Ports given with -f, more than one makes us a collector
+static const char *ports[SITES_MAX];
+static int portCount = 0;
+
 /* GLOBAL VARIABLES */
 
 /* FUNCTIONS */
@@ -157,479 +202,281 @@ typedef struct
  *********************************************************************/
 static void usage(const char *argv0)
 {
-    printf("usage: %s [-f port] [-d dir]\n", argv0);
-    printf("       port = the serial port to use (i.e. /dev/ttyS0)\n");
-    printf("       dir  = the root directory to write the data files to\n");
+    printf("usage: %s [-f port] [-b baud] [-d dir] [-r capture] [-c] [-s rows]\n"
+           "       [-k hours] [-i secs] [-D mins] [-R ms] [-t] [-o] [-B]\n"
+           "       [-L lat,lon] [-H] [-p port] [-P addr] [-C bands] [-T secs]\n"
+           "       [-e target] [-E rate]\n", argv0);
+    printf("       port    = the serial port to use (i.e. /dev/ttyS0), or\n");
+    printf("                 tcp:host:port for a serial to Ethernet converter.\n");
+    printf("                 Given more than once, every port is swept at the same\n");
+    printf("                 time and each gets its own directory in dir; only\n");
+    printf("                 data.csv is written then, -C applies to it\n");
+    printf("       baud    = line rate of the port, 0 to find the fastest that\n");
+    printf("                 works (default 0)\n");
+    printf("       dir     = the root directory to write the data files to\n");
+    printf("       capture = replay a capture file instead of using the port\n");
+    printf("       -c      = record every frame to %s next to data.csv\n",
+           CAPTURE_FILENAME);
+    printf("       rows    = fdatasync data.csv every this many rows (0 = never)\n");
+    printf("       hours   = hours of samples to keep in memory (default %d)\n",
+           KEEP_HOURS);
+    printf("       secs    = seconds between sweeps (default %d)\n", SAMPLE_SECS);
+    printf("       mins    = work out the day, year and total counters locally and\n");
+    printf("                 only read them from the inverter every mins minutes\n");
+    printf("       ms      = time each sweep may spend retrying failed commands\n");
+    printf("                 (default %d, 0 = no retries)\n", RETRY_BUDGET_MS);
+    printf("       -t      = add a RETRIED column flagging values read on a retry\n");
+    printf("       -o      = add an OFFSETS_MS column with the time each value was\n");
+    printf("                 read, in ms after the row's timestamp\n");
+    printf("       -B      = also write every reading with its own timestamps to\n");
+    printf("                 %s next to data.csv\n", BINLOG_FILENAME);
+    printf("       lat,lon = location of the site in degrees (north and east\n");
+    printf("                 positive), to look for the inverter around sunrise\n");
+    printf("       -H      = abort on any heap allocation after startup (small\n");
+    printf("                 build only, to check it runs in its fixed budget)\n");
+    printf("       port    = answer JSON history queries over HTTP on this TCP port\n");
+    printf("       addr    = address to answer them on (default 127.0.0.1, this\n");
+    printf("                 machine only; 0.0.0.0 for every interface)\n");
+    printf("       bands   = only write values that have changed by more than a band,\n");
+    printf("                 as a default and/or NAME=band per column, e.g.\n");
+    printf("                 0,POWER_NOW=5 (a negative band writes every sweep)\n");
+    printf("       secs    = with -C, write unchanged values again after this long\n");
+    printf("                 (default %d, 0 = never)\n", BAND_HEARTBEAT_SECS);
+    printf("       target  = also send every sweep as InfluxDB line protocol, in\n");
+    printf("                 batches, to http://host[:port][/path] (default path\n");
+    printf("                 %s), tcp:host:port or unix:path. What can't\n",
+           INFLUX_DEFAULT_PATH);
+    printf("                 be sent waits in %s in dir\n", INFLUX_SPOOL_FILENAME);
+    printf("       rate    = lines a second sent from %s once the target\n",
+           INFLUX_SPOOL_FILENAME);
+    printf("                 is back (default %d, 0 = no limit)\n", INFLUX_REPLAY_RATE);
     exit(0);
 }
 
 /*********************************************************************
- *** FUNCTION: initPort
+ *** FUNCTION: metricOf
  *** 
  *** DESCRIPTION:
- ***   Open the serial port, set the IO modes.
+ ***   Find the column of a command in cmds[], which is also its metric
+ ***   number in the sample store.
  ***
  *** RETURN VALUE:
- ***   The file descriptor to use for the serial port. .
+ ***   Index into cmds[], -1 if the command isn't polled.
  ***
  *** SIDE EFFECTS:
- ***   Exits on any errors.
+ ***   None.
  *********************************************************************/
-int initPort(const char *port)
+static int metricOf(unsigned char cmd)
 {
-    int fd;
-    struct termios t;
-    int r;
-
-    fd = open(port, O_NONBLOCK | O_RDWR);
-    if (fd < 0)
-    {
-        printf("open failed: %s\n", strerror(errno));
-        exit(0);
-    }
-
-    // Set the IO modes on the serial port
-    r = tcgetattr(fd, &t);
-    if (r != 0)
-    {
-        printf("tcgetattr failed: %s\n", strerror(errno));
-        exit(0);
-    }
-
-    cfmakeraw(&t);
-    r = cfsetispeed(&t, B19200);
-    if (r != 0)
-    {
-        printf("cfsetispeed failed: %s\n", strerror(errno));
-        exit(0);
-    }
-    
-    r = cfsetospeed(&t, B19200);
-    if (r != 0)
-    {
-        printf("cfsetospeed failed: %s\n", strerror(errno));
-        exit(0);
-    }
+    int i;
 
-    r = tcsetattr(fd, TCSANOW, &t);
-    if (r != 0)
+    for (i=0; i<CMD_COUNT; i++)
     {
-        printf("tcsetattr failed: %s\n", strerror(errno));
-        exit(0);
+        if (cmds[i] == cmd)
+            return i;
     }
 
-    return fd;
+    return -1;
 }
 
 /*********************************************************************
- *** FUNCTION: readMsg
+ *** FUNCTION: getTime
  *** 
  *** DESCRIPTION:
- ***   Read a message on the serial port
+ ***   Get the current wall clock time. When replaying a capture this
+ ***   is the time the capture was taken, not the time now.
  ***
  *** RETURN VALUE:
- ***   The number of bytes in the message. Returns 0 if there's an
- ***   error or timeout.
+ ***   Time is returned in tv.
  ***
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static int readMsg(int fd, unsigned char *buf, int len)
+static void getTime(struct timeval *tv)
 {
-    static char readbuf[100];
-    int r;
-    int readBufTail = 0;
-    unsigned char start[] = { 0x80, 0x80, 0x80 };
-    int i;
-
-    for ( ; ; )
-    {
-        fd_set readFds;
-
-        // One second timeout
-        struct timeval timeout = { 1, 0 };
-        
-        FD_ZERO(&readFds);
-        FD_SET(fd, &readFds);
-
-        r = select(fd+1, &readFds, NULL, NULL, &timeout);
-        if (r < 0)
-        {
-            // Error
-            printf("select failed: %s\n", strerror(errno));
-            return 0;
-        }
-        if (r == 0)
-        {
-            // Timed out, nothing to read
-            return 0;
-        }
-
-        // We should be good to go here.
-        r = read(fd, &readbuf[readBufTail], sizeof(readbuf) - readBufTail);
-        readBufTail += r;
-
-        // Figure out if there's a whole message in the readbuf
-        for (i=0; i<readBufTail; i++)
-        {
-            unsigned char cksumRecv;
-            unsigned char cksum = 0;
-            msgHeader_t *hdr = (msgHeader_t *)&readbuf[i];
-            int j;
-            
-            // Check if there's enough in the buffer before processing
-            if (i+sizeof(msgHeader_t) > readBufTail)
-            {
-                // Loop again to read more bytes
-                break;
-            }
-            
-            if (memcmp(&readbuf[i], start, 3) != 0)
-            {
-                // No start flag, keep going
-                break;
-            }
-
-            // Check the length field in the header
-            if (sizeof(msgHeader_t) + hdr->length + 1 > readBufTail)
-            {
-                // Still need to read more bytes
-                break;
-            }
-
-            // OK, we have the right message length. Verify the checksum.
-            cksumRecv = readbuf[readBufTail - 1];
-            for(j=i+3; j<readBufTail-1; j++)
-            {
-                cksum += readbuf[j];
-            }
-            if (cksum != cksumRecv)
-            {
-                printf("bad message checksum [%d]: %d != %d\n", readBufTail-1,
-                       cksum, cksumRecv);
-                return 0;
-            }
-            memcpy(buf, &readbuf[i], sizeof(msgHeader_t)+hdr->length+1);
-            return sizeof(msgHeader_t)+hdr->length+1;
-        }
-    }
-    return 0;
+    if (replaying)
+        replayGetTime(&replaySrc, tv);
+    else
+        gettimeofday(tv, NULL);
 }
 
 /*********************************************************************
- *** FUNCTION: writeMsg
+ *** FUNCTION: getStamp
  *** 
  *** DESCRIPTION:
- ***   Send a message on the serial port
+ ***   Get the current time on both clocks, as the capture saw it when
+ ***   replaying.
  ***
  *** RETURN VALUE:
- ***   Always returns the number of bytes written. 
+ ***   Time is returned in at.
  ***
  *** SIDE EFFECTS:
- ***   Exits if the write fails.
+ ***   None.
  *********************************************************************/
-static int writeMsg(int fd, unsigned char *msg, int len)
+static void getStamp(frStamp_t *at)
 {
-    msgHeader_t *hdr = (msgHeader_t *)msg;
-    int i;
-    unsigned char cksum = 0;
-    int r;
+    struct timeval tv;
 
-    // Build the header.
-    hdr->start[0] = 0x80;
-    hdr->start[1] = 0x80;
-    hdr->start[2] = 0x80;
-
-    // Set the length field
-    hdr->length = len;
-
-    // Compute the checksum
-    for (i=sizeof(hdr->start); i<sizeof(*hdr) + len; i++)
+    if (replaying)
     {
-        cksum += msg[i];
+        replayGetTime(&replaySrc, &tv);
+        at->real.tv_sec  = tv.tv_sec;
+        at->real.tv_nsec = tv.tv_usec * 1000;
+        replayGetMono(&replaySrc, &at->mono);
     }
-    msg[i] = cksum;
-
-    // Send the message on the serial port
-    r = write(fd, msg, sizeof(*hdr) + len + 1);
-    if (r != (sizeof(*hdr) + len + 1))
+    else
     {
-        printf("write failed: %s", strerror(errno));
-        exit(0);
+        clock_gettime(CLOCK_MONOTONIC, &at->mono);
+        clock_gettime(CLOCK_REALTIME, &at->real);
     }
+}
 
-    return len;
+/*********************************************************************
+ *** FUNCTION: onSignal
+ *** 
+ *** DESCRIPTION:
+ ***   Signal handler for SIGINT and SIGTERM.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Asks the main loop to stop.
+ *********************************************************************/
+static void onSignal(int sig)
+{
+    quit = 1;
 }
 
 /*********************************************************************
- *** FUNCTION: getVersion
+ *** FUNCTION: replayIoRead
  *** 
  *** DESCRIPTION:
- ***   Get the software version of the interface card
+ ***   Protocol library read hook used when replaying a capture.
  ***
  *** RETURN VALUE:
- ***   Returns 1 if the request was successful, 0 otherwise. Software
- ***   versions are returned in major, minor and release.
+ ***   Number of bytes read, 0 if there are none before the next
+ ***   request in the capture.
  ***
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static int getVersion(int fd, unsigned char *major, unsigned char *minor,
-                      unsigned char *release)
+static int replayIoRead(void *arg, unsigned char *buf, int len)
 {
-    // The data section of the message
-    typedef struct 
-    {
-        unsigned char major;
-        unsigned char minor;
-        unsigned char release;
-    } __attribute__((__packed__)) version_t;
-    
-    unsigned char msgbuf[100];
-    msgHeader_t *hdr;
-    version_t *version;
-    int r;
-    
-    hdr = (msgHeader_t *)msgbuf;
-
-    hdr->device = 0;
-    hdr->number = 0;
-    hdr->command = 0x01; // Get version command
-
-    writeMsg(fd, msgbuf, 0);
-    r = readMsg(fd, msgbuf, sizeof(msgbuf));
-    if (r == 0)
-    {
-        printf("readMsg timed out (get version)\n");
-        return 0;
-    }
-
-    version = (version_t *)hdr->data;
-    *major = version->major;
-    *minor = version->minor;
-    *release = version->release;
-
-    return 1;
+    return replayRead(arg, buf, len);
 }
 
 /*********************************************************************
- *** FUNCTION: getActiveInverter
+ *** FUNCTION: replayIoWrite
  *** 
  *** DESCRIPTION:
- ***   Get the number of the active inverter.
+ ***   Protocol library write hook used when replaying a capture.
+ ***   Nothing is sent, we just move on to the next request in the
+ ***   capture if it's this one.
  ***
  *** RETURN VALUE:
- ***   0 if no inverters are active, 1 otherwise. ID number of active
- ***   inverter is returned in active.
+ ***   Always returns len.
  ***
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static int getActiveInverter(int fd, unsigned char *active)
+static int replayIoWrite(void *arg, const unsigned char *buf, int len)
 {
-    typedef struct 
-    {
-        unsigned char active;
-    } __attribute__((__packed__)) activeInv_t;
-    
-    unsigned char msgbuf[100];
-    msgHeader_t *hdr;
-    activeInv_t *activeInv;
-    int r;
-    
-    hdr = (msgHeader_t *)msgbuf;
-
-    hdr->device = 0;
-    hdr->number = 0;
-    hdr->command = 0x04;
-
-    writeMsg(fd, msgbuf, 0);
-    r = readMsg(fd, msgbuf, sizeof(msgbuf));
-    if (r == 0)
-    {
-        printf("readMsg timed out (get active inverter)\n");
-        return 0;
-    }
-
-    if (hdr->length == 0)
-    {
-        return 0;
-    }
-    
-    activeInv = (activeInv_t *)hdr->data;
-    *active = activeInv->active;
-
-    return 1;
+    replayNextTx(arg, buf, len);
+    return len;
 }
 
 /*********************************************************************
- *** FUNCTION: typeIdToStr
+ *** FUNCTION: replayIoNow
  *** 
  *** DESCRIPTION:
- ***   Convert the typeId of the inverter to a string.
+ ***   Protocol library clock hook used when replaying a capture, so
+ ***   readings are stamped with the time they were captured.
  ***
  *** RETURN VALUE:
- ***   Constant string name.
+ ***   Time is returned in at.
  ***
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static const char *typeIdToStr(unsigned char typeId)
+static void replayIoNow(void *arg, frStamp_t *at)
 {
-    switch (typeId)
-    {
-        case 0xFE:
-        return "FRONIUS IG 15";
-
-        case 0xFD:
-        return "FRONIUS IG 20";
-        
-        case 0xFC:
-        return "FRONIUS IG 30";
-        
-        case 0xFB:
-        return "FRONIUS IG 30 Dummy";
-        
-        case 0xFA:
-        return "FRONIUS IG 40";
-        
-        case 0xF9:
-        return "FRONIUS IG 60/IG 60 HV";
-        
-        case 0xF6:
-        return "FRONIUS IG 300";
-
-        case 0xF5:
-        return "FRONIUS IG 400";
-
-        case 0xF4:
-        return "FRONIUS IG 500";
-
-        case 0xF3:
-        return "FRONIUS IG 60/IG 60 HV";
-
-        case 0xEE:
-        return "FRONIUS IG 2000";
-
-        case 0xED:
-        return "FRONIUS IG 3000";
-
-        case 0xEB:
-        return "FRONIUS IG 4000";
-
-        case 0xEA:
-        return "FRONIUS IG 5100";
-
-        case 0xE5:
-        return "FRONIUS IG 2500-LV";
-
-        case 0xE3:
-        return "FRONIUS IG 4500-LV";
-
-        case 0xFF:
-        default:
-        return "Unknown device";
-    }
+    getStamp(at);
 }
 
 /*********************************************************************
- *** FUNCTION: getDeviceType
+ *** FUNCTION: captureHook
  *** 
  *** DESCRIPTION:
- ***   Get the device type of the active inverter.
+ ***   Protocol library frame hook that feeds the capture file.
  ***
  *** RETURN VALUE:
- ***   1 for success, 0 for failure. Device type returned in typeId.
+ ***   None.
  ***
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static int getDeviceType(int fd, unsigned char number, unsigned char *typeId)
+static void captureHook(void *arg, int dir, const unsigned char *buf, int len,
+                        int flags)
 {
-    unsigned char msgbuf[100];
-    msgHeader_t *hdr;
-    int r;
-    
-    hdr = (msgHeader_t *)msgbuf;
-
-    hdr->device = 1;
-    hdr->number = number;
-    hdr->command = 0x02;
-
-    writeMsg(fd, msgbuf, 0);
-    r = readMsg(fd, msgbuf, sizeof(msgbuf));
-    if (r == 0)
-    {
-        printf("readMsg timed out (get active inverter)\n");
-        return 0;
-    }
+    int captureFlags = 0;
 
-    if (hdr->length != 1)
-    {
-        return 0;
-    }
-    
-    *typeId = *hdr->data;
+    if (flags & FR_FRAME_BAD_CKSUM)
+        captureFlags |= CAPTURE_FLAG_BAD_CKSUM;
+    if (flags & FR_FRAME_INCOMPLETE)
+        captureFlags |= CAPTURE_FLAG_INCOMPLETE;
 
-    return 1;
+    captureFrame((dir == FR_FRAME_TX) ? CAPTURE_TX : CAPTURE_RX, 0, buf, len,
+                 captureFlags);
 }
 
 /*********************************************************************
- *** FUNCTION: getNumeric
+ *** FUNCTION: retryFailed
  *** 
  *** DESCRIPTION:
- ***   Get a numeric parameter from the inverter.
+ ***   Go round the commands that failed earlier in the sweep again,
+ ***   each up to RETRY_TRIES times, until they've all been read or the
+ ***   time runs out.
  ***
  *** RETURN VALUE:
- ***   1 for success, 0 for failure. Value returned in f.
+ ***   None. Values read are filled in values[] and stamps[] and their
+ ***   bits set in retried.
  ***
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static int getNumeric(int fd, unsigned char number, unsigned char cmd, float *f)
+static void retryFailed(frCtx_t *ctx, unsigned char active, int *queue, int count,
+                        const struct timeval *until, float *values,
+                        frStamp_t *stamps, unsigned long long *retried)
 {
-    unsigned char msgbuf[100];
-    msgHeader_t *hdr;
-    int r;
-    short value;
-    signed char exponent;
-    
-    hdr = (msgHeader_t *)msgbuf;
-
-    hdr->device  = 1;
-    hdr->number  = number;
-    hdr->command = cmd;
-
-    writeMsg(fd, msgbuf, 0);
-    r = readMsg(fd, msgbuf, sizeof(msgbuf));
-    if (r == 0)
-    {
-        printf("readMsg timed out (get active inverter)\n");
-        return 0;
-    }
+    struct timeval now;
+    int pass, k, n, j;
+    float fval;
 
-    if (hdr->length != 3)
-    {
-        return 0;
-    }
-    
-    memcpy(&value, hdr->data, 2);
-    value = ntohs(value);
-    exponent = (char)hdr->data[2];
-    if ((exponent < -3) || (exponent > 10))
-        return 0;
-
-    //only the temperature command returns a signed value
-    if (cmd != 0x31)
+    for (pass=0; (pass < RETRY_TRIES) && (count > 0); pass++)
     {
-        *f = (unsigned short)value * powf(10, exponent);
-    }
-    else
-    {
-        *f = value * powf(10, exponent);
+        n = 0;
+        for (k=0; k<count; k++)
+        {
+            // Leave whatever is left for the next sweep. The capture's
+            // clock is used when replaying so the same retries happen.
+            getTime(&now);
+            if (timercmp(&now, until, >=))
+                return;
+
+            j = queue[k];
+            if (frGetNumericAt(ctx, active, cmds[j], &fval, &stamps[j]) == FR_OK)
+            {
+                values[j] = fval;
+                *retried |= 1ULL << j;
+            }
+            else
+            {
+                queue[n++] = j;
+            }
+        }
+        count = n;
     }
-
-    return 1;
 }
 
 /*********************************************************************
@@ -649,12 +496,13 @@ static void delay(struct timeval *nextEvent)
     struct timeval now;
     struct timeval timetmp;
     useconds_t sleepyTime;
-    struct timeval inc = { 60, 0 };
+    struct timeval inc = { sampleSecs, 0 };
 
-    gettimeofday(&now, NULL);
+    getTime(&now);
 
-    // If it's already time to do stuff, return
-    if (timercmp(&now, nextEvent, >=))
+    // If it's already time to do stuff, return. There's never any
+    // waiting when replaying, the capture dictates the pace.
+    if (replaying || timercmp(&now, nextEvent, >=))
     {
         timeradd(nextEvent, &inc, &timetmp);
         *nextEvent = timetmp;
@@ -672,103 +520,109 @@ static void delay(struct timeval *nextEvent)
 }
 
 /*********************************************************************
- *** FUNCTION: makePath
+ *** FUNCTION: sleepUntil
  *** 
  *** DESCRIPTION:
- ***   Generate the path for the CSV data file and the index.html
+ ***   Sleep until a given time, or until we're asked to quit. Returns
+ ***   straight away when replaying.
  ***
  *** RETURN VALUE:
- ***   Returns the complete path to the file in path.
+ ***   None.
  ***
  *** SIDE EFFECTS:
- ***   Creates directories if they don't exist.
+ ***   None.
  *********************************************************************/
-static void makePath(const char *dir, const char *filename, char *path, int pathLen)
+static void sleepUntil(time_t when)
 {
-    struct timeval t;
-    struct tm *tmTime;
-    char tmp[255];
+    struct timeval now;
+    struct timespec ts;
 
-    // File path is "<dir>/Year/Month/Day/file". For example:
-    // /tmp/2009/03/23/data.csv
-    gettimeofday(&t, NULL);
-    tmTime = localtime(&t.tv_sec);
+    if (replaying)
+        return;
 
-    snprintf(path, pathLen, "%s", dir);
-    mkdir(path, 0755);
+    getTime(&now);
+    if (now.tv_sec >= when)
+        return;
 
-    snprintf(tmp, sizeof(tmp), "/%04d", tmTime->tm_year+1900);
-    strncat(path, tmp, pathLen);
-    mkdir(path, 0755);
+    // Whole seconds to go less the part of this one already gone. On
+    // an exact second that's no part at all, tv_nsec must stay below 1e9.
+    ts.tv_sec  = when - now.tv_sec - 1;
+    ts.tv_nsec = (1000000 - now.tv_usec) * 1000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
 
-    snprintf(tmp, sizeof(tmp), "/%02d", tmTime->tm_mon+1);
-    strncat(path, tmp, pathLen);
-    mkdir(path, 0755);
-    
-    snprintf(tmp, sizeof(tmp), "/%02d", tmTime->tm_mday);
-    strncat(path, tmp, pathLen);
-    mkdir(path, 0755);
-    
-    snprintf(tmp, sizeof(tmp), "/%s", filename);
-    strncat(path, tmp, pathLen);
+    // A signal cuts the sleep short, leaving quit set
+    nanosleep(&ts, NULL);
 }
 
 /*********************************************************************
  *** FUNCTION: openFile
  *** 
  *** DESCRIPTION:
- ***   Open the CSV data file
+ ***   Open the CSV data file in the current day directory
  ***
  *** RETURN VALUE:
- ***   FILE pointer to open file. NULL if there's an error opening the
- ***   file. newFile is set to 1 if a new file was created, 0 if we are
- ***   appending to an existing file.
+ ***   File descriptor of the open file, opened for appending. -1 if
+ ***   there's an error opening the file. newFile is set to 1 if a new
+ ***   file was created, 0 if we are appending to an existing file.
  ***
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static FILE *openFile(const char *dir, int *newFile)
+static int openFile(const rotator_t *rot, int *newFile)
 {
-    char path[255];
     struct stat statbuf;
-    FILE *f;
-    int r;
+    int fd;
 
     *newFile = 0;
-    
-    makePath(dir, "data.csv", path, sizeof(path));
 
-    r = stat(path, &statbuf);
-    if (r != 0)
+    fd = rotOpen(rot, "data.csv", O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
     {
-        if (errno == ENOENT)
-        {
-            f = fopen(path, "a");
-            if (f == NULL)
-            {
-                printf("fopen(%s) failed: %s\n", path, strerror(errno));
-                exit(0);
-            }
-            *newFile = 1;
-        }
-        else
-        {
-            printf("stat(%s) failed: %s\n", path, strerror(errno));
-            exit(0);
-        }
+        printf("open(data.csv) failed: %s\n", strerror(errno));
+        return -1;
     }
 
-    if (*newFile == 0)
+    if (fstat(fd, &statbuf) != 0)
     {
-        f = fopen(path, "a");
-        if (f == NULL)
-        {
-            printf("fopen(%s) failed: %s", path, strerror(errno));
-            exit(0);
-        }
+        printf("fstat(data.csv) failed: %s\n", strerror(errno));
+        close(fd);
+        return -1;
     }
 
-    return f;
+    *newFile = (statbuf.st_size == 0);
+
+    return fd;
+}
+
+/*********************************************************************
+ *** FUNCTION: htmlAdd
+ *** 
+ *** DESCRIPTION:
+ ***   printf() onto the end of the index.html being built.
+ ***
+ *** RETURN VALUE:
+ ***   The new length. Anything past HTML_MAX is cut off.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int htmlAdd(int len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(html + len, HTML_MAX - len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return len;
+    len += n;
+    return (len < HTML_MAX) ? len : HTML_MAX - 1;
 }
 
 /*********************************************************************
@@ -783,39 +637,46 @@ static FILE *openFile(const char *dir, int *newFile)
  *** SIDE EFFECTS:
  ***   None.
  *********************************************************************/
-static void updateHtml(const char *dir, short *watts, int wattsCount, float energyNow,
-                       float energyDay, time_t startTime)
+static void updateHtml(const rotator_t *rot, const struct tm *lt, const store_t *store,
+                       float energyNow, float energyDay, time_t startTime)
 {
-    FILE *f;
-    char path[255];
+    int fd;
+    int len = 0;
     int i;
+    short watts[CHART_BARS];
+    int wattsCount = 0;
+    int power = metricOf(GET_POWER_NOW);
+    int64_t from, last;
+    float avg;
     int max = 0;
     int energyNowInt = energyNow; 
     int energyDayInt = energyDay;
-    struct timeval now;
-    struct tm *lt, *st;
+    struct tm st;
     float startX, stopX;
 
-    gettimeofday(&now, NULL);
-    lt = localtime(&now.tv_sec);
+    rotLocalTime(rot, startTime, &st);
 
-    st = localtime(&startTime);
-
-    startX = st->tm_min;
+    startX = st.tm_min;
     startX /= 60;
-    startX += st->tm_hour;
+    startX += st.tm_hour;
     stopX = startX + 15.0;
 
-    makePath(dir, "index.html", path, sizeof(path));
-
-    // Open up the index.html file
-    f = fopen(path, "w+");
-    if (f == NULL)
+    // Average the power over every 15 minutes since the first reading
+    // of the day. The last bar is the quarter hour in progress.
+    if ((startTime != 0) && (power >= 0) && (storeCount(store) > 0))
     {
-        printf("Failed to open %s: %s\n", path, strerror(errno));
-        return;
+        last = storeTime(store, storeCount(store) - 1);
+        for ( ; wattsCount < CHART_BARS; wattsCount++)
+        {
+            from = (int64_t)(startTime + wattsCount * 15 * 60) * 1000;
+            if (from > last)
+                break;
+            if (storeAverage(store, power, from, from + 15 * 60 * 1000, &avg) == 0)
+                avg = 0;
+            watts[wattsCount] = avg;
+        }
     }
-    
+
     for (i = 0; i < wattsCount; i++)
     {
         if (watts[i] > max)
@@ -824,30 +685,255 @@ static void updateHtml(const char *dir, short *watts, int wattsCount, float ener
         }
     }
 
-    // Write out the current output
-    fprintf(f, "<html>\n");
-    fprintf(f, "Current Power:      %d W<br>\n", energyNowInt);
-    fprintf(f, "Today's Power:      %d kWh<br>\n", energyDayInt/1000);
-    fprintf(f, "<img src=http://chart.apis.google.com/chart?cht=lc");
-    fprintf(f, "&chxt=x,y&chxr=0,%g,%g|1,0,%u", startX, stopX, (max + (50 - max%50)));
-    fprintf(f, "&chtt=Power+(watts)&chd=t:");
+    // Build the page with the current output
+    len = htmlAdd(len, "<html>\n");
+    len = htmlAdd(len, "Current Power:      %d W<br>\n", energyNowInt);
+    len = htmlAdd(len, "Today's Power:      %d kWh<br>\n", energyDayInt/1000);
+    len = htmlAdd(len, "<img src=http://chart.apis.google.com/chart?cht=lc");
+    len = htmlAdd(len, "&chxt=x,y&chxr=0,%g,%g|1,0,%u", startX, stopX, (max + (50 - max%50)));
+    len = htmlAdd(len, "&chtt=Power+(watts)&chd=t:");
     for (i=0; i<wattsCount; i++)
     {
-        fprintf(f, "%d,", watts[i]);
+        len = htmlAdd(len, "%d,", watts[i]);
+    }
+    for ( ; i<CHART_BARS; i++)
+    {
+        len = htmlAdd(len, "0");
+        if (i < CHART_BARS-1)
+            len = htmlAdd(len, ",");
+    }
+    len = htmlAdd(len, "&chds=0,%u&chs=800x370><br>\n", (max + (50 - max%50)));
+    len = htmlAdd(len, "Raw data:           <a href=data.csv>data.csv</a><br>\n");
+    len = htmlAdd(len, "Last update: %02d:%02d %d-%02d-%02d<br>\n", lt->tm_hour, lt->tm_min,
+                  lt->tm_year+1900, lt->tm_mon+1, lt->tm_mday);
+    len = htmlAdd(len, "</html>\n");
+
+    // Write out the page
+    fd = rotOpen(rot, "index.html", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((fd < 0) || (write(fd, html, len) != len))
+        printf("Failed to write index.html: %s\n", strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+/*********************************************************************
+ *** FUNCTION: addValues
+ *** 
+ *** DESCRIPTION:
+ ***   Add a sweep's values to a CSV row. Values not marked in changed
+ ***   are left empty; with change only rows a value that has gone
+ ***   missing is written as such.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void addValues(csvRow_t *row, const float *values, unsigned long long changed,
+                      int changeOnly)
+{
+    int j;
+
+    for (j=0; j<CMD_COUNT; j++)
+    {
+        // None of the data seems to have more than 1/100 precision
+        if (!(changed & (1ULL << j)))
+            csvEmpty(row);
+        else if (!isnan(values[j]))
+            csvValue(row, values[j]);
+        else if (changeOnly)
+            csvMissing(row);
+        else
+            csvEmpty(row);
+    }
+}
+
+/*********************************************************************
+ *** FUNCTION: reconnect
+ *** 
+ *** DESCRIPTION:
+ ***   Open the port again after it failed, a converter that dropped
+ ***   the connection or a USB serial port that was unplugged.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void reconnect(frCtx_t *ctx, const frEndpoint_t *ep)
+{
+    int fd;
+
+    if (ctx->fd >= 0)
+        close(ctx->fd);
+
+    fd = frOpenEndpoint(ep, (ctx->baud != 0) ? ctx->baud : FR_BAUD_DEFAULT);
+    if (fd < 0)
+        printf("Can't open %s again: %s\n", ep->spec, strerror(errno));
+    else
+        printf("Opened %s again\n", ep->spec);
+
+    frSetFd(ctx, (fd >= 0) ? fd : -1);
+}
+
+/*********************************************************************
+ *** FUNCTION: collect
+ *** 
+ *** DESCRIPTION:
+ ***   Run as a collector for all the ports given. Every sweep goes out
+ ***   to all of them at once, and each site's rows go to data.csv in
+ ***   a directory of its own in dir, and to the line protocol export
+ ***   if influx isn't NULL. Never returns.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   Exits when asked to quit.
+ *********************************************************************/
+static void collect(const char *dir, int baud, const deadband_t *bandTemplate,
+                    influxConfig_t *influx, int heapFatal)
+{
+    sites_t sites;
+    site_t *site;
+    rotator_t *rot;
+    deadband_t *band = NULL;
+    csvRow_t *row;
+    struct rlimit rl;
+    struct timeval t, timestamp;
+    struct tm ltm;
+    char path[sizeof(rot->root)];
+    unsigned long long changed;
+    size_t arenaSize;
+    int i, r, fd, newFile;
+
+    // Each site keeps its connection and two directories open
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < portCount * 3 + 16)
+            printf("Only %lu files can be open, too few for %d sites\n",
+                   (unsigned long)rl.rlim_cur, portCount);
+    }
+
+    arenaSize = ARENA_ROUND(sizeof(csvRow_t)) + ARENA_ROUND(sitesFootprint(portCount)) +
+                ARENA_ROUND(portCount * sizeof(rotator_t));
+    if (bandTemplate != NULL)
+        arenaSize += ARENA_ROUND(portCount * sizeof(deadband_t));
+    if (influx != NULL)
+        arenaSize += ARENA_ROUND(influxFootprint());
+    if (arenaInit(arenaSize) == 0)
+        exit(0);
+    row = arenaAlloc(sizeof(csvRow_t));
+    rot = arenaAlloc(portCount * sizeof(rotator_t));
+    if (bandTemplate != NULL)
+        band = arenaAlloc(portCount * sizeof(deadband_t));
+
+    if (sitesInit(&sites, arenaAlloc(sitesFootprint(portCount)), ports, portCount,
+                  (baud != 0) ? baud : FR_BAUD_DEFAULT, cmds, CMD_COUNT) == 0)
+    {
+        exit(0);
+    }
+
+    mkdir(dir, 0755);
+    for (i=0; i<portCount; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, sites.site[i].name);
+        if (rotInit(&rot[i], path) == 0)
+            exit(0);
+        if (band != NULL)
+            band[i] = *bandTemplate;
+    }
+
+    // The export's spool goes in the root, next to the sites
+    if (influx != NULL)
+    {
+        influx->rootFd = open(dir, O_RDONLY | O_DIRECTORY);
+        if ((influx->rootFd < 0) || (influxStart(influx, arenaAlloc(influxFootprint())) == 0))
+            exit(0);
     }
-    for ( ; i<60; i++)
+    printf("Collecting from %d sites\n", portCount);
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    getTime(&t);
+
+#ifdef FRONIUS_SMALL
+    arenaReport("at startup");
+#endif
+    arenaSeal(heapFatal);
+
+    while (!quit)
     {
-        fprintf(f, "0");
-        if (i < 59)
-            fprintf(f, ",");
+        getTime(&timestamp);
+        sitesSweep(&sites, sampleSecs * 10 * COLLECT_BUDGET);
+
+        for (i=0; i<portCount; i++)
+        {
+            site = &sites.site[i];
+            if ((site->status != FR_OK) || (site->active == 0))
+                continue;
+
+            r = rotCheck(&rot[i], timestamp.tv_sec);
+            if (r < 0)
+                continue;
+            fd = openFile(&rot[i], &newFile);
+            if (fd < 0)
+                continue;
+
+            csvBegin(row);
+            if (newFile)
+            {
+                csvText(row, "Software version: %d.%d.%d\n", site->major, site->minor,
+                        site->release);
+                csvText(row, "Inverter model: %s\n", frTypeIdToStr(site->typeId));
+                csvText(row, "%s\n", csvHeader);
+            }
+
+            // The first row of the day in this run is a full one
+            if ((band != NULL) && (r != 0))
+            {
+                bandReset(&band[i]);
+                csvText(row, "%s\n", BAND_CSV_MARKER);
+            }
+
+            changed = (band != NULL) ? bandCheck(&band[i], site->values, timestamp.tv_sec) :
+                                       ~0ULL;
+            if (changed != 0)
+            {
+                rotLocalTime(&rot[i], timestamp.tv_sec, &ltm);
+                csvTimestamp(row, &ltm);
+                addValues(row, site->values, changed, band != NULL);
+                csvEnd(row);
+                if (influx != NULL)
+                {
+                    influxSweep(site->name, site->active, site->values, site->stamps,
+                                changed);
+                }
+            }
+
+            if ((row->len > 0) && (csvWrite(row, fd) == 0))
+                printf("Failed to write %s/data.csv: %s\n", site->name, strerror(errno));
+            close(fd);
+        }
+
+        delay(&t);
     }
-    fprintf(f, "&chds=0,%u&chs=800x370><br>\n", (max + (50 - max%50)));
-    fprintf(f, "Raw data:           <a href=data.csv>data.csv</a><br>\n");
-    fprintf(f, "Last update: %02d:%02d %d-%02d-%02d<br>\n", lt->tm_hour, lt->tm_min,
-            lt->tm_year+1900, lt->tm_mon+1, lt->tm_mday);
-    fprintf(f, "</html>\n");
 
-    fclose(f);
+    for (i=0; i<portCount; i++)
+        rotClose(&rot[i]);
+    if (influx != NULL)
+        influxStop();
+
+#ifdef FRONIUS_SMALL
+    arenaReport("at exit");
+#endif
+
+    exit(0);
 }
 
 /*********************************************************************
@@ -865,50 +951,131 @@ static void updateHtml(const char *dir, short *watts, int wattsCount, float ener
 int main(int argc, char *argv[])
 {
     // Default serial port
-    char *port = "/dev/ttyS0";
+    const char *port = "/dev/ttyS0";
+    frEndpoint_t ep;
 
     // Default root directory
     char *dir  = ".";
     
-    int i, j, k;
+    int i, j;
 
     // Software version from interface card
-    unsigned char major, minor, release, active, typeId;
+    unsigned char major = 0, minor = 0, release = 0, active, typeId;
 
-    // Serial port fd
+    // Serial port fd and the protocol state for it
     int fd;
+    int baud = 0;
+    frCtx_t ctx;
+    frIo_t replayIo = { replayIoRead, replayIoWrite, &replaySrc, replayIoNow };
     int r;
     float fval;
 
-    // File pointer of the data file
-    FILE *f = NULL;
+    // Day directories and the data file in today's
+    rotator_t rot;
+    int csvFd = -1;
+    int syncRows = 0;
+    int unsyncedRows = 0;
     
-    struct timeval t, timestamp, startTime;
+    struct timeval t, timestamp;
+    struct timeval startTime = { 0, 0 };
     int firstPower = 0;
     
     int newFile = 0;
-    struct tm *ltime;
+    struct tm ltm;
+    struct tm *ltime = &ltm;
 
     // Current usage and total kWh for the day to put on the web page
     float energyNow = 0, energyDay = 0;
 
-    // Watts averaged every 15 minutes 
-    static short watts15[100];
-    static int watts15Count = 0;
-
-    // Watts sampled every minute
-    static short watts[15];
-    static int wattsCount = 0;
+    // The CSV row being built for this sweep
+    csvRow_t *row;
+
+    // Recent samples of every metric
+    int keepHours = KEEP_HOURS;
+    uint32_t capacity;
+    void *storeMem;
+    store_t store;
+    float values[CMD_COUNT];
+    unsigned char polled[CMD_COUNT];
+
+    // Commands that failed this sweep and get another go (-R, -t)
+    int retryBudgetMs = RETRY_BUDGET_MS;
+    int tagRetries = 0;
+    int retryQueue[CMD_COUNT];
+    int retryCount;
+    unsigned long long retried;
+    struct timeval budget, until;
+
+    // When each value was read (-o, -B)
+    frStamp_t stamps[CMD_COUNT];
+    frStamp_t derivedAt;
+    unsigned long long derived;
+    int offsets[CMD_COUNT];
+    int tagOffsets = 0;
+    int binary = 0;
+    binlog_t bin;
+    int flags;
+
+    // Dormant while the inverter is off for the night (-L)
+    night_t night;
+    double lat, lon;
+    int haveSite = 0;
+
+    // The day's state, kept in a file so a restart carries on from it
+    ckpt_t ckpt;
+    time_t nextCkptSync = 0;
+
+    // Counters worked out locally (-D)
+    derive_t derive;
+    deriveInputs_t inputs;
+    int reconcileMins = 0;
+    int reconcile = 0;
+    int64_t nowMs;
+
+    // Every buffer comes out of one arena sized up front (-H)
+    size_t arenaSize;
+    void *ring = NULL;
+    int heapFatal = 0;
+
+    // History queries over HTTP (-p, -P)
+    httpConfig_t httpCfg;
+    int httpPort = 0;
+    const char *httpAddr = NULL;
+
+    // Change only recording (-C, -T)
+    deadband_t band;
+    const char *bands = NULL;
+    int heartbeat = BAND_HEARTBEAT_SECS;
+    unsigned long long changed;
+    frStamp_t sweepAt;
+
+    // Line protocol export (-e, -E)
+    influxConfig_t influxCfg;
+    const char *influxTarget = NULL;
+    int influxRate = INFLUX_REPLAY_RATE;
+
+    // Replay statistics
+    const char *capture = NULL;
+    int record = 0;
+    struct timespec replayStart, replayEnd;
+    double replaySecs;
 
     // Process command line arguments
     for (i=0; i<argc; i++)
     {
         if (strcmp(argv[i], "-f") == 0)
+        {
+            if (((i+1) >= argc) || (portCount == SITES_MAX))
+                usage(argv[0]);
+            else
+                ports[portCount++] = argv[i+1];
+        }
+        if (strcmp(argv[i], "-b") == 0)
         {
             if ((i+1) >= argc)
                 usage(argv[0]);
             else
-                port = argv[i+1];
+                baud = atoi(argv[i+1]);
         }
         if (strcmp(argv[i], "-d") == 0)
         {
@@ -917,38 +1084,390 @@ int main(int argc, char *argv[])
             else
                 dir = argv[i+1];
         }
+        if (strcmp(argv[i], "-r") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                capture = argv[i+1];
+        }
+        if (strcmp(argv[i], "-c") == 0)
+        {
+            record = 1;
+        }
+        if (strcmp(argv[i], "-s") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                syncRows = atoi(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-k") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                keepHours = atoi(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-i") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                sampleSecs = atoi(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-R") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                retryBudgetMs = atoi(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-t") == 0)
+        {
+            tagRetries = 1;
+        }
+        if (strcmp(argv[i], "-o") == 0)
+        {
+            tagOffsets = 1;
+        }
+        if (strcmp(argv[i], "-B") == 0)
+        {
+            binary = 1;
+        }
+        if (strcmp(argv[i], "-L") == 0)
+        {
+            if (((i+1) >= argc) || (sscanf(argv[i+1], "%lf,%lf", &lat, &lon) != 2))
+                usage(argv[0]);
+            else
+                haveSite = 1;
+        }
+        if (strcmp(argv[i], "-H") == 0)
+        {
+            heapFatal = 1;
+        }
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                httpPort = atoi(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-P") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                httpAddr = argv[i+1];
+        }
+        if (strcmp(argv[i], "-C") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                bands = argv[i+1];
+        }
+        if (strcmp(argv[i], "-T") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                heartbeat = atoi(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-e") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                influxTarget = argv[i+1];
+        }
+        if (strcmp(argv[i], "-E") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                influxRate = atoi(argv[i+1]);
+        }
+        if (strcmp(argv[i], "-D") == 0)
+        {
+            if ((i+1) >= argc)
+                usage(argv[0]);
+            else
+                reconcileMins = atoi(argv[i+1]);
+        }
+    }
+
+    if (bands != NULL)
+    {
+        bandInit(&band, CMD_COUNT, heartbeat);
+        if (bandParse(&band, bands, csvHeader) == 0)
+            usage(argv[0]);
+    }
+
+    influxCfg.target = influxTarget;
+    influxCfg.rootFd = -1;
+    influxCfg.rate   = influxRate;
+    influxCfg.header = csvHeader;
+
+    if ((portCount > 1) && (capture == NULL))
+        collect(dir, baud, (bands != NULL) ? &band : NULL,
+                (influxTarget != NULL) ? &influxCfg : NULL, heapFatal);
+    if (portCount > 0)
+        port = ports[0];
+
+    if (rotInit(&rot, dir) == 0)
+        exit(0);
+    binlogInit(&bin);
+
+    // One slot per sweep for every metric, allocated once up front.
+    // When running live it's mapped from the checkpoint file, so the
+    // samples survive a restart. A replay starts from nothing.
+    if (keepHours < 1)
+        keepHours = 1;
+    if (sampleSecs < 1)
+        sampleSecs = 1;
+    capacity = keepHours * 3600 / sampleSecs;
+    ckpt.fd = -1;
+    if (capture == NULL)
+        ckptOpen(&ckpt, rot.rootFd, storeFootprint(capacity, CMD_COUNT));
+
+    // Size the arena for everything the one port and inverter need: the
+    // CSV row, the web page, the capture ring, the query server, the
+    // export and the samples if they aren't in the checkpoint.
+    arenaSize = ARENA_ROUND(sizeof(csvRow_t)) + ARENA_ROUND(HTML_MAX);
+    if (ckpt.fd < 0)
+        arenaSize += ARENA_ROUND(storeFootprint(capacity, CMD_COUNT));
+    if (record && (capture == NULL))
+        arenaSize += ARENA_ROUND(CAPTURE_RING_SIZE);
+    if (httpPort > 0)
+        arenaSize += ARENA_ROUND(httpFootprint());
+    if (influxTarget != NULL)
+        arenaSize += ARENA_ROUND(influxFootprint());
+    if (arenaInit(arenaSize) == 0)
+        exit(0);
+    row  = arenaAlloc(sizeof(csvRow_t));
+    html = arenaAlloc(HTML_MAX);
+    if (record && (capture == NULL))
+        ring = arenaAlloc(CAPTURE_RING_SIZE);
+
+    storeMem = (ckpt.fd >= 0) ? ckpt.store :
+               arenaAlloc(storeFootprint(capacity, CMD_COUNT));
+    if (ckpt.fd >= 0)
+        arenaCount(ckpt.size);
+    if (storeMem == NULL)
+    {
+        printf("Can't allocate %d hours of samples\n", keepHours);
+        exit(0);
+    }
+    storeAttach(&store, storeMem, capacity, CMD_COUNT);
+
+    if (httpPort > 0)
+    {
+        httpCfg.port   = httpPort;
+        httpCfg.addr   = httpAddr;
+        httpCfg.rootFd = rot.rootFd;
+        httpCfg.store  = &store;
+        httpCfg.lock   = &storeLock;
+        httpCfg.header = csvHeader;
+        if (httpStart(&httpCfg, arenaAlloc(httpFootprint())) == 0)
+            exit(0);
+    }
+
+    if (influxTarget != NULL)
+    {
+        influxCfg.rootFd = rot.rootFd;
+        if (influxStart(&influxCfg, arenaAlloc(influxFootprint())) == 0)
+            exit(0);
+    }
+
+    // Carry on with today's chart and totals if the last run was today
+    if (ckpt.fd >= 0)
+    {
+        getTime(&t);
+        rotLocalTime(&rot, t.tv_sec, ltime);
+        if (ckpt.hdr->dayKey == (ltime->tm_year+1900) * 10000 + (ltime->tm_mon+1) * 100 +
+                                ltime->tm_mday)
+        {
+            firstPower       = ckpt.hdr->firstPower;
+            startTime.tv_sec = ckpt.hdr->startTime;
+            energyNow        = ckpt.hdr->energyNow;
+            energyDay        = ckpt.hdr->energyDay;
+            printf("Restored today's state, %d samples in memory\n", storeCount(&store));
+        }
+    }
+
+    nightInit(&night, sampleSecs);
+    if (haveSite)
+        nightSetSite(&night, lat, lon);
+
+    if (reconcileMins > 0)
+        deriveInit(&derive, rot.rootFd, reconcileMins);
+
+    if (capture != NULL)
+    {
+        // Run the capture through the parser and the main loop as fast
+        // as we can instead of talking to the serial port.
+        if (replayOpen(&replaySrc, capture) == 0)
+            exit(0);
+        replaying = 1;
+        frInit(&ctx, -1);
+        frSetIo(&ctx, &replayIo);
+        clock_gettime(CLOCK_MONOTONIC, &replayStart);
+    }
+    else
+    {
+        // Open the serial port, or connect to the converter
+        if (frParseEndpoint(port, &ep) != FR_OK)
+        {
+            printf("Can't use port %s\n", port);
+            exit(0);
+        }
+        fd = frOpenEndpoint(&ep, (baud != 0) ? baud : FR_BAUD_DEFAULT);
+        if (fd < 0)
+        {
+            printf("open(%s) failed: %s\n", port, strerror(errno));
+            exit(0);
+        }
+        frInit(&ctx, fd);
+
+        // Wire time is most of a sweep, so run the line as fast as the
+        // interface card and the cabling allow. A converter's line rate
+        // is its own business.
+        if (ctx.transport != FR_TRANSPORT_TTY)
+        {
+            printf("Connecting to %s\n", port);
+        }
+        else
+        {
+            if (baud == 0)
+            {
+                r = frNegotiateBaud(&ctx, 0);
+                if (r < 0)
+                    printf("No line rate worked (%s), using %d\n", frStrError(r), ctx.baud);
+            }
+            printf("Line rate: %d baud\n", ctx.baud);
+        }
+
+        if (record)
+        {
+            if (captureStart(dir, ring, CAPTURE_RING_SIZE) == 0)
+                exit(0);
+            frSetFrameHook(&ctx, captureHook, NULL);
+        }
     }
 
-    // Open the serial port
-    fd = initPort(port);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    getTime(&t);
 
-    gettimeofday(&t, NULL);
+    // Startup is over, the sweeps run in what has been set aside
+#ifdef FRONIUS_SMALL
+    arenaReport("at startup");
+#endif
+    arenaSeal(heapFatal);
 
     for ( ; ; )
     {
-        getVersion(fd, &major, &minor, &release);
-        
-        r = getActiveInverter(fd, &active);
-        if (r == 0)
+        if (quit || (replaying && replaySrc.done))
+            break;
+
+        // Slow down if the line has become unreliable. Renegotiating
+        // isn't recorded, a capture only holds sweeps.
+        if (!replaying && (baud == 0) && (ctx.transport == FR_TRANSPORT_TTY))
         {
-            if (f != NULL)
+            frSetFrameHook(&ctx, NULL, NULL);
+            r = frCheckBaud(&ctx);
+            if (r > 0)
+                printf("Checksum errors, line rate now %d baud\n", r);
+            else if (r < 0)
+                printf("Checksum errors, no line rate worked: %s\n", frStrError(r));
+            if (record)
+                frSetFrameHook(&ctx, captureHook, NULL);
+        }
+
+        // While the inverter is off there's just one probe now and then
+        // instead of the whole handshake every sweep.
+        if (night.dormant)
+        {
+            sleepUntil(night.nextProbe);
+            if (quit)
+                break;
+
+            r = frGetActiveInverter(&ctx, &active);
+            getTime(&timestamp);
+            if ((r != FR_OK) || (active == 0))
             {
-                fclose(f);
-                f = NULL;
+                if ((r == FR_EIO) && !replaying)
+                    reconnect(&ctx, &ep);
+                nightFailed(&night, timestamp.tv_sec);
+                continue;
             }
 
-            delay(&t);
-            continue;
+            // Back to sweeping at the full rate straight away. The probe
+            // stands in for this sweep's handshake.
+            printf("Inverter %d is awake\n", active);
+            nightAwake(&night);
+            t = timestamp;
+
+            // The version goes in the header of the day's first file, and
+            // it was never read if the night started before this did
+            r = frGetVersion(&ctx, &major, &minor, &release);
+            if (r != FR_OK)
+                printf("get version failed: %s\n", frStrError(r));
+        }
+        else
+        {
+            r = frGetVersion(&ctx, &major, &minor, &release);
+            if (r != FR_OK)
+                printf("get version failed: %s\n", frStrError(r));
+            if ((r == FR_EIO) && !replaying)
+                reconnect(&ctx, &ep);
+
+            r = frGetActiveInverter(&ctx, &active);
+            if (r != FR_OK)
+                printf("get active inverter failed: %s\n", frStrError(r));
+            if ((r != FR_OK) || (active == 0))
+            {
+                getTime(&timestamp);
+                if (nightFailed(&night, timestamp.tv_sec))
+                    printf("Inverter is off, going dormant\n");
+                else
+                    delay(&t);
+                continue;
+            }
+            nightAwake(&night);
         }
         
-        r = getDeviceType(fd, active, &typeId);
-        if (r != 1)
-            printf("Couldn't get device type\n");
+        r = frGetDeviceType(&ctx, active, &typeId);
+        if (r != FR_OK)
+        {
+            printf("Couldn't get device type: %s\n", frStrError(r));
+            typeId = 0xFF;
+        }
+
+        getTime(&timestamp);
+
+        // Switch to a new day directory and data file only when local
+        // midnight has passed.
+        r = rotCheck(&rot, timestamp.tv_sec);
+        if ((r != 0) && (csvFd >= 0))
+        {
+            if (unsyncedRows != 0)
+                fdatasync(csvFd);
+            unsyncedRows = 0;
+            close(csvFd);
+            csvFd = -1;
+        }
+        if ((r != 0) && binary)
+            binlogClose(&bin);
+        if (binary && (bin.fd < 0) && (binlogOpen(&bin, &rot) == 0))
+            exit(0);
 
-        if (f == NULL)
+        if (csvFd < 0)
         {
-            f = openFile(dir, &newFile);
-            if (f == NULL)
+            csvFd = openFile(&rot, &newFile);
+            if (csvFd < 0)
             {
                 printf("No file\n");
                 exit(0);
@@ -956,98 +1475,128 @@ int main(int argc, char *argv[])
             if (newFile != 0)
             {
                 firstPower   = 0;
-                wattsCount   = 0;
-                watts15Count = 0;
+                startTime.tv_sec = 0;
                 energyDay    = 0;
-                fprintf(f, "Software version: %d.%d.%d\n", major, minor, release);
-                fprintf(f, "Inverter model: %s\n", typeIdToStr(typeId));
-                fprintf(f,
-                        "TIMESTAMP             ,"
-                        "POWER_NOW             ,"
-                        "ENERGY_TOTAL          ,"
-                        "ENERGY_DAY            ,"
-                        "ENERGY_YEAR           ,"
-                        "AC_CURRENT_NOW        ,"
-                        "AC_VOLTAGE_NOW        ,"
-                        "AC_FREQUENCY_NOW      ,"
-                        "DC_CURRENT_NOW        ,"
-                        "DC_VOLTAGE_NOW        ,"
-                        "YIELD_DAY             ,"
-                        "MAX_POWER_DAY         ,"
-                        "MAX_AC_VOLTAGE_DAY    ,"
-                        "MIN_AC_VOLTAGE_DAY    ,"
-                        "MAX_DC_VOLTAGE_DAY    ,"
-                        "OPERATING_HOURS_DAY   ,"
-                        "YIELD_YEAR            ,"
-                        "MAX_POWER_YEAR        ,"
-                        "MAX_AC_VOLTAGE_YEAR   ,"
-                        "MIN_AC_VOLTAGE_YEAR   ,"
-                        "MAX_DC_VOLTAGE_YEAR   ,"
-                        "OPERATING_HOURS_YEAR  ,"
-                        "YIELD_TOTAL           ,"
-                        "MAX_POWER_TOTAL       ,"
-                        "MAX_AC_VOLTAGE_TOTAL  ,"
-                        "MIN_AC_VOLTAGE_TOTAL  ,"
-                        "MAX_DC_VOLTAGE_TOTAL  ,"
-                        "OPERATING_HOURS_TOTAL ,"
-                        "PHASE_1_CURRENT       ,"
-                        "PHASE_2_CURRENT       ,"
-                        "PHASE_3_CURRENT       ,"
-                        "PHASE_1_VOLTAGE       ,"
-                        "PHASE_2_VOLTAGE       ,"
-                        "PHASE_3_VOLTAGE       ,"
-                        "AMBIENT_TEMPERATURE   ,"
-                        "FRONT_LEFT_FAN_SPEED  ,"
-                        "FRONT_RIGHT_FAN_SPEED ,"
-                        "REAR_LEFT_FAN_SPEED   ,"
-                        "REAR_RIGHT_FAN_SPEED\n");
+                csvBegin(row);
+                csvText(row, "Software version: %d.%d.%d\n", major, minor, release);
+                csvText(row, "Inverter model: %s\n", frTypeIdToStr(typeId));
+                csvText(row, "%s", csvHeader);
+                csvText(row, "%s%s\n", tagRetries ? ",RETRIED" : "",
+                        tagOffsets ? ",OFFSETS_MS" : "");
+                if (csvWrite(row, csvFd) == 0)
+                    printf("Failed to write data.csv: %s\n", strerror(errno));
+            }
+
+            // Every file starts with a full row, and says what the empty
+            // fields after it mean. data.bin is opened at the same time.
+            if (bands != NULL)
+            {
+                bandReset(&band);
+                csvBegin(row);
+                csvText(row, "%s\n", BAND_CSV_MARKER);
+                if (csvWrite(row, csvFd) == 0)
+                    printf("Failed to write data.csv: %s\n", strerror(errno));
             }
         }
 
-        gettimeofday(&timestamp, NULL);
-        ltime = localtime(&timestamp.tv_sec);
-        fprintf(f, "%d-%02d-%02d %02d:%02d:%02d,", ltime->tm_year+1900, ltime->tm_mon+1,
-                ltime->tm_mday, ltime->tm_hour, ltime->tm_min, ltime->tm_sec);
-        energyNow = 0;
+        rotLocalTime(&rot, timestamp.tv_sec, ltime);
+        nowMs = (int64_t)timestamp.tv_sec * 1000 + timestamp.tv_usec / 1000;
+        reconcile = (reconcileMins > 0) && deriveReconcileDue(&derive, nowMs);
 
-        // Try every command on the inverter and save the result in a CSV file.
+        // Try every command on the inverter. Counters we can work out
+        // ourselves are skipped unless it's time to check them.
+        retryCount = 0;
+        retried = 0;
+        derived = 0;
         for (j=0; j<CMD_COUNT; j++)
         {
-            r = getNumeric(fd, active, cmds[j], &fval);
-            if (r != 0)
+            values[j] = NAN;
+            polled[j] = 0;
+            if ((reconcileMins > 0) && !reconcile && deriveGet(&derive, cmds[j], &fval))
+                continue;
+
+            polled[j] = 1;
+            r = frGetNumericAt(&ctx, active, cmds[j], &fval, &stamps[j]);
+            if (r == FR_OK)
+            {
+                values[j] = fval;
+
+                // The chart starts at the first reading of the day
+                if ((cmds[j] == GET_POWER_NOW) && (firstPower == 0))
+                {
+                    firstPower = 1;
+                    getTime(&startTime);
+                }
+            }
+            else
+            {
+                retryQueue[retryCount++] = j;
+            }
+        }
+
+        // A timeout on a noisy line is usually a one off, so try the
+        // failures again rather than leave a gap until the next sweep.
+        // Stop in time for the next sweep to start on schedule.
+        if ((retryCount > 0) && (retryBudgetMs > 0))
+        {
+            budget.tv_sec  = retryBudgetMs / 1000;
+            budget.tv_usec = (retryBudgetMs % 1000) * 1000;
+            timeradd(&timestamp, &budget, &until);
+            if (timercmp(&t, &timestamp, >) && timercmp(&t, &until, <))
+                until = t;
+            retryFailed(&ctx, active, retryQueue, retryCount, &until, values, stamps,
+                        &retried);
+        }
+
+        if (reconcileMins > 0)
+        {
+            inputs.power     = values[metricOf(GET_POWER_NOW)];
+            inputs.acVoltage = values[metricOf(GET_AC_VOLTAGE_NOW)];
+            inputs.dcVoltage = values[metricOf(GET_DC_VOLTAGE_NOW)];
+            deriveUpdate(&derive, nowMs, ltime, &inputs);
+            getStamp(&derivedAt);
+
+            // Whatever was read from the inverter wins
+            for (j=0; j<CMD_COUNT; j++)
             {
-                // None of the data seems to have more than 1/100 precision
-                fprintf(f, "%g,", fval);
+                if (!deriveIsDerived(cmds[j]))
+                    continue;
+                if (polled[j] && !isnan(values[j]))
+                    deriveSetRegister(&derive, cmds[j], values[j]);
+                else if (deriveGet(&derive, cmds[j], &fval))
+                {
+                    values[j] = fval;
+                    stamps[j] = derivedAt;
+                    derived |= 1ULL << j;
+                }
+            }
+
+            if (reconcile)
+                deriveReconciled(&derive, nowMs);
+        }
 
-                // Everything gets put in the CSV file. This lets us intercept some
-                // parameters to put in the HTML file.
+        // With -C only what has moved goes to the files. The chart and
+        // queries still get every sweep from the store.
+        changed = (bands != NULL) ? bandCheck(&band, values, timestamp.tv_sec) : ~0ULL;
+
+        csvBegin(row);
+        csvTimestamp(row, ltime);
+        energyNow = 0;
+
+        // Save the result in a CSV file.
+        addValues(row, values, changed, bands != NULL);
+
+        // Everything gets put in the CSV file. This lets us intercept some
+        // parameters to put in the HTML file.
+        for (j=0; j<CMD_COUNT; j++)
+        {
+            fval = values[j];
+            if (!isnan(fval))
+            {
                 switch (cmds[j])
                 {
                     case GET_POWER_NOW:
                     {
-                        if (firstPower == 0)
-                        {
-                            firstPower = 1;
-                            gettimeofday(&startTime, NULL);
-                        }
-                        
-                        // Store the current power output in a circular buffer.
-                        watts[wattsCount] = fval;
-                        wattsCount = (wattsCount + 1) % 15;
-
-                        // Every 15 minutes, take the average and store it. This
-                        // will be used to make the graph on the HTML page.
-                        if ((ltime->tm_min % 15) == 0)
-                        {
-                            int wattsAvg = 0;
-                            for (k=0; k<15; k++)
-                            {
-                                wattsAvg += watts[k];
-                            }
-                            wattsAvg /= 15;
-                            
-                            watts15[watts15Count++] = wattsAvg;
-                        }
                         energyNow = fval;
                     }
                     break;
@@ -1065,19 +1614,121 @@ int main(int argc, char *argv[])
                     break;
                 }
             }
-            else
+        }
+        if (tagRetries)
+            csvMask(row, retried);
+        if (tagOffsets)
+        {
+            for (j=0; j<CMD_COUNT; j++)
+            {
+                offsets[j] = -1;
+                if (isnan(values[j]))
+                    continue;
+                offsets[j] = (stamps[j].real.tv_sec - timestamp.tv_sec) * 1000 +
+                             (stamps[j].real.tv_nsec / 1000 - timestamp.tv_usec) / 1000;
+                if (offsets[j] < 0)
+                    offsets[j] = 0;
+            }
+            csvOffsets(row, offsets, CMD_COUNT);
+        }
+        csvEnd(row);
+
+        // Every reading with the time it actually came in
+        if (binary && (changed != 0))
+        {
+            getStamp(&sweepAt);
+            for (j=0; j<CMD_COUNT; j++)
             {
-                fprintf(f, ",");
+                if (!(changed & (1ULL << j)))
+                    continue;
+                if (isnan(values[j]))
+                {
+                    if (bands != NULL)
+                        binlogAdd(&bin, active, cmds[j], BINLOG_FLAG_MISSING, NAN, &sweepAt);
+                    continue;
+                }
+                flags = 0;
+                if (retried & (1ULL << j))
+                    flags |= BINLOG_FLAG_RETRIED;
+                if (derived & (1ULL << j))
+                    flags |= BINLOG_FLAG_DERIVED;
+                binlogAdd(&bin, active, cmds[j], flags, values[j], &stamps[j]);
             }
+            if (binlogFlush(&bin) == 0)
+                printf("Failed to write %s: %s\n", BINLOG_FILENAME, strerror(errno));
+        }
+
+        // Keep the sweep in memory for the web page and queries
+        pthread_mutex_lock(&storeLock);
+        storeAppend(&store, nowMs, values);
+        pthread_mutex_unlock(&storeLock);
+
+        // A sweep with nothing changed isn't written at all
+        if ((changed != 0) && (csvWrite(row, csvFd) == 0))
+            printf("Failed to write data.csv: %s\n", strerror(errno));
+        if ((changed != 0) && (influxTarget != NULL))
+            influxSweep(NULL, active, values, stamps, changed);
+
+        // Batch the syncs, an SD card doesn't like one per row
+        if ((changed != 0) && (syncRows > 0) && (++unsyncedRows >= syncRows))
+        {
+            fdatasync(csvFd);
+            unsyncedRows = 0;
         }
-        fprintf(f, "\n");
-        fflush(f);
 
         // Update the current web page
-        updateHtml(dir, watts15, watts15Count, energyNow, energyDay, startTime.tv_sec);
+        updateHtml(&rot, ltime, &store, energyNow, energyDay, startTime.tv_sec);
+
+        // The samples are already in the checkpoint, the rest goes with them
+        if (ckpt.fd >= 0)
+        {
+            ckpt.hdr->dayKey     = (ltime->tm_year+1900) * 10000 + (ltime->tm_mon+1) * 100 +
+                                   ltime->tm_mday;
+            ckpt.hdr->firstPower = firstPower;
+            ckpt.hdr->startTime  = startTime.tv_sec;
+            ckpt.hdr->energyNow  = energyNow;
+            ckpt.hdr->energyDay  = energyDay;
+            if (timestamp.tv_sec >= nextCkptSync)
+            {
+                ckptSync(&ckpt);
+                nextCkptSync = timestamp.tv_sec + CKPT_SYNC_SECS;
+            }
+        }
         
         delay(&t);
     }
+
+    if (csvFd >= 0)
+    {
+        if (unsyncedRows != 0)
+            fdatasync(csvFd);
+        close(csvFd);
+    }
+    binlogClose(&bin);
+    if (influxTarget != NULL)
+        influxStop();
+    ckptClose(&ckpt);
+    if (reconcileMins > 0)
+        deriveSave(&derive);
+    rotClose(&rot);
+
+#ifdef FRONIUS_SMALL
+    arenaReport("at exit");
+#endif
+
+    if (replaying)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &replayEnd);
+        replaySecs = (replayEnd.tv_sec - replayStart.tv_sec) +
+                     (replayEnd.tv_nsec - replayStart.tv_nsec) / 1e9;
+        printf("Replayed %lu records (%lu bytes received, %lu requests not in "
+               "the capture, %lu skipped) in %.3f s", replaySrc.records,
+               replaySrc.rxBytes, replaySrc.unmatched, replaySrc.skipped, replaySecs);
+        if (replaySecs > 0)
+            printf(", %.0f records/s", replaySrc.records / replaySecs);
+        printf("\n");
+        replayClose(&replaySrc);
+    }
     
     return 0;
 }
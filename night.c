@@ -0,0 +1,241 @@
+/*********************************************************************
+ *** FILE: night.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// Dormant state for when the inverter has shut down for the night.
+// Rather than run the full handshake every sweep, one cheap probe is
+// sent with the time between probes doubling up to a limit. Given the
+// site's location the probes are packed in around sunrise so logging
+// picks up again within seconds of the inverter waking.
+
+/* SYSTEM INCLUDE FILES */
+#include <string.h>
+#include <math.h>
+
+/* INCLUDE FILES */
+#include "night.h"
+
+/* DEFINES */
+#define DEG     (M_PI / 180.0)
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: nightInit
+ ***
+ *** DESCRIPTION:
+ ***   Start out awake. minSecs is the normal time between sweeps, the
+ ***   first backoff once dormant.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void nightInit(night_t *n, int minSecs)
+{
+    memset(n, 0, sizeof(*n));
+    n->minSecs = (minSecs > 0) ? minSecs : 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: nightSetSite
+ ***
+ *** DESCRIPTION:
+ ***   Set the location of the site so probes can be timed for sunrise.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void nightSetSite(night_t *n, double lat, double lon)
+{
+    n->haveSite = 1;
+    n->lat = lat;
+    n->lon = lon;
+}
+
+/*********************************************************************
+ *** FUNCTION: sunriseOn
+ ***
+ *** DESCRIPTION:
+ ***   Work out sunrise on a UTC day with the NOAA approximation, good
+ ***   to a minute or two.
+ ***
+ *** RETURN VALUE:
+ ***   Time of sunrise, 0 if the sun doesn't rise or set that day.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static time_t sunriseOn(double lat, double lon, time_t midnight, int yday)
+{
+    double g = 2 * M_PI / 365 * yday;
+    double eqTime, decl, cosHa, ha;
+
+    eqTime = 229.18 * (0.000075 + 0.001868 * cos(g) - 0.032077 * sin(g) -
+                       0.014615 * cos(2 * g) - 0.040849 * sin(2 * g));
+    decl = 0.006918 - 0.399912 * cos(g) + 0.070257 * sin(g) -
+           0.006758 * cos(2 * g) + 0.000907 * sin(2 * g) -
+           0.002697 * cos(3 * g) + 0.00148 * sin(3 * g);
+
+    // 90.833 degrees allows for refraction and the size of the sun
+    cosHa = cos(90.833 * DEG) / (cos(lat * DEG) * cos(decl)) -
+            tan(lat * DEG) * tan(decl);
+    if ((cosHa < -1) || (cosHa > 1))
+        return 0;
+    ha = acos(cosHa) / DEG;
+
+    return midnight + (time_t)((720 - 4 * (lon + ha) - eqTime) * 60);
+}
+
+/*********************************************************************
+ *** FUNCTION: nightSunrise
+ ***
+ *** DESCRIPTION:
+ ***   Find the next sunrise, counting one that was less than
+ ***   NIGHT_DAWN_LAG_SECS ago.
+ ***
+ *** RETURN VALUE:
+ ***   Time of sunrise, 0 if there's none in the next two days (polar
+ ***   day or night).
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+time_t nightSunrise(double lat, double lon, time_t now)
+{
+    struct tm utc;
+    time_t midnight;
+    time_t rise;
+    int day;
+
+    for (day=0; day<3; day++)
+    {
+        midnight = now - (now % 86400) + day * 86400;
+        gmtime_r(&midnight, &utc);
+        rise = sunriseOn(lat, lon, midnight, utc.tm_yday);
+        if ((rise != 0) && (rise + NIGHT_DAWN_LAG_SECS > now))
+            return rise;
+    }
+
+    return 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: schedule
+ ***
+ *** DESCRIPTION:
+ ***   Work out when to probe next, never later than the start of the
+ ***   dawn window and every NIGHT_DAWN_PROBE_SECS inside it.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void schedule(night_t *n, time_t now)
+{
+    time_t rise;
+    time_t dawn;
+
+    n->nextProbe = now + n->backoffSecs;
+    if (!n->haveSite)
+        return;
+
+    rise = nightSunrise(n->lat, n->lon, now);
+    if (rise == 0)
+        return;
+
+    dawn = rise - NIGHT_DAWN_LEAD_SECS;
+    if (now >= dawn)
+        n->nextProbe = now + NIGHT_DAWN_PROBE_SECS;
+    else if (n->nextProbe > dawn)
+        n->nextProbe = dawn;
+}
+
+/*********************************************************************
+ *** FUNCTION: nightFailed
+ ***
+ *** DESCRIPTION:
+ ***   Note that the inverter didn't answer, either the handshake while
+ ***   awake or a probe while dormant. Enough failures in a row and we
+ ***   go dormant; every failure after that doubles the backoff.
+ ***
+ *** RETURN VALUE:
+ ***   1 if this made us dormant, 0 otherwise.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int nightFailed(night_t *n, time_t now)
+{
+    if (n->dormant)
+    {
+        n->backoffSecs *= 2;
+        if (n->backoffSecs > NIGHT_MAX_BACKOFF_SECS)
+            n->backoffSecs = NIGHT_MAX_BACKOFF_SECS;
+        schedule(n, now);
+        return 0;
+    }
+
+    if (++n->fails < NIGHT_FAILS)
+        return 0;
+
+    n->dormant = 1;
+    n->backoffSecs = n->minSecs;
+    schedule(n, now);
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: nightAwake
+ ***
+ *** DESCRIPTION:
+ ***   Note that the inverter answered.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void nightAwake(night_t *n)
+{
+    n->dormant = 0;
+    n->fails = 0;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,66 @@
+/*********************************************************************
+ *** FILE: night.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+#ifndef NIGHT_H
+#define NIGHT_H
+
+/* SYSTEM INCLUDE FILES */
+#include <time.h>
+
+/* DEFINES */
+
+// Failed handshakes in a row before we decide the inverter is off
+#define NIGHT_FAILS             3
+
+// Longest time between probes while dormant, in seconds
+#define NIGHT_MAX_BACKOFF_SECS  (30 * 60)
+
+// With a location set, probing speeds up from this long before sunrise
+// until this long after it, in seconds
+#define NIGHT_DAWN_LEAD_SECS    (30 * 60)
+#define NIGHT_DAWN_LAG_SECS     (90 * 60)
+
+// Time between probes around sunrise, in seconds
+#define NIGHT_DAWN_PROBE_SECS   10
+
+/* TYPEDEFS */
+
+// Whether the inverter is asleep and when to look for it next
+typedef struct
+{
+    int     dormant;        // Set while the inverter is off
+    int     fails;          // Handshakes failed in a row
+    int     minSecs;        // First backoff, the normal sweep interval
+    int     backoffSecs;    // Current backoff
+    time_t  nextProbe;      // When to probe next while dormant
+    int     haveSite;       // Set if lat and lon are known
+    double  lat;            // Degrees, north positive
+    double  lon;            // Degrees, east positive
+} night_t;
+
+/* FUNCTION PROTOTYPES */
+void   nightInit(night_t *n, int minSecs);
+void   nightSetSite(night_t *n, double lat, double lon);
+int    nightFailed(night_t *n, time_t now);
+void   nightAwake(night_t *n);
+time_t nightSunrise(double lat, double lon, time_t now);
+
+#endif // NIGHT_H
@@ -0,0 +1,307 @@
+/*********************************************************************
+ *** FILE: rotate.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* INCLUDE FILES */
+#include "rotate.h"
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: tzChanged
+ ***
+ *** DESCRIPTION:
+ ***   See whether the zone file has been replaced since it was last
+ ***   looked at. tzset() allocates every time it's called without TZ
+ ***   set, so it's only called when there's something to pick up.
+ ***
+ *** RETURN VALUE:
+ ***   1 if it has changed, 0 if not.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int tzChanged(rotator_t *rot)
+{
+    struct stat statbuf;
+
+    if (stat(ROT_TZ_FILE, &statbuf) != 0)
+        return 0;
+    if ((statbuf.st_mtime == rot->tzMtime) && (statbuf.st_ino == rot->tzIno))
+        return 0;
+
+    rot->tzMtime = statbuf.st_mtime;
+    rot->tzIno   = statbuf.st_ino;
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: rotInit
+ ***
+ *** DESCRIPTION:
+ ***   Open the root directory the day directories go under. No day
+ ***   directory is open until the first rotCheck().
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 for failure.
+ ***
+ *** SIDE EFFECTS:
+ ***   Creates the root directory if it doesn't exist.
+ *********************************************************************/
+int rotInit(rotator_t *rot, const char *root)
+{
+    memset(rot, 0, sizeof(*rot));
+    rot->dirFd = -1;
+    snprintf(rot->root, sizeof(rot->root), "%s", root);
+
+    mkdir(root, 0755);
+    rot->rootFd = open(root, O_RDONLY | O_DIRECTORY);
+    if (rot->rootFd < 0)
+    {
+        printf("open(%s) failed: %s\n", root, strerror(errno));
+        return 0;
+    }
+
+    // Load the timezone now rather than in the middle of a sweep
+    tzChanged(rot);
+    tzset();
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: midnight
+ ***
+ *** DESCRIPTION:
+ ***   Work out local midnight at the start of the day t falls in. Steps
+ ***   back by the time of day, then again if the UTC offset changed in
+ ***   between. Where midnight is skipped, the first time of the day.
+ ***   Done with localtime_r() rather than mktime(), which calls tzset()
+ ***   and so allocates every time without TZ set.
+ ***
+ *** RETURN VALUE:
+ ***   The time of midnight.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static time_t midnight(time_t t)
+{
+    struct tm day, tmTime;
+    int secs;
+    int i;
+
+    localtime_r(&t, &day);
+    for (i=0; i<3; i++)
+    {
+        localtime_r(&t, &tmTime);
+        secs = tmTime.tm_hour * 3600 + tmTime.tm_min * 60 + tmTime.tm_sec;
+
+        // Stepped back into the day before, so this day's clocks went
+        // forward at midnight. It starts at the end of that day.
+        if (tmTime.tm_mday != day.tm_mday)
+            return t + 24 * 3600 - secs;
+        if (secs == 0)
+            break;
+        t -= secs;
+    }
+
+    return t;
+}
+
+/*********************************************************************
+ *** FUNCTION: rotCheck
+ ***
+ *** DESCRIPTION:
+ ***   Make sure the open day directory is the one for time now. Costs
+ ***   two compares unless the day is over, the clock went backwards
+ ***   or it's time to reload the timezone.
+ ***
+ *** RETURN VALUE:
+ ***   1 if a different day directory was opened, 0 if the current one
+ ***   is still good, -1 if the new directory couldn't be opened.
+ ***
+ *** SIDE EFFECTS:
+ ***   Creates the day directories as needed.
+ *********************************************************************/
+int rotCheck(rotator_t *rot, time_t now)
+{
+    struct tm tmTime;
+    char path[32];
+    int fd;
+
+    if ((rot->dirFd >= 0) && (now >= rot->dayStart) && (now < rot->dayEnd) &&
+        (now < rot->nextTzCheck))
+    {
+        return 0;
+    }
+
+    // Pick up a changed /etc/localtime. The day bounds are worked out
+    // again below in case the offset moved.
+    if (now >= rot->nextTzCheck)
+    {
+        if (tzChanged(rot))
+            tzset();
+        rot->nextTzCheck = now + ROT_TZ_CHECK_SECS;
+    }
+
+    localtime_r(&now, &tmTime);
+    rot->dayStart = midnight(now);
+    rot->dayEnd   = midnight(rot->dayStart + 36 * 3600);
+
+    if ((rot->dirFd >= 0) && (rot->year == tmTime.tm_year+1900) &&
+        (rot->mon == tmTime.tm_mon+1) && (rot->mday == tmTime.tm_mday))
+    {
+        return 0;
+    }
+
+    // New day. File path is "<dir>/Year/Month/Day/file", for example
+    // /tmp/2009/03/23/data.csv
+    snprintf(path, sizeof(path), "%04d", tmTime.tm_year+1900);
+    mkdirat(rot->rootFd, path, 0755);
+    snprintf(path, sizeof(path), "%04d/%02d", tmTime.tm_year+1900, tmTime.tm_mon+1);
+    mkdirat(rot->rootFd, path, 0755);
+    snprintf(path, sizeof(path), "%04d/%02d/%02d", tmTime.tm_year+1900, tmTime.tm_mon+1,
+             tmTime.tm_mday);
+    mkdirat(rot->rootFd, path, 0755);
+
+    fd = openat(rot->rootFd, path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        printf("open(%s/%s) failed: %s\n", rot->root, path, strerror(errno));
+
+        // Try again next time round
+        rot->nextTzCheck = now;
+        return -1;
+    }
+
+    if (rot->dirFd >= 0)
+        close(rot->dirFd);
+
+    rot->dirFd = fd;
+    rot->year  = tmTime.tm_year+1900;
+    rot->mon   = tmTime.tm_mon+1;
+    rot->mday  = tmTime.tm_mday;
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: rotOpen
+ ***
+ *** DESCRIPTION:
+ ***   Open a file in the current day directory.
+ ***
+ *** RETURN VALUE:
+ ***   The fd, or -1 with errno set.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int rotOpen(const rotator_t *rot, const char *name, int flags, mode_t mode)
+{
+    if (rot->dirFd < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return openat(rot->dirFd, name, flags | O_CLOEXEC, mode);
+}
+
+/*********************************************************************
+ *** FUNCTION: rotRename
+ ***
+ *** DESCRIPTION:
+ ***   Rename a file in the current day directory.
+ ***
+ *** RETURN VALUE:
+ ***   0 for success, -1 with errno set.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int rotRename(const rotator_t *rot, const char *from, const char *to)
+{
+    return renameat(rot->dirFd, from, rot->dirFd, to);
+}
+
+/*********************************************************************
+ *** FUNCTION: rotLocalTime
+ ***
+ *** DESCRIPTION:
+ ***   Convert a time to local time without the stat() of the zone
+ ***   file that localtime() does on every call. Zone changes are
+ ***   picked up by rotCheck().
+ ***
+ *** RETURN VALUE:
+ ***   Local time is returned in tmTime.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void rotLocalTime(const rotator_t *rot, time_t t, struct tm *tmTime)
+{
+    localtime_r(&t, tmTime);
+}
+
+/*********************************************************************
+ *** FUNCTION: rotClose
+ ***
+ *** DESCRIPTION:
+ ***   Close the directories.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void rotClose(rotator_t *rot)
+{
+    if (rot->dirFd >= 0)
+        close(rot->dirFd);
+    if (rot->rootFd >= 0)
+        close(rot->rootFd);
+
+    rot->dirFd = -1;
+    rot->rootFd = -1;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,65 @@
+/*********************************************************************
+ *** FILE: rotate.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef ROTATE_H
+#define ROTATE_H
+
+/* SYSTEM INCLUDE FILES */
+#include <sys/types.h>
+#include <time.h>
+
+/* DEFINES */
+
+// How often the timezone is checked for changes, in seconds
+#define ROT_TZ_CHECK_SECS   3600
+
+// The zone file used when TZ isn't set
+#define ROT_TZ_FILE         "/etc/localtime"
+
+/* TYPEDEFS */
+
+// Keeps the "<root>/Year/Month/Day" directory for the current local
+// day open, so files in it can be opened with openat(). Checking for
+// the end of the day is a compare against a precomputed time, the
+// calendar is only worked out again when the day is over.
+typedef struct
+{
+    char    root[200];
+    int     rootFd;         // The root directory
+    int     dirFd;          // The current day directory, -1 if none
+    int     year;           // Day the directory is for
+    int     mon;
+    int     mday;
+    time_t  dayStart;       // Local midnight at the start of the day
+    time_t  dayEnd;         // Local midnight at the end of the day
+    time_t  nextTzCheck;    // When to check the timezone
+    time_t  tzMtime;        // ROT_TZ_FILE as it was when last loaded
+    ino_t   tzIno;
+} rotator_t;
+
+/* FUNCTION PROTOTYPES */
+int  rotInit(rotator_t *rot, const char *root);
+int  rotCheck(rotator_t *rot, time_t now);
+int  rotOpen(const rotator_t *rot, const char *name, int flags, mode_t mode);
+int  rotRename(const rotator_t *rot, const char *from, const char *to);
+void rotLocalTime(const rotator_t *rot, time_t t, struct tm *tmTime);
+void rotClose(rotator_t *rot);
+
+#endif // ROTATE_H
@@ -0,0 +1,401 @@
+/*********************************************************************
+ *** FILE: sites.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+
+// Sweeps many endpoints at once from one thread, for collecting from a
+// lot of sites behind serial to Ethernet converters. Each endpoint has
+// its own protocol context with the whole sweep queued on it; one
+// poll() waits on all of them, and whichever has a reply in gets its
+// next request sent. A sweep takes about as long as the slowest site
+// rather than the sum of them all.
+
+/* SYSTEM INCLUDE FILES */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+
+/* INCLUDE FILES */
+#include "sites.h"
+#include "arena.h"
+
+/* DEFINES */
+
+// Tags of the requests that aren't one of the commands
+#define TAG_VERSION     -1
+#define TAG_ACTIVE      -2
+#define TAG_TYPE        -3
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: sitesFootprint
+ ***
+ *** DESCRIPTION:
+ ***   Work out the memory sitesInit() needs for count endpoints.
+ ***
+ *** RETURN VALUE:
+ ***   Size in bytes.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+size_t sitesFootprint(int count)
+{
+    return ARENA_ROUND(count * sizeof(site_t)) +
+           ARENA_ROUND(count * sizeof(struct pollfd)) +
+           ARENA_ROUND(count * sizeof(int));
+}
+
+/*********************************************************************
+ *** FUNCTION: siteName
+ ***
+ *** DESCRIPTION:
+ ***   Make a directory name out of an endpoint: the host and port of
+ ***   a converter, the last part of a serial port's path.
+ ***
+ *** RETURN VALUE:
+ ***   None. The name is returned in name.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void siteName(const frEndpoint_t *ep, char *name, int size)
+{
+    const char *p = ep->spec;
+    int i;
+
+    if (ep->transport == FR_TRANSPORT_TCP)
+        p += strlen(FR_TCP_PREFIX);
+    else if (strrchr(p, '/') != NULL)
+        p = strrchr(p, '/') + 1;
+
+    for (i=0; (*p != '\0') && (i < size - 1); p++)
+    {
+        if ((*p == '[') || (*p == ']'))
+            continue;
+        name[i++] = ((*p == '/') || (*p == ':')) ? '_' : *p;
+    }
+    name[i] = '\0';
+}
+
+/*********************************************************************
+ *** FUNCTION: sitesInit
+ ***
+ *** DESCRIPTION:
+ ***   Set up the endpoints in the block of sitesFootprint() bytes at
+ ***   mem. Converters' addresses are looked up now, nothing is opened
+ ***   until the first sweep.
+ ***
+ *** RETURN VALUE:
+ ***   1 for success, 0 if an endpoint can't be understood.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int sitesInit(sites_t *s, void *mem, const char **specs, int count, int baud,
+              const unsigned char *cmds, int cmdCount)
+{
+    unsigned char *p = mem;
+    site_t *site;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->site = (site_t *)p;
+    p += ARENA_ROUND(count * sizeof(site_t));
+    s->pfd = (struct pollfd *)p;
+    p += ARENA_ROUND(count * sizeof(struct pollfd));
+    s->pfdSite = (int *)p;
+
+    s->count    = count;
+    s->baud     = baud;
+    s->cmds     = cmds;
+    s->cmdCount = (cmdCount < SITES_CMDS_MAX) ? cmdCount : SITES_CMDS_MAX;
+
+    for (i=0; i<count; i++)
+    {
+        site = &s->site[i];
+        if (frParseEndpoint(specs[i], &site->ep) != FR_OK)
+        {
+            printf("Can't use endpoint %s\n", specs[i]);
+            return 0;
+        }
+        siteName(&site->ep, site->name, sizeof(site->name));
+        frInit(&site->ctx, -1);
+        site->retryAt = 0;
+        site->status = FR_EIO;
+    }
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: siteStart
+ ***
+ *** DESCRIPTION:
+ ***   Get a site ready for a sweep, connecting first if need be, and
+ ***   queue the handshake.
+ ***
+ *** RETURN VALUE:
+ ***   1 if the sweep was started, 0 if the site is down.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int siteStart(sites_t *s, site_t *site, time_t now)
+{
+    int fd;
+    int i;
+
+    site->broken = 0;
+    site->status = FR_EIO;
+    site->active = 0;
+    site->typeId = 0xFF;
+    for (i=0; i<s->cmdCount; i++)
+        site->values[i] = NAN;
+
+    if (site->ctx.fd < 0)
+    {
+        if (now < site->retryAt)
+            return 0;
+
+        fd = frOpenEndpoint(&site->ep, s->baud);
+        if (fd < 0)
+        {
+            printf("Can't open %s: %s\n", site->ep.spec, strerror(errno));
+            site->retryAt = now + SITES_RETRY_SECS;
+            return 0;
+        }
+        frSetFd(&site->ctx, fd);
+    }
+
+    frSubmitVersion(&site->ctx, TAG_VERSION);
+    frSubmitActiveInverter(&site->ctx, TAG_ACTIVE);
+
+    return 1;
+}
+
+/*********************************************************************
+ *** FUNCTION: siteProcess
+ ***
+ *** DESCRIPTION:
+ ***   Do a site's I/O and deal with whatever requests have finished.
+ ***   Once an inverter is found to be on, the rest of the sweep is
+ ***   queued behind it.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static void siteProcess(sites_t *s, site_t *site)
+{
+    frCompletion_t c;
+    int i;
+
+    frProcess(&site->ctx);
+    while (frComplete(&site->ctx, &c))
+    {
+        if (c.status == FR_EIO)
+            site->broken = 1;
+
+        switch (c.req.tag)
+        {
+            case TAG_VERSION:
+            {
+                if (c.status != FR_OK)
+                    break;
+                site->major   = c.u.version.major;
+                site->minor   = c.u.version.minor;
+                site->release = c.u.version.release;
+            }
+            break;
+
+            case TAG_ACTIVE:
+            {
+                site->status = c.status;
+                if ((c.status != FR_OK) || (c.u.active == 0))
+                    break;
+
+                site->active = c.u.active;
+                frSubmitDeviceType(&site->ctx, site->active, TAG_TYPE);
+                for (i=0; i<s->cmdCount; i++)
+                    frSubmitNumeric(&site->ctx, site->active, s->cmds[i], i);
+            }
+            break;
+
+            case TAG_TYPE:
+            {
+                if (c.status == FR_OK)
+                    site->typeId = c.u.typeId;
+            }
+            break;
+
+            default:
+            {
+                if (c.status != FR_OK)
+                    break;
+                site->values[c.req.tag] = c.u.value;
+                site->stamps[c.req.tag] = c.at;
+            }
+            break;
+        }
+    }
+
+    // Nothing more will get through, so don't wait for the rest
+    if (site->broken)
+        frSetFd(&site->ctx, site->ctx.fd);
+}
+
+/*********************************************************************
+ *** FUNCTION: msSince
+ ***
+ *** DESCRIPTION:
+ ***   Work out the time since a point on the monotonic clock.
+ ***
+ *** RETURN VALUE:
+ ***   Milliseconds.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static int msSince(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*********************************************************************
+ *** FUNCTION: sitesSweep
+ ***
+ *** DESCRIPTION:
+ ***   Sweep every site at once. Returns when they've all finished or
+ ***   budgetMs has gone by, whatever is left over is dropped.
+ ***
+ *** RETURN VALUE:
+ ***   None. Each site's results are in its site_t.
+ ***
+ *** SIDE EFFECTS:
+ ***   Connections that failed are closed, to be opened again on a
+ ***   later sweep.
+ *********************************************************************/
+void sitesSweep(sites_t *s, int budgetMs)
+{
+    struct timespec start;
+    site_t *site;
+    time_t now = time(NULL);
+    int n, i, k, t, timeout;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i=0; i<s->count; i++)
+    {
+        if (siteStart(s, &s->site[i], now))
+            siteProcess(s, &s->site[i]);
+    }
+
+    for ( ; ; )
+    {
+        timeout = budgetMs - msSince(&start);
+        if (timeout <= 0)
+            break;
+
+        // Wait on every site with something on the wire. Any whose
+        // request has timed out is dealt with first.
+        n = 0;
+        for (i=0; i<s->count; i++)
+        {
+            site = &s->site[i];
+            if (frPending(&site->ctx) == 0)
+                continue;
+
+            t = frTimeout(&site->ctx);
+            if (t == 0)
+            {
+                siteProcess(s, site);
+                if (frPending(&site->ctx) == 0)
+                    continue;
+                t = frTimeout(&site->ctx);
+            }
+
+            s->pfd[n].fd = site->ctx.fd;
+            s->pfd[n].events = frEvents(&site->ctx);
+            s->pfd[n].revents = 0;
+            s->pfdSite[n] = i;
+            n++;
+            if ((t >= 0) && (t < timeout))
+                timeout = t;
+        }
+        if (n == 0)
+            break;
+
+        if (poll(s->pfd, n, timeout) < 0)
+        {
+            if (errno != EINTR)
+                break;
+            continue;
+        }
+
+        for (k=0; k<n; k++)
+        {
+            if (s->pfd[k].revents != 0)
+                siteProcess(s, &s->site[s->pfdSite[k]]);
+        }
+    }
+
+    // Drop what didn't make it in time, and hang up on the sites that
+    // failed
+    for (i=0; i<s->count; i++)
+    {
+        site = &s->site[i];
+        if (site->ctx.fd < 0)
+            continue;
+
+        if (site->broken)
+        {
+            printf("Lost %s\n", site->ep.spec);
+            close(site->ctx.fd);
+            frSetFd(&site->ctx, -1);
+            site->retryAt = now + SITES_RETRY_SECS;
+        }
+        else if (frPending(&site->ctx) != 0)
+        {
+            frSetFd(&site->ctx, site->ctx.fd);
+        }
+    }
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
@@ -0,0 +1,85 @@
+/*********************************************************************
+ *** FILE: sites.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef SITES_H
+#define SITES_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+
+/* INCLUDE FILES */
+#include "fronius.h"
+
+/* DEFINES */
+
+// Most endpoints one process polls
+#define SITES_MAX           1024
+
+// Most commands a sweep sends each inverter. The handshake and device
+// type come on top, and it all has to fit the context's queue.
+#define SITES_CMDS_MAX      (FR_QUEUE_LEN - 3)
+
+// Time to wait before connecting again to an endpoint that failed
+#define SITES_RETRY_SECS    60
+
+// Longest name of a site's directory
+#define SITES_NAME_MAX      64
+
+/* TYPEDEFS */
+
+// One endpoint and what the last sweep got from it
+typedef struct
+{
+    frEndpoint_t  ep;
+    char          name[SITES_NAME_MAX];   // Directory name, from the endpoint
+    frCtx_t       ctx;                    // ctx.fd is -1 while not connected
+    time_t        retryAt;                // When to connect again
+    int           broken;                 // The connection failed this sweep
+    int           status;                 // FR_OK if the inverter answered
+    unsigned char major;                  // Interface card version
+    unsigned char minor;
+    unsigned char release;
+    unsigned char active;                 // Inverter number, 0 if none
+    unsigned char typeId;
+    float         values[SITES_CMDS_MAX]; // NaN for those that failed
+    frStamp_t     stamps[SITES_CMDS_MAX]; // When each value came in
+} site_t;
+
+// Every endpoint, swept at the same time
+typedef struct
+{
+    site_t              *site;
+    int                  count;
+    int                  baud;      // For the serial ports among them
+    const unsigned char *cmds;
+    int                  cmdCount;
+    struct pollfd       *pfd;
+    int                 *pfdSite;   // Site each pfd entry is for
+} sites_t;
+
+/* FUNCTION PROTOTYPES */
+size_t sitesFootprint(int count);
+int    sitesInit(sites_t *s, void *mem, const char **specs, int count, int baud,
+                 const unsigned char *cmds, int cmdCount);
+void   sitesSweep(sites_t *s, int budgetMs);
+
+#endif // SITES_H
@@ -0,0 +1,299 @@
+/*********************************************************************
+ *** FILE: store.c
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+/* SYSTEM INCLUDE FILES */
+#include <string.h>
+#include <math.h>
+
+/* INCLUDE FILES */
+#include "store.h"
+
+/* DEFINES */
+
+// Each array starts on a cache line, so is padded out to a whole number
+// of them
+#define STORE_ALIGN(n)  (((n) + 63) & ~(size_t)63)
+
+/* FUNCTIONS */
+/*********************************************************************
+ *** FUNCTION: storeFootprint
+ ***
+ *** DESCRIPTION:
+ ***   Work out how much memory a store needs.
+ ***
+ *** RETURN VALUE:
+ ***   Size in bytes of the block to pass to storeAttach().
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+size_t storeFootprint(uint32_t capacity, uint32_t metrics)
+{
+    return STORE_ALIGN(sizeof(storeHeader_t)) +
+           STORE_ALIGN((size_t)capacity * sizeof(int64_t)) +
+           (size_t)metrics * STORE_ALIGN((size_t)capacity * sizeof(float));
+}
+
+/*********************************************************************
+ *** FUNCTION: storeAttach
+ ***
+ *** DESCRIPTION:
+ ***   Set up a store in a block of storeFootprint() bytes. If the block
+ ***   already holds a store with the same layout, its samples are kept.
+ ***
+ *** RETURN VALUE:
+ ***   1 if existing samples were kept, 0 if the store starts empty.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int storeAttach(store_t *s, void *mem, uint32_t capacity, uint32_t metrics)
+{
+    unsigned char *p = mem;
+    storeHeader_t *hdr = mem;
+
+    s->hdr = hdr;
+    p += STORE_ALIGN(sizeof(storeHeader_t));
+    s->t = (int64_t *)p;
+    p += STORE_ALIGN((size_t)capacity * sizeof(int64_t));
+    s->v = (float *)p;
+    s->stride = STORE_ALIGN((size_t)capacity * sizeof(float)) / sizeof(float);
+
+    if ((hdr->magic == STORE_MAGIC) && (hdr->version == STORE_VERSION) &&
+        (hdr->capacity == capacity) && (hdr->metrics == metrics) &&
+        (hdr->head < capacity) && (hdr->count <= capacity))
+    {
+        return 1;
+    }
+
+    hdr->magic    = STORE_MAGIC;
+    hdr->version  = STORE_VERSION;
+    hdr->capacity = capacity;
+    hdr->metrics  = metrics;
+    storeClear(s);
+
+    return 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: storeClear
+ ***
+ *** DESCRIPTION:
+ ***   Throw away all samples.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void storeClear(store_t *s)
+{
+    s->hdr->head  = 0;
+    s->hdr->count = 0;
+}
+
+/*********************************************************************
+ *** FUNCTION: slot
+ ***
+ *** DESCRIPTION:
+ ***   Map a sample index, 0 being the oldest sample kept, to its slot
+ ***   in the rings.
+ ***
+ *** RETURN VALUE:
+ ***   The slot.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+static uint32_t slot(const store_t *s, int i)
+{
+    uint32_t cap = s->hdr->capacity;
+
+    return (s->hdr->head + cap - s->hdr->count + i) % cap;
+}
+
+/*********************************************************************
+ *** FUNCTION: storeAppend
+ ***
+ *** DESCRIPTION:
+ ***   Add a sample of every metric, overwriting the oldest sample once
+ ***   the store is full. Times must not go backwards; a sample older
+ ***   than the newest one is stamped with the newest time instead.
+ ***
+ *** RETURN VALUE:
+ ***   None.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+void storeAppend(store_t *s, int64_t t, const float *values)
+{
+    storeHeader_t *hdr = s->hdr;
+    uint32_t m;
+
+    if (hdr->capacity == 0)
+        return;
+
+    if ((hdr->count > 0) && (t < storeTime(s, hdr->count - 1)))
+        t = storeTime(s, hdr->count - 1);
+
+    s->t[hdr->head] = t;
+    for (m=0; m<hdr->metrics; m++)
+        s->v[m * s->stride + hdr->head] = values[m];
+
+    hdr->head = (hdr->head + 1) % hdr->capacity;
+    if (hdr->count < hdr->capacity)
+        hdr->count++;
+}
+
+/*********************************************************************
+ *** FUNCTION: storeCount
+ ***
+ *** DESCRIPTION:
+ ***   Get the number of samples kept.
+ ***
+ *** RETURN VALUE:
+ ***   Number of samples.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int storeCount(const store_t *s)
+{
+    return s->hdr->count;
+}
+
+/*********************************************************************
+ *** FUNCTION: storeFind
+ ***
+ *** DESCRIPTION:
+ ***   Binary search for the first sample taken at or after time t.
+ ***
+ *** RETURN VALUE:
+ ***   Index of the sample, storeCount() if there is none.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int storeFind(const store_t *s, int64_t t)
+{
+    int lo = 0;
+    int hi = s->hdr->count;
+    int mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (s->t[slot(s, mid)] < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*********************************************************************
+ *** FUNCTION: storeTime
+ ***
+ *** DESCRIPTION:
+ ***   Get the time of a sample.
+ ***
+ *** RETURN VALUE:
+ ***   Time in ms since the epoch.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int64_t storeTime(const store_t *s, int i)
+{
+    return s->t[slot(s, i)];
+}
+
+/*********************************************************************
+ *** FUNCTION: storeValue
+ ***
+ *** DESCRIPTION:
+ ***   Get one metric of a sample.
+ ***
+ *** RETURN VALUE:
+ ***   The value, NaN if it couldn't be read.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+float storeValue(const store_t *s, int metric, int i)
+{
+    return s->v[metric * s->stride + slot(s, i)];
+}
+
+/*********************************************************************
+ *** FUNCTION: storeAverage
+ ***
+ *** DESCRIPTION:
+ ***   Average one metric over the samples taken from time from up to,
+ ***   but not including, time to. Missing values are skipped.
+ ***
+ *** RETURN VALUE:
+ ***   Number of values averaged. The average is returned in avg if
+ ***   that's more than 0.
+ ***
+ *** SIDE EFFECTS:
+ ***   None.
+ *********************************************************************/
+int storeAverage(const store_t *s, int metric, int64_t from, int64_t to, float *avg)
+{
+    const float *v = &s->v[metric * s->stride];
+    double sum = 0;
+    int n = 0;
+    int i;
+    uint32_t k;
+
+    for (i = storeFind(s, from); i < s->hdr->count; i++)
+    {
+        k = slot(s, i);
+        if (s->t[k] >= to)
+            break;
+        if (!isnan(v[k]))
+        {
+            sum += v[k];
+            n++;
+        }
+    }
+
+    if (n > 0)
+        *avg = sum / n;
+
+    return n;
+}
+
+/*********************************************************************
+ *** EDIT HISTORY FOR FILE
+ ***
+ *** This section contains comments describing changes made to the module.
+ *** Notice that changes are listed in reverse chronological order.
+ *** Comments are pasted here automatically by CVS, extracted from user
+ *** text comments entered during cvs commit operations.
+ ***
+ *** Copyright (c) 2009 by Jeremy Simmons
+ ***
+ *** $Log$
+ *********************************************************************/
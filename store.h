@@ -0,0 +1,68 @@
+/*********************************************************************
+ *** FILE: store.h
+ ***
+ *** Copyright (C)  2009 by Jeremy Simmons
+ ***
+ *** This program is free software: you can redistribute it and/or modify
+ *** it under the terms of the GNU General Public License as published by
+ *** the Free Software Foundation, either version 3 of the License, or
+ *** (at your option) any later version.
+ ***
+ *** This program is distributed in the hope that it will be useful,
+ *** but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *** GNU General Public License for more details.
+ ***
+ *** You should have received a copy of the GNU General Public License
+ *** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ***
+ *********************************************************************/
+
+#ifndef STORE_H
+#define STORE_H
+
+/* SYSTEM INCLUDE FILES */
+#include <stdint.h>
+#include <stddef.h>
+
+/* DEFINES */
+#define STORE_MAGIC     0x45524f54  // "TORE"
+#define STORE_VERSION   2
+
+/* TYPEDEFS */
+
+// Fixed size store of the most recent samples, one ring per metric.
+// It lives in a single block of memory laid out as the header, the
+// sample times, then one array of values per metric, so a query over
+// one metric only touches that metric's array. The block holds no
+// pointers and can be kept anywhere.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;  // Samples kept per metric
+    uint32_t metrics;   // Number of metrics
+    uint32_t head;      // Slot the next sample goes in
+    uint32_t count;     // Number of samples kept, up to capacity
+} storeHeader_t;
+
+typedef struct
+{
+    storeHeader_t *hdr;
+    int64_t       *t;   // Sample times, ms since the epoch
+    float         *v;   // Values, metric * stride + slot. NaN if missing.
+    size_t         stride;  // Floats from one metric's array to the next
+} store_t;
+
+/* FUNCTION PROTOTYPES */
+size_t  storeFootprint(uint32_t capacity, uint32_t metrics);
+int     storeAttach(store_t *s, void *mem, uint32_t capacity, uint32_t metrics);
+void    storeClear(store_t *s);
+void    storeAppend(store_t *s, int64_t t, const float *values);
+int     storeCount(const store_t *s);
+int     storeFind(const store_t *s, int64_t t);
+int64_t storeTime(const store_t *s, int i);
+float   storeValue(const store_t *s, int metric, int i);
+int     storeAverage(const store_t *s, int metric, int64_t from, int64_t to, float *avg);
+
+#endif // STORE_H